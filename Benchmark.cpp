@@ -0,0 +1,124 @@
+//
+// Created on 10/16/26.
+//
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <time.h>
+#include "Benchmark.h"
+#include "MonotonicClock.h"
+
+Benchmark::Benchmark(const long min_time_ms):
+	mMinTimeMs(min_time_ms) {
+}
+
+// op returns the payload bytes it moved, 0 for pure CPU work. One untimed call warms caches and connections up.
+BenchmarkResult Benchmark::run(const std::string &name, const long ops_per_call, Operation op) const {
+	op();
+
+	long long bytes = 0;
+	long calls = 0;
+	const long long syscalls_start = threadSyscalls();
+	const long long cpu_start = threadCpuNanos();
+	const long long start = MonotonicClock::now();
+	const long long deadline = start + mMinTimeMs * 1000000LL;
+	long long now = start;
+	while (now < deadline || calls == 0) {
+		bytes += op();
+		calls++;
+		now = MonotonicClock::now();
+	}
+	const long long cpu = threadCpuNanos() - cpu_start;
+	const long long syscalls = threadSyscalls() - syscalls_start;
+	const double ops = static_cast<double>(calls) * ops_per_call;
+	const double elapsed_s = static_cast<double>(now - start) / 1e9;
+
+	BenchmarkResult result = BenchmarkResult();
+	result.name = name;
+	result.iterations = calls;
+	result.ns_per_op = static_cast<double>(now - start) / ops;
+	result.bytes_per_s = bytes / elapsed_s;
+	result.syscalls_per_op = syscalls < 0 ? -1 : syscalls / ops;
+	result.cpu_s_per_gbit = bytes > 0 ? (cpu / 1e9) / (bytes * 8 / 1e9) : 0;
+	return result;
+}
+
+void Benchmark::writeJson(const std::vector<BenchmarkResult> &results, std::ostream &out) {
+	out << "{\"benchmarks\": [" << std::endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		auto &r = results[i];
+		out << std::fixed << std::setprecision(3)
+			<< "{\"name\": \"" << r.name << "\""
+			<< ", \"iterations\": " << r.iterations
+			<< ", \"ns_per_op\": " << r.ns_per_op
+			<< ", \"bytes_per_s\": " << r.bytes_per_s
+			<< ", \"syscalls_per_op\": " << r.syscalls_per_op
+			<< std::setprecision(6)
+			<< ", \"cpu_s_per_gbit\": " << r.cpu_s_per_gbit
+			<< "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	out << "]}" << std::endl;
+}
+
+static bool jsonNumber(const std::string &line, const std::string &key, double &value) {
+	auto pos = line.find("\"" + key + "\": ");
+	if (pos == std::string::npos)
+		return false;
+	value = std::strtod(line.c_str() + pos + key.length() + 4, nullptr);
+	return true;
+}
+
+// It reads back the one-benchmark-per-line layout produced by writeJson
+bool Benchmark::loadBaseline(const std::string &path, std::map<std::string, BenchmarkResult> &baseline) {
+	std::ifstream in(path);
+	if (!in)
+		return false;
+	std::string line;
+	while (std::getline(in, line)) {
+		auto start = line.find("{\"name\": \"");
+		if (start == std::string::npos)
+			continue;
+		start += 10;
+		auto end = line.find('"', start);
+		if (end == std::string::npos)
+			continue;
+		BenchmarkResult r = BenchmarkResult();
+		r.name = line.substr(start, end - start);
+		double iterations = 0;
+		jsonNumber(line, "iterations", iterations);
+		r.iterations = static_cast<long>(iterations);
+		jsonNumber(line, "ns_per_op", r.ns_per_op);
+		jsonNumber(line, "bytes_per_s", r.bytes_per_s);
+		jsonNumber(line, "syscalls_per_op", r.syscalls_per_op);
+		jsonNumber(line, "cpu_s_per_gbit", r.cpu_s_per_gbit);
+		baseline[r.name] = r;
+	}
+	return true;
+}
+
+long long Benchmark::threadCpuNanos() {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Read and write family syscalls issued by the calling thread so far (syscr + syscw of
+// /proc/thread-self/io), or -1 where the kernel does not expose them
+long long Benchmark::threadSyscalls() {
+	std::ifstream io("/proc/thread-self/io");
+	if (!io)
+		return -1;
+	long long total = 0;
+	bool found = false;
+	std::string key;
+	long long value;
+	while (io >> key >> value) {
+		if (key == "syscr:" || key == "syscw:") {
+			total += value;
+			found = true;
+		}
+	}
+	return found ? total : -1;
+}
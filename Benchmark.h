@@ -0,0 +1,31 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_BENCHMARK_H
+#define SPEEDTEST_BENCHMARK_H
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "DataTypes.h"
+
+// Minimal benchmark harness. An operation is repeated until min_time_ms of wall time
+// has passed; wall time, CPU time and read/write syscalls of the calling thread are
+// sampled around the whole run. Results serialize to JSON, one benchmark per line,
+// and can be compared against a baseline written by a previous run.
+class Benchmark {
+public:
+	typedef std::function<long long()> Operation;
+
+	explicit Benchmark(const long min_time_ms);
+	BenchmarkResult run(const std::string &name, const long ops_per_call, Operation op) const;
+	static void writeJson(const std::vector<BenchmarkResult> &results, std::ostream &out);
+	static bool loadBaseline(const std::string &path, std::map<std::string, BenchmarkResult> &baseline);
+	static long long threadCpuNanos();
+	static long long threadSyscalls();
+private:
+	long mMinTimeMs;
+};
+#endif // SPEEDTEST_BENCHMARK_H
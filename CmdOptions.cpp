@@ -0,0 +1,220 @@
+//
+// Created by Francesco Laurita on 9/9/16.
+//
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include "CmdOptions.h"
+#include "SpeedTest.h"
+
+static struct option CmdLongOptions[] = {
+	{"help",        no_argument,       0, 'h' },
+	{"latency",     no_argument,       0, 'l' },
+	{"download",    no_argument,       0, 'd' },
+	{"upload",      no_argument,       0, 'u' },
+	{"share",       no_argument,       0, 's' },
+	{"test-server", required_argument, 0, 't' },
+	{"serverid",    required_argument, 0, 'i' },
+	{"output",      required_argument, 0, 'o' },
+	{"engine",      required_argument, 0, 'e' },
+	{"mode",        required_argument, 0, 'm' },
+	{"preflight",   no_argument,       0, 'p' },
+	{"tolerance",   required_argument, 0, 'c' },
+	{"cache-ttl",   required_argument, 0, 'a' },
+	{"daemon",      no_argument,       0, 'D' },
+	{"interval",    required_argument, 0, 'I' },
+	{"interval-jitter", required_argument, 0, 'J' },
+	{"metrics",     required_argument, 0, 'M' },
+	{"multi-server", required_argument, 0, 'k' },
+	{"source",      required_argument, 0, 'b' },
+	{"interface",   required_argument, 0, 'f' },
+	{"mark",        required_argument, 0, 'r' },
+	{"pin-cpus",    no_argument,       0, 'C' },
+	{"packet-loss", no_argument,       0, 'L' },
+	{"loaded-latency", no_argument,    0, 'B' },
+	{"udp-rate",    required_argument, 0, 'U' },
+	{0,             0,                 0,  0  }
+};
+
+static const char *optStr = "hlduspt:i:o:e:m:c:a:DI:J:M:k:b:f:r:CLU:B";
+
+// The whole argument must be a number, atof would read "0,05" as 0
+static bool parseDouble(const char *arg, double &value) {
+	char *end = nullptr;
+	value = std::strtod(arg, &end);
+	return end != arg && *end == '\0';
+}
+
+// Same for whole numbers, atol would read "1h" as 1
+static bool parseLong(const char *arg, long &value) {
+	char *end = nullptr;
+	errno = 0;
+	value = std::strtol(arg, &end, 10);
+	return end != arg && *end == '\0' && errno == 0;
+}
+
+bool ParseOptions(const int argc, const char **argv, ProgramOptions& options) {
+	int long_index = 0;
+	int opt = 0;
+	while ( (opt = getopt_long(argc, (char **)argv, optStr, CmdLongOptions, &long_index)) != -1 ) {
+		switch (opt) {
+			case 'h':
+				options.help     = true;
+				break;
+			case 'l':
+				options.latency  = true;
+				break;
+			case 'd':
+				options.download = true;
+				break;
+			case 'u':
+				options.upload   = true;
+				break;
+			case 's':
+				options.share    = true;
+				break;
+			case 'p':
+				options.preflight = true;
+				break;
+			case 'C':
+				options.pin_cpus = true;
+				break;
+			case 'L':
+				options.packet_loss = true;
+				break;
+			case 'B':
+				options.loaded_latency = true;
+				break;
+			case 'U':
+				options.udp_rate = std::atol((char*)optarg);
+				if (options.udp_rate < 1) {
+					std::cerr << "Unsupported UDP rate " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 't':
+				options.selected_server.append(optarg);
+				break;
+			case 'i':
+				options.selected_serverid = std::atoi((char*)optarg);
+				break;
+			case 'o':
+				if (strcmp(optarg, "verbose") == 0)
+					options.output_type = OutputType::verbose;
+				else if (strcmp(optarg, "text") == 0)
+					options.output_type = OutputType::text;
+				else {
+					std::cerr << "Unsupported output type " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'e':
+				if (strcmp(optarg, "threads") == 0)
+					options.engine = TransferEngine::threads;
+				else if (strcmp(optarg, "epoll") == 0)
+					options.engine = TransferEngine::epoll;
+				else if (strcmp(optarg, "uring") == 0)
+					options.engine = TransferEngine::uring;
+				else {
+					std::cerr << "Unsupported transfer engine " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'c':
+				if (!parseDouble(optarg, options.tolerance) || options.tolerance < 0) {
+					std::cerr << "Unsupported convergence tolerance " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'a':
+				if (!parseLong(optarg, options.cache_ttl) || options.cache_ttl < 0) {
+					std::cerr << "Unsupported cache TTL " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'b':
+				options.sources = SpeedTest::splitString(optarg, ',');
+				break;
+			case 'f':
+				options.devices = SpeedTest::splitString(optarg, ',');
+				break;
+			case 'r': {
+				long mark = 0;
+				if (!parseLong(optarg, mark) || mark < 0 || mark > INT_MAX) {
+					std::cerr << "Unsupported routing mark " << optarg << std::endl;
+					return false;
+				}
+				options.mark = static_cast<int>(mark);
+				break;
+			}
+			case 'k':
+				options.multi_server = std::atoi((char*)optarg);
+				if (options.multi_server < 1) {
+					std::cerr << "Unsupported server count " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'D':
+				options.daemon = true;
+				break;
+			case 'I':
+				options.interval = std::atol((char*)optarg);
+				if (options.interval < 1) {
+					std::cerr << "Unsupported interval " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'J':
+				if (!parseDouble(optarg, options.interval_jitter) || options.interval_jitter < 0 || options.interval_jitter >= 1) {
+					std::cerr << "Unsupported interval jitter " << optarg << std::endl;
+					return false;
+				}
+				break;
+			case 'M': {
+				std::string listen(optarg);
+				auto colon = listen.rfind(':');
+				if (colon == std::string::npos) {
+					std::cerr << "Unsupported metrics address " << optarg << std::endl;
+					return false;
+				}
+				long port = 0;
+				if (!parseLong(listen.c_str() + colon + 1, port) || port < 1 || port > 65535) {
+					std::cerr << "Unsupported metrics port " << optarg << std::endl;
+					return false;
+				}
+				options.metrics_address = listen.substr(0, colon);
+				options.metrics_port = static_cast<int>(port);
+				break;
+			}
+			case 'm':
+				if (strcmp(optarg, "chunked") == 0)
+					options.mode = TransferMode::chunked;
+				else if (strcmp(optarg, "streaming") == 0)
+					options.mode = TransferMode::streaming;
+				else {
+					std::cerr << "Unsupported transfer mode " << optarg << std::endl;
+					return false;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+	if (options.sources.size() > 1 && options.devices.size() > 1 && options.sources.size() != options.devices.size()) {
+		std::cerr << "Every --source address needs its own --interface" << std::endl;
+		return false;
+	}
+	// Pipelined requests only exist on blocking sockets
+	if (options.mode == TransferMode::streaming && options.engine != TransferEngine::threads) {
+		std::cerr << "--mode streaming needs --engine threads" << std::endl;
+		return false;
+	}
+	if (options.daemon && (options.sources.size() > 1 || options.devices.size() > 1)) {
+		std::cerr << "Daemon mode runs on a single uplink" << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -4,7 +4,10 @@
 
 #ifndef SPEEDTEST_CMDOPTIONS_H
 #define SPEEDTEST_CMDOPTIONS_H
-#include <getopt.h>
+#include <string>
+#include <vector>
+#include "SpeedTestConfig.h"
+#include "DataTypes.h"
 
 enum OutputType { verbose, text };
 
@@ -14,65 +17,28 @@ typedef struct program_options_t {
 	bool download = false;
 	bool upload   = false;
 	bool share    = false;
+	bool preflight = false;
 	std::string selected_server = "";
 	int selected_serverid = -1;
+	int multi_server = 1;
+	std::vector<std::string> sources;
+	std::vector<std::string> devices;
+	int mark = 0;
+	bool pin_cpus = false;
+	bool packet_loss = false;
+	bool loaded_latency = false;
+	long udp_rate = 0;
 	OutputType output_type = OutputType::verbose;
+	TransferEngine engine = TransferEngine::threads;
+	TransferMode mode = TransferMode::chunked;
+	double tolerance = SPEED_TEST_CONVERGENCE_TOLERANCE;
+	long cache_ttl = SPEED_TEST_SERVER_CACHE_TTL;
+	bool daemon = false;
+	long interval = SPEED_TEST_DAEMON_INTERVAL;
+	double interval_jitter = SPEED_TEST_DAEMON_INTERVAL_JITTER;
+	std::string metrics_address = "127.0.0.1";
+	int metrics_port = SPEED_TEST_METRICS_PORT;
 } ProgramOptions;
 
-static struct option CmdLongOptions[] = {
-	{"help",        no_argument,       0, 'h' },
-	{"latency",     no_argument,       0, 'l' },
-	{"download",    no_argument,       0, 'd' },
-	{"upload",      no_argument,       0, 'u' },
-	{"share",       no_argument,       0, 's' },
-	{"test-server", required_argument, 0, 't' },
-	{"serverid",    required_argument, 0, 'i' },
-	{"output",      required_argument, 0, 'o' },
-	{0,             0,                 0,  0  }
-};
-
-const char *optStr = "hldust:i:o:";
-
-bool ParseOptions(const int argc, const char **argv, ProgramOptions& options) {
-	int long_index = 0;
-	int opt = 0;
-	while ( (opt = getopt_long(argc, (char **)argv, optStr, CmdLongOptions, &long_index)) != -1 ) {
-		switch (opt) {
-			case 'h':
-				options.help     = true;
-				break;
-			case 'l':
-				options.latency  = true;
-				break;
-			case 'd':
-				options.download = true;
-				break;
-			case 'u':
-				options.upload   = true;
-				break;
-			case 's':
-				options.share    = true;
-				break;
-			case 't':
-				options.selected_server.append(optarg);
-				break;
-			case 'i':
-				options.selected_serverid = std::atoi((char*)optarg);
-				break;
-			case 'o':
-				if (strcmp(optarg, "verbose") == 0)
-					options.output_type = OutputType::verbose;
-				else if (strcmp(optarg, "text") == 0)
-					options.output_type = OutputType::text;
-				else {
-					std::cerr << "Unsupported output type " << optarg << std::endl;
-					return false;
-				}
-				break;
-			default:
-				return false;
-		}
-	}
-	return true;
-}
+bool ParseOptions(const int argc, const char **argv, ProgramOptions& options);
 #endif // SPEEDTEST_CMDOPTIONS_H
\ No newline at end of file
@@ -0,0 +1,119 @@
+//
+// Created on 10/16/26.
+//
+
+#include "ConnectionPool.h"
+#include "SpeedTestClient.h"
+
+ConnectionPool::ConnectionPool(size_t capacity):
+	mSocketOptions(),
+	mCapacity(capacity),
+	mWarming(0) {
+}
+
+ConnectionPool::~ConnectionPool() {
+	clear();
+}
+
+// Connections to any other server are closed
+void ConnectionPool::setServer(const ServerInfo &server) {
+	if (server.host == mHost)
+		return;
+	clear();
+	std::lock_guard<std::mutex> lock(mMutex);
+	mHost = server.host;
+	mHostPort = SpeedTestClient(server).hostport();
+}
+
+// New connections are set up with options; pooled ones are closed
+void ConnectionPool::setSocketOptions(const SocketOptions &options) {
+	clear();
+	std::lock_guard<std::mutex> lock(mMutex);
+	mSocketOptions = options;
+}
+
+// It opens up to count connections in the background, one thread each, without going
+// over the pool capacity. acquire() does not wait for them.
+void ConnectionPool::warm(size_t count) {
+	join();
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mHost.empty())
+		return;
+	size_t busy = mIdle.size() + mWarming;
+	count = busy < mCapacity ? std::min(count, mCapacity - busy) : 0;
+	ServerInfo server = ServerInfo();
+	server.host = mHost;
+	SocketOptions options = mSocketOptions;
+	for (size_t i = 0; i < count; i++) {
+		mWarming++;
+		mWarmers.push_back(std::thread([this, server, options]() {
+			std::unique_ptr<SpeedTestClient> client(new SpeedTestClient(server, options));
+			bool success = client->connect();
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+				mWarming--;
+			}
+			if (success)
+				release(std::move(client));
+		}));
+	}
+}
+
+// A pooled connection when there is a live one for server, a new one otherwise. The most
+// recently used connection goes first. It returns nullptr when a new connection fails.
+std::unique_ptr<SpeedTestClient> ConnectionPool::acquire(const ServerInfo &server) {
+	SocketOptions options;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		options = mSocketOptions;
+		while (server.host == mHost && !mIdle.empty()) {
+			std::unique_ptr<SpeedTestClient> client = std::move(mIdle.back());
+			mIdle.pop_back();
+			// The server may have timed it out while it was idle
+			if (client->idle())
+				return client;
+			client->abort();
+		}
+	}
+	std::unique_ptr<SpeedTestClient> client(new SpeedTestClient(server, options));
+	if (!client->connect())
+		return nullptr;
+	return client;
+}
+
+// The connection is kept if it is still idle; otherwise, or when the pool is full or set
+// to another server, it is dropped.
+void ConnectionPool::release(std::unique_ptr<SpeedTestClient> client) {
+	if (!client)
+		return;
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mIdle.size() < mCapacity && client->hostport() == mHostPort && client->idle()) {
+		client->setTransferControl(nullptr, nullptr);
+		mIdle.push_back(std::move(client));
+		return;
+	}
+	client->abort();
+}
+
+void ConnectionPool::clear() {
+	join();
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto &client : mIdle)
+		client->close();
+	mIdle.clear();
+}
+
+size_t ConnectionPool::idle() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mIdle.size();
+}
+
+void ConnectionPool::join() {
+	std::vector<std::thread> warmers;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		warmers.swap(mWarmers);
+	}
+	for (auto &t : warmers)
+		t.join();
+}
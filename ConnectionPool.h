@@ -0,0 +1,44 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_CONNECTIONPOOL_H
+#define SPEEDTEST_CONNECTIONPOOL_H
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DataTypes.h"
+
+class SpeedTestClient;
+
+// Established, handshaken connections to the selected server, shared by the phases of a
+// test: latency, jitter and the transfer workers take a connection from the pool and give
+// it back while it is still idle, so later phases skip DNS, the TCP handshake and HI.
+// Connections that carried a transfer come back with an open congestion window, unless
+// the kernel resets it after idle (net.ipv4.tcp_slow_start_after_idle).
+class ConnectionPool {
+public:
+	explicit ConnectionPool(size_t capacity);
+	~ConnectionPool();
+	void setServer(const ServerInfo &server);
+	void setSocketOptions(const SocketOptions &options);
+	void warm(size_t count);
+	std::unique_ptr<SpeedTestClient> acquire(const ServerInfo &server);
+	void release(std::unique_ptr<SpeedTestClient> client);
+	void clear();
+	size_t idle();
+private:
+	void join();
+
+	std::string mHost;
+	SocketOptions mSocketOptions;
+	std::pair<std::string, int> mHostPort;
+	size_t mCapacity;
+	size_t mWarming;
+	std::vector<std::unique_ptr<SpeedTestClient>> mIdle;
+	std::vector<std::thread> mWarmers;
+	std::mutex mMutex;
+};
+#endif // SPEEDTEST_CONNECTIONPOOL_H
@@ -0,0 +1,249 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include "CpuAffinity.h"
+#include "MonotonicClock.h"
+#include "SpeedTestConfig.h"
+
+CpuAffinity::CpuAffinity(): mNext(0) {
+}
+
+// An empty device stands for the interface of the default route. Without readable IRQ
+// affinities the plan is every core the process may run on.
+void CpuAffinity::plan(const std::string &device) {
+	auto allowed = allowedCpus();
+	auto irq = irqCpus(device.empty() ? routeDevice() : device);
+	mCpus.clear();
+	for (auto cpu : allowed) {
+		if (std::find(irq.begin(), irq.end(), cpu) != irq.end())
+			mCpus.push_back(cpu);
+	}
+	for (auto cpu : allowed) {
+		if (std::find(mCpus.begin(), mCpus.end(), cpu) == mCpus.end())
+			mCpus.push_back(cpu);
+	}
+	mNext = 0;
+}
+
+void CpuAffinity::clear() {
+	mCpus.clear();
+	mNext = 0;
+}
+
+bool CpuAffinity::enabled() const {
+	return !mCpus.empty();
+}
+
+// The core for the next worker, -1 without a plan
+int CpuAffinity::next() {
+	if (mCpus.empty())
+		return -1;
+	return mCpus[mNext++ % mCpus.size()];
+}
+
+const std::vector<int> &CpuAffinity::cpus() const {
+	return mCpus;
+}
+
+// It pins the calling thread to cpu
+bool CpuAffinity::pin(int cpu) {
+#if defined(__linux__)
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+std::vector<int> CpuAffinity::allowedCpus() {
+	std::vector<int> cpus;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+	}
+#endif
+	if (cpus.empty()) {
+		int count = static_cast<int>(std::thread::hardware_concurrency());
+		for (int cpu = 0; cpu < std::max(count, 1); cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+// Cores that service the interrupts of device. IRQ numbers come from the MSI vectors of the
+// device in sysfs or, for drivers that name their vectors after the interface, from
+// /proc/interrupts. Only root may read some affinities; those IRQs are skipped.
+std::vector<int> CpuAffinity::irqCpus(const std::string &device) {
+	std::vector<int> cpus;
+	if (device.empty() || device.find('/') != std::string::npos)
+		return cpus;
+
+	std::vector<std::string> irqs;
+	DIR *dir = opendir(("/sys/class/net/" + device + "/device/msi_irqs").c_str());
+	if (dir) {
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != nullptr) {
+			if (entry->d_name[0] != '.')
+				irqs.push_back(entry->d_name);
+		}
+		closedir(dir);
+	}
+	if (irqs.empty()) {
+		std::ifstream interrupts("/proc/interrupts");
+		std::string line;
+		while (std::getline(interrupts, line)) {
+			std::istringstream fields(line);
+			std::string irq, field;
+			fields >> irq;
+			if (irq.empty() || irq.back() != ':')
+				continue;
+			while (fields >> field) {
+				if (field.compare(0, device.size(), device) == 0 && (field.size() == device.size() || field[device.size()] == '-')) {
+					irqs.push_back(irq.substr(0, irq.size() - 1));
+					break;
+				}
+			}
+		}
+	}
+
+	for (auto &irq : irqs) {
+		std::string list;
+		std::ifstream effective("/proc/irq/" + irq + "/effective_affinity_list");
+		if (!std::getline(effective, list) || list.empty()) {
+			std::ifstream configured("/proc/irq/" + irq + "/smp_affinity_list");
+			std::getline(configured, list);
+		}
+		for (auto cpu : parseCpuList(list)) {
+			if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+				cpus.push_back(cpu);
+		}
+	}
+	std::sort(cpus.begin(), cpus.end());
+	return cpus;
+}
+
+// Interface of the IPv4 default route, empty when there is none
+std::string CpuAffinity::routeDevice() {
+	std::ifstream route("/proc/net/route");
+	std::string line;
+	std::getline(route, line);
+	while (std::getline(route, line)) {
+		std::istringstream fields(line);
+		std::string device, destination;
+		if (fields >> device >> destination && destination == "00000000")
+			return device;
+	}
+	return "";
+}
+
+// It parses the kernel cpu list format, as in "0-3,8,10-11"
+std::vector<int> CpuAffinity::parseCpuList(const std::string &list) {
+	std::vector<int> cpus;
+	std::istringstream ranges(list);
+	std::string range;
+	while (std::getline(ranges, range, ',')) {
+		auto dash = range.find('-');
+		char *end = nullptr;
+		long first = strtol(range.c_str(), &end, 10);
+		if (end == range.c_str() || first < 0)
+			continue;
+		long last = first;
+		if (dash != std::string::npos) {
+			const char *start = range.c_str() + dash + 1;
+			last = strtol(start, &end, 10);
+			if (end == start || last < first)
+				continue;
+		}
+		for (long cpu = first; cpu <= last && cpu < 4096; cpu++)
+			cpus.push_back(static_cast<int>(cpu));
+	}
+	return cpus;
+}
+
+CpuMeter::CpuMeter():
+	mStart(),
+	mUser(0),
+	mSystem(0),
+	mPeak(0) {
+}
+
+void CpuMeter::start() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mStart = process();
+	mUser = 0;
+	mSystem = 0;
+	mPeak = 0;
+}
+
+// Workers that ran for less than one estimator window are charged but do not count for
+// the peak, their ratio is mostly noise
+void CpuMeter::add(const Sample &begin) {
+	Sample end = thread();
+	long long wall = end.wall_ns - begin.wall_ns;
+	long long user = end.user_ns - begin.user_ns;
+	long long system = end.system_ns - begin.system_ns;
+	std::lock_guard<std::mutex> lock(mMutex);
+	mUser += user;
+	mSystem += system;
+	if (wall >= SPEED_TEST_ESTIMATOR_WINDOW_MS * 1000000LL)
+		mPeak = std::max(mPeak, static_cast<double>(user + system) / wall);
+}
+
+void CpuMeter::stop(ThroughputResult &result) {
+	Sample end = process();
+	std::lock_guard<std::mutex> lock(mMutex);
+	const long long wall = end.wall_ns - mStart.wall_ns;
+	const double cores = static_cast<double>(CpuAffinity::allowedCpus().size());
+	result.cpu_user_s = static_cast<double>(mUser) / 1000000000;
+	result.cpu_system_s = static_cast<double>(mSystem) / 1000000000;
+	result.cpu_peak = mPeak;
+	result.cpu_load = wall > 0 ? (end.user_ns - mStart.user_ns + end.system_ns - mStart.system_ns) / (wall * cores) : 0;
+	result.cpu_bound = result.cpu_peak >= SPEED_TEST_CPU_SATURATION || result.cpu_load >= SPEED_TEST_CPU_SATURATION;
+}
+
+static long long toNanos(const struct timeval &tv) {
+	return static_cast<long long>(tv.tv_sec) * 1000000000LL + static_cast<long long>(tv.tv_usec) * 1000;
+}
+
+// CPU time of the calling thread. Where per-thread usage is not available it is left at 0.
+CpuMeter::Sample CpuMeter::thread() {
+	Sample sample = Sample();
+	sample.wall_ns = MonotonicClock::now();
+#if defined(RUSAGE_THREAD)
+	struct rusage usage;
+	if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+		sample.user_ns = toNanos(usage.ru_utime);
+		sample.system_ns = toNanos(usage.ru_stime);
+	}
+#endif
+	return sample;
+}
+
+CpuMeter::Sample CpuMeter::process() {
+	Sample sample = Sample();
+	sample.wall_ns = MonotonicClock::now();
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		sample.user_ns = toNanos(usage.ru_utime);
+		sample.system_ns = toNanos(usage.ru_stime);
+	}
+	return sample;
+}
@@ -0,0 +1,59 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_CPUAFFINITY_H
+#define SPEEDTEST_CPUAFFINITY_H
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "DataTypes.h"
+
+// Placement of the transfer workers. The plan lists the cores a worker may be pinned to:
+// first the cores that service the IRQs of the uplink interface, as read from /proc, so
+// that workers run where the kernel delivers their packets, then every other core the
+// process may run on. Workers take cores from the plan round robin.
+class CpuAffinity {
+public:
+	CpuAffinity();
+	void plan(const std::string &device);
+	void clear();
+	bool enabled() const;
+	int  next();
+	const std::vector<int> &cpus() const;
+	static bool pin(int cpu);
+	static std::vector<int> allowedCpus();
+	static std::vector<int> irqCpus(const std::string &device);
+	static std::string routeDevice();
+	static std::vector<int> parseCpuList(const std::string &list);
+private:
+	std::vector<int> mCpus;
+	std::atomic<unsigned> mNext;
+};
+
+// CPU time of the workers of one test. Every worker takes a thread() sample when it starts
+// and hands it to add() when it is done; stop() fills the cpu fields of the result and
+// flags it when the busiest worker or the process as a whole saturated the CPU.
+class CpuMeter {
+public:
+	typedef struct cpu_sample_t {
+		long long wall_ns;
+		long long user_ns;
+		long long system_ns;
+	} Sample;
+
+	CpuMeter();
+	void start();
+	void add(const Sample &begin);
+	void stop(ThroughputResult &result);
+	static Sample thread();
+	static Sample process();
+private:
+	Sample mStart;
+	long long mUser;
+	long long mSystem;
+	double mPeak;
+	std::mutex mMutex;
+};
+#endif // SPEEDTEST_CPUAFFINITY_H
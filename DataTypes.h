@@ -7,9 +7,14 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <vector>
 
 static const float EARTH_RADIUS_KM = 6371.0;
 
+enum TransferEngine { threads, epoll, uring };
+
+enum TransferMode { chunked, streaming };
+
 typedef struct ip_info_t {
 	std::string ip_address;
 	std::string isp;
@@ -30,6 +35,31 @@ typedef struct server_info_t {
 	float distance;
 } ServerInfo;
 
+typedef struct latency_stats_t {
+	long long count;
+	long long min;
+	long long max;
+	double    mean;
+	double    stddev;
+	long long p50;
+	long long p90;
+	long long p99;
+	long long p999;
+} LatencyStats;
+
+typedef struct ping_sample_t {
+	long long sent_ns;
+	long long rtt_ns;
+} PingSample;
+
+typedef struct server_latency_t {
+	ServerInfo server;
+	long long min;
+	long long max;
+	double    avg;
+	int       samples;
+} ServerLatency;
+
 typedef struct test_config_t {
 	long start_size;
 	long max_size;
@@ -39,4 +69,155 @@ typedef struct test_config_t {
 	int  concurrency;
 	std::string label;
 } TestConfig;
+
+typedef struct latency_sample_t {
+	long long offset_ns;
+	long long rtt_ns;
+	double    mbps;
+} LatencySample;
+
+typedef struct loaded_latency_t {
+	int       samples;
+	int       timeouts;
+	long long idle;
+	long long p50;
+	long long p90;
+	long long p99;
+	long long max;
+	long long increase;
+	std::vector<LatencySample> timeline;
+} LoadedLatency;
+
+typedef struct throughput_result_t {
+	double speed;
+	double lower;
+	double upper;
+	bool   bounded;
+	int    windows;
+	bool   converged;
+	double cpu_user_s;
+	double cpu_system_s;
+	double cpu_peak;
+	double cpu_load;
+	bool   cpu_bound;
+	LoadedLatency loaded;
+} ThroughputResult;
+
+typedef struct adaptive_config_t {
+	int    start_concurrency;
+	int    max_concurrency;
+	long   start_buff_size;
+	long   max_buff_size;
+	long   request_size;
+	long   step_ms;
+	double min_gain;
+	long   hold_time_ms;
+	std::string label;
+} AdaptiveConfig;
+
+typedef struct udp_probe_config_t {
+	long   rate_pps;
+	int    packet_size;
+	long   duration_ms;
+	int    batch;
+	long   drain_ms;
+	std::string label;
+} UdpProbeConfig;
+
+typedef struct udp_probe_result_t {
+	long   sent;
+	long   received;
+	long   lost;
+	long   reordered;
+	long   duplicated;
+	long   client_dropped;
+	double loss;
+	long long jitter;
+	long long rtt_min;
+	long long rtt_avg;
+	long long rtt_max;
+} UdpProbeResult;
+
+typedef struct socket_options_t {
+	std::string source_address;
+	std::string device;
+	int    mark;
+} SocketOptions;
+
+typedef struct server_throughput_t {
+	ServerInfo server;
+	int    streams;
+	double speed;
+} ServerThroughput;
+
+typedef struct runner_options_t {
+	bool latency;
+	bool download;
+	bool upload;
+	bool share;
+	bool preflight;
+	std::string selected_server;
+	int    selected_serverid;
+	int    sample_size;
+	int    multi_server;
+	SocketOptions socket;
+	bool   pin_cpus;
+	bool   loaded_latency;
+	bool   packet_loss;
+	long   udp_rate;
+	TransferEngine engine;
+	TransferMode   mode;
+	double tolerance;
+	long   cache_ttl;
+} RunnerOptions;
+
+typedef struct speed_test_report_t {
+	IPInfo     ip_info;
+	size_t     server_count;
+	ServerInfo server;
+	long long  latency;
+	long long  jitter;
+	LatencyStats latency_stats;
+	UdpProbeResult packet_loss;
+	TestConfig preflight_config;
+	double     preflight_speed;
+	TestConfig download_config;
+	TestConfig upload_config;
+	ThroughputResult download;
+	ThroughputResult upload;
+	std::vector<ServerThroughput> download_servers;
+	std::vector<ServerThroughput> upload_servers;
+	std::string share_url;
+	std::string error;
+} SpeedTestReport;
+
+typedef struct daemon_config_t {
+	RunnerOptions runner;
+	long   interval_s;
+	double interval_jitter;
+	std::string metrics_address;
+	int    metrics_port;
+} DaemonConfig;
+
+typedef struct server_config_t {
+	std::string bind_address;
+	int    port;
+	int    threads;
+	std::string version;
+	long   latency_us;
+	double rate_mbps;
+	double reset_rate;
+	double stall_rate;
+	double garbage_rate;
+	double udp_loss_rate;
+} ServerConfig;
+
+typedef struct benchmark_result_t {
+	std::string name;
+	long   iterations;
+	double ns_per_op;
+	double bytes_per_s;
+	double syscalls_per_op;
+	double cpu_s_per_gbit;
+} BenchmarkResult;
 #endif // SPEEDTEST_DATATYPES_H
\ No newline at end of file
@@ -0,0 +1,461 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#if defined(__linux__)
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#endif
+#include "EpollTransferEngine.h"
+#include "SpeedTestClient.h"
+#include "MonotonicClock.h"
+
+EpollTransferEngine::EpollTransferEngine(const ServerInfo &server, const TestConfig &config, Direction direction, float minServerVersion):
+	mServerInfo(server),
+	mConfig(config),
+	mDirection(direction),
+	mMinServerVersion(minServerVersion),
+	mSocketOptions(),
+	mAddr(),
+	mBytes(nullptr),
+	mStop(nullptr),
+	mChunk(nullptr),
+	mAffinity(nullptr),
+	mMeter(nullptr),
+	mCompleted(0),
+	mDynamic(false),
+	mNext(0) {
+}
+
+bool EpollTransferEngine::supported() {
+#if defined(__linux__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Bytes moved are added to *bytes as they go, and every connection is wound down once *stop is raised
+void EpollTransferEngine::setTransferControl(std::atomic<long long> *bytes, const std::atomic<bool> *stop) {
+	mBytes = bytes;
+	mStop = stop;
+}
+
+// Every read and write moves at most *chunk bytes, capped by config.buff_size, the size of the buffers
+void EpollTransferEngine::setChunkControl(const std::atomic<long> *chunk) {
+	mChunk = chunk;
+}
+
+void EpollTransferEngine::setSocketOptions(const SocketOptions &options) {
+	mSocketOptions = options;
+}
+
+// Every epoll loop is pinned to the next core of affinity, when it has a plan, and its CPU
+// time is charged to meter
+void EpollTransferEngine::setCpuControl(CpuAffinity *affinity, CpuMeter *meter) {
+	mAffinity = affinity;
+	mMeter = meter;
+}
+
+// It runs the test and returns true when at least one request completed
+bool EpollTransferEngine::run(std::function<void(bool)> cb) {
+	mCb = cb;
+	mCompleted = 0;
+	mDynamic = false;
+	if (!supported() || !SpeedTestClient(mServerInfo, mSocketOptions).resolve(mAddr)) {
+		for (int i = 0; i < mConfig.concurrency; i++)
+			notify(false);
+		return false;
+	}
+
+	spawn(mConfig.concurrency);
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		for (int i = 0; i < mConfig.concurrency; i++) {
+			Connection conn = Connection();
+			conn.fd = -1;
+			conn.state = connecting;
+			conn.curr_size = mConfig.start_size;
+			conn.addr = mAddr;
+			conn.bytes = mBytes;
+			mLoops[i % mLoops.size()]->pending.push_back(conn);
+		}
+	}
+	wait();
+	return mCompleted > 0;
+}
+
+// The loops of an adaptive test, up to one per core and no more than config.concurrency
+bool EpollTransferEngine::start(std::function<void(bool)> cb) {
+	if (!supported())
+		return false;
+	mCb = cb;
+	mCompleted = 0;
+	mDynamic = true;
+	spawn(mConfig.concurrency);
+	return true;
+}
+
+// One more connection to server; *alive is decremented once it is gone. It fails when the
+// server cannot be resolved or the engine is already shutting down.
+bool EpollTransferEngine::add(const ServerInfo &server, std::atomic<long long> *bytes, std::shared_ptr<std::atomic<bool>> stop, std::atomic<int> *alive) {
+	Connection conn = Connection();
+	conn.fd = -1;
+	conn.state = connecting;
+	conn.curr_size = mConfig.start_size;
+	conn.bytes = bytes;
+	conn.stop = stop;
+	if (mLoops.empty() || !SpeedTestClient(server, mSocketOptions).resolve(conn.addr))
+		return false;
+	std::lock_guard<std::mutex> lock(mPendingMutex);
+	Loop &l = *mLoops[mNext++ % mLoops.size()];
+	if (l.closed)
+		return false;
+	conn.alive = alive;
+	l.pending.push_back(conn);
+#if defined(__linux__)
+	uint64_t one = 1;
+	write(l.wake, &one, sizeof(one));
+#endif
+	return true;
+}
+
+void EpollTransferEngine::wait() {
+	for (auto &t : mWorkers) {
+		t.join();
+	}
+	mWorkers.clear();
+	mLoops.clear();
+}
+
+void EpollTransferEngine::spawn(int loops) {
+	loops = std::min(std::max(static_cast<int>(std::thread::hardware_concurrency()), 1), std::max(loops, 1));
+	for (int i = 0; i < loops; i++) {
+		std::unique_ptr<Loop> l(new Loop());
+#if defined(__linux__)
+		l->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+		l->wake = -1;
+#endif
+		l->closed = false;
+		mLoops.push_back(std::move(l));
+	}
+	for (auto &l : mLoops) {
+		Loop *current = l.get();
+		mWorkers.push_back(std::thread([this, current]() {
+			if (mAffinity && mAffinity->enabled())
+				CpuAffinity::pin(mAffinity->next());
+			auto cpu = CpuMeter::thread();
+			loop(*current);
+			if (mMeter)
+				mMeter->add(cpu);
+		}));
+	}
+}
+
+#if defined(__linux__)
+void EpollTransferEngine::loop(Loop &l) {
+	int epfd = epoll_create1(0);
+	std::vector<char> buff(static_cast<size_t>(mConfig.buff_size));
+	for (auto &c : buff) {
+		c = static_cast<char>(rand() % 256);
+		if (c == '\n')
+			c = ' ';
+	}
+	if (epfd >= 0 && l.wake >= 0) {
+		struct epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, l.wake, &ev);
+	}
+
+	size_t active = 0;
+	const long long deadline_ns = (mConfig.min_test_time_ms + 30000) * 1000000LL;
+	struct epoll_event events[64];
+	while (epfd >= 0 && !stopped()) {
+		admit(l, epfd, active);
+		if (active == 0 && !mDynamic)
+			break;
+		int n = epoll_wait(epfd, events, 64, 100);
+		if (n < 0 && errno != EINTR)
+			break;
+		auto now = MonotonicClock::now();
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == nullptr) {
+				uint64_t count;
+				while (read(l.wake, &count, sizeof(count)) > 0);
+				continue;
+			}
+			auto &conn = *static_cast<Connection *>(events[i].data.ptr);
+			if (conn.state == done)
+				continue;
+			bool ok = !(events[i].events & EPOLLERR) && step(conn, epfd, buff.data());
+			if (!ok || conn.state == done) {
+				finish(conn, epfd, !ok && !retired(conn));
+				active--;
+			}
+		}
+		for (auto &conn : l.connections) {
+			if (conn.state == done)
+				continue;
+			if (retired(conn) || now - conn.started_ns > deadline_ns) {
+				finish(conn, epfd, !retired(conn));
+				active--;
+			}
+		}
+	}
+
+	std::vector<Connection> pending;
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		l.closed = true;
+		pending.swap(l.pending);
+	}
+	for (auto &conn : pending)
+		finish(conn, -1, epfd < 0 || !stopped());
+	for (auto &conn : l.connections) {
+		if (conn.state != done)
+			finish(conn, epfd, !stopped());
+	}
+	if (epfd >= 0)
+		::close(epfd);
+	if (l.wake >= 0)
+		::close(l.wake);
+}
+
+// It opens the connections handed over since the last round
+void EpollTransferEngine::admit(Loop &l, int epfd, size_t &active) {
+	std::vector<Connection> pending;
+	{
+		std::lock_guard<std::mutex> lock(mPendingMutex);
+		pending.swap(l.pending);
+	}
+	for (auto &added : pending) {
+		l.connections.push_back(added);
+		Connection &conn = l.connections.back();
+		if (!open(conn)) {
+			finish(conn, -1, true);
+			continue;
+		}
+		struct epoll_event ev{};
+		ev.events = EPOLLOUT;
+		ev.data.ptr = &conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+			finish(conn, -1, true);
+			continue;
+		}
+		active++;
+	}
+}
+
+bool EpollTransferEngine::open(Connection &conn) {
+	conn.started_ns = MonotonicClock::now();
+	conn.fd = socket(conn.addr.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (conn.fd < 0 || !SpeedTestClient::applySocketOptions(conn.fd, mSocketOptions))
+		return false;
+	if (::connect(conn.fd, (struct sockaddr *)&conn.addr.addr, conn.addr.len) < 0 && errno != EINPROGRESS)
+		return false;
+	return true;
+}
+
+// It advances the connection state machine as far as the socket allows
+bool EpollTransferEngine::step(Connection &conn, int epfd, char *buff) {
+	bool progress = true;
+	while (progress) {
+		progress = false;
+		switch (conn.state) {
+			case connecting: {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				if (getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+					return false;
+				conn.out = "HI\n";
+				conn.state = handshake;
+				progress = true;
+				break;
+			}
+			case handshake: {
+				if (!flush(conn))
+					return false;
+				if (!conn.out.empty())
+					break;
+				std::string line;
+				int framed = conn.framer.tryReadLine(conn.fd, line);
+				if (framed <= 0)
+					return framed == 0;
+				std::stringstream reply_stream(line);
+				std::string hello;
+				float version = -1.0;
+				reply_stream >> hello >> version;
+				if (reply_stream.fail() || hello != "HELLO" || version < mMinServerVersion)
+					return false;
+				if (!nextCommand(conn))
+					return false;
+				progress = true;
+				break;
+			}
+			case command: {
+				if (!flush(conn))
+					return false;
+				if (!conn.out.empty())
+					break;
+				conn.state = transfer;
+				if (mDirection == upload) {
+					std::stringstream cmd;
+					cmd << "UPLOAD " << conn.curr_size << "\n";
+					conn.missing = conn.curr_size - static_cast<long>(cmd.str().length());
+				} else {
+					conn.missing = conn.curr_size - static_cast<long>(conn.framer.drain(static_cast<size_t>(conn.curr_size)));
+				}
+				progress = true;
+				break;
+			}
+			case transfer: {
+				for (int i = 0; i < 16 && conn.missing > 0; i++) {
+					ssize_t n;
+					if (mDirection == download) {
+						n = read(conn.fd, buff, static_cast<size_t>(std::min(conn.missing, chunk())));
+						if (n == 0)
+							return false;
+					} else if (conn.missing > 1) {
+						n = write(conn.fd, buff, static_cast<size_t>(std::min(conn.missing - 1, chunk())));
+					} else {
+						n = write(conn.fd, "\n", 1);
+					}
+					if (n < 0) {
+						if (errno == EAGAIN || errno == EWOULDBLOCK)
+							break;
+						return false;
+					}
+					conn.missing -= n;
+					if (conn.bytes)
+						conn.bytes->fetch_add(n, std::memory_order_relaxed);
+				}
+				if (conn.missing > 0)
+					break;
+				if (mDirection == download) {
+					notify(true);
+					conn.curr_size += mConfig.incr_size;
+					if (!nextCommand(conn))
+						return false;
+				} else {
+					conn.state = reply;
+				}
+				progress = true;
+				break;
+			}
+			case reply: {
+				std::string line;
+				int framed = conn.framer.tryReadLine(conn.fd, line);
+				if (framed <= 0)
+					return framed == 0;
+				std::stringstream ss;
+				ss << "OK " << conn.curr_size << " ";
+				if (line.substr(0, ss.str().length()) != ss.str())
+					return false;
+				notify(true);
+				conn.curr_size += mConfig.incr_size;
+				if (!nextCommand(conn))
+					return false;
+				progress = true;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	uint32_t events = EPOLLIN;
+	if (conn.state == connecting || conn.state == command || (conn.state == transfer && mDirection == upload) || !conn.out.empty())
+		events = EPOLLOUT;
+	struct epoll_event ev{};
+	ev.events = events;
+	ev.data.ptr = &conn;
+	return conn.state == done || epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev) == 0;
+}
+
+bool EpollTransferEngine::flush(Connection &conn) {
+	while (!conn.out.empty()) {
+		auto n = write(conn.fd, conn.out.c_str(), conn.out.length());
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		conn.out.erase(0, static_cast<size_t>(n));
+	}
+	return true;
+}
+
+// It queues the next chunk request, or marks the connection as done when the test is over.
+// Every request gets min_test_time_ms plus 30 s before the connection counts as stalled.
+bool EpollTransferEngine::nextCommand(Connection &conn) {
+	if (conn.curr_size >= mConfig.max_size || stopped() || retired(conn)) {
+		conn.state = done;
+		return true;
+	}
+	conn.started_ns = MonotonicClock::now();
+	std::stringstream cmd;
+	cmd << (mDirection == download ? "DOWNLOAD " : "UPLOAD ") << conn.curr_size << "\n";
+	conn.out = cmd.str();
+	conn.state = command;
+	return flush(conn);
+}
+
+void EpollTransferEngine::finish(Connection &conn, int epfd, bool failed) {
+	if (conn.fd >= 0) {
+		if (epfd >= 0)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+		if (!failed)
+			write(conn.fd, "QUIT\n", 5);
+		::close(conn.fd);
+		conn.fd = -1;
+	}
+	conn.state = done;
+	if (conn.alive) {
+		conn.alive->fetch_sub(1);
+		conn.alive = nullptr;
+	}
+	if (failed)
+		notify(false);
+}
+#else
+void EpollTransferEngine::loop(Loop &l) {
+	std::lock_guard<std::mutex> lock(mPendingMutex);
+	l.closed = true;
+	for (auto &conn : l.pending) {
+		if (conn.alive)
+			conn.alive->fetch_sub(1);
+		notify(false);
+	}
+	l.pending.clear();
+}
+#endif
+
+void EpollTransferEngine::notify(bool success) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (success)
+		mCompleted++;
+	if (mCb)
+		mCb(success);
+}
+
+bool EpollTransferEngine::stopped() {
+	return mStop && mStop->load(std::memory_order_relaxed);
+}
+
+bool EpollTransferEngine::retired(const Connection &conn) {
+	return conn.stop && conn.stop->load(std::memory_order_relaxed);
+}
+
+long EpollTransferEngine::chunk() {
+	if (!mChunk)
+		return mConfig.buff_size;
+	return std::max(1L, std::min(mConfig.buff_size, mChunk->load(std::memory_order_relaxed)));
+}
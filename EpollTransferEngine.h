@@ -0,0 +1,97 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_EPOLLTRANSFERENGINE_H
+#define SPEEDTEST_EPOLLTRANSFERENGINE_H
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include "DataTypes.h"
+#include "ProtocolFramer.h"
+#include "CpuAffinity.h"
+#include "ResolverCache.h"
+
+// Drives every DOWNLOAD/UPLOAD connection of a test from a small pool of
+// epoll loops (one per core) instead of one blocking thread per connection.
+// run() carries the config.concurrency connections of a static test. For the adaptive
+// tests start() runs the loops and every add() opens one more connection on them, to any
+// server, that lasts until its own stop or the engine's is raised; wait() joins the loops.
+class EpollTransferEngine {
+public:
+	enum Direction { download, upload };
+
+	EpollTransferEngine(const ServerInfo &server, const TestConfig &config, Direction direction, float minServerVersion);
+	static bool supported();
+	void setTransferControl(std::atomic<long long> *bytes, const std::atomic<bool> *stop);
+	void setChunkControl(const std::atomic<long> *chunk);
+	void setSocketOptions(const SocketOptions &options);
+	void setCpuControl(CpuAffinity *affinity, CpuMeter *meter);
+	bool run(std::function<void(bool)> cb = nullptr);
+	bool start(std::function<void(bool)> cb = nullptr);
+	bool add(const ServerInfo &server, std::atomic<long long> *bytes, std::shared_ptr<std::atomic<bool>> stop, std::atomic<int> *alive);
+	void wait();
+private:
+	enum State { connecting, handshake, command, transfer, reply, done };
+	typedef struct connection_t {
+		int   fd;
+		State state;
+		long  curr_size;
+		long  missing;
+		std::string out;
+		ProtocolFramer framer;
+		long long started_ns;
+		ResolverCache::Address addr;
+		std::atomic<long long> *bytes;
+		std::shared_ptr<std::atomic<bool>> stop;
+		std::atomic<int> *alive;
+	} Connection;
+
+	// Connections handed over by add() wait in pending until the loop wakes up on wake
+	typedef struct loop_t {
+		std::deque<Connection> connections;
+		std::vector<Connection> pending;
+		int  wake;
+		bool closed;
+	} Loop;
+
+	void spawn(int loops);
+	void loop(Loop &l);
+	void admit(Loop &l, int epfd, size_t &active);
+	bool open(Connection &conn);
+	bool step(Connection &conn, int epfd, char *buff);
+	bool flush(Connection &conn);
+	bool nextCommand(Connection &conn);
+	void finish(Connection &conn, int epfd, bool notify);
+	void notify(bool success);
+	bool stopped();
+	bool retired(const Connection &conn);
+	long chunk();
+
+	ServerInfo mServerInfo;
+	TestConfig mConfig;
+	Direction  mDirection;
+	float      mMinServerVersion;
+	SocketOptions mSocketOptions;
+	ResolverCache::Address mAddr;
+	std::function<void(bool)> mCb;
+	std::mutex mMutex;
+	std::atomic<long long> *mBytes;
+	const std::atomic<bool> *mStop;
+	const std::atomic<long> *mChunk;
+	CpuAffinity *mAffinity;
+	CpuMeter *mMeter;
+	int mCompleted;
+	bool mDynamic;
+	std::vector<std::unique_ptr<Loop>> mLoops;
+	std::vector<std::thread> mWorkers;
+	std::mutex mPendingMutex;
+	size_t mNext;
+};
+#endif // SPEEDTEST_EPOLLTRANSFERENGINE_H
@@ -0,0 +1,213 @@
+//
+// Created on 10/16/26.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "IoUring.h"
+
+IoUring::IoUring(unsigned entries):
+	mEntries(entries),
+	mRingFd(-1),
+	mBuffersRegistered(false),
+	mToSubmit(0),
+	mSqeTail(0),
+	mSqRing(nullptr),
+	mSqRingSize(0),
+	mCqRing(nullptr),
+	mCqRingSize(0),
+	mSqes(nullptr),
+	mSqesSize(0),
+	mSqHead(nullptr),
+	mSqTail(nullptr),
+	mSqMask(nullptr),
+	mSqArray(nullptr),
+	mCqHead(nullptr),
+	mCqTail(nullptr),
+	mCqMask(nullptr),
+	mCqes(nullptr) {
+}
+
+IoUring::~IoUring() {
+#if defined(HAVE_LINUX_IO_URING_H)
+	if (mSqes)
+		munmap(mSqes, mSqesSize);
+	if (mCqRing && mCqRing != mSqRing)
+		munmap(mCqRing, mCqRingSize);
+	if (mSqRing)
+		munmap(mSqRing, mSqRingSize);
+	if (mRingFd >= 0)
+		close(mRingFd);
+#endif
+}
+
+unsigned IoUring::entries() {
+	return mEntries;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+static inline unsigned loadAcquire(unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void storeRelease(unsigned *p, unsigned v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+bool IoUring::init() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	mRingFd = static_cast<int>(syscall(__NR_io_uring_setup, mEntries, &params));
+	if (mRingFd < 0)
+		return false;
+	mEntries = params.sq_entries;
+
+	mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	mSqesSize   = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+	if (mSqRing == MAP_FAILED) {
+		mSqRing = nullptr;
+		return false;
+	}
+	mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+	if (mCqRing == MAP_FAILED) {
+		mCqRing = nullptr;
+		return false;
+	}
+	mSqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+	if (mSqes == MAP_FAILED) {
+		mSqes = nullptr;
+		return false;
+	}
+
+	auto sq = static_cast<char *>(mSqRing);
+	mSqHead  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	mSqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	mSqMask  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	mSqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	mSqeTail = *mSqTail;
+	auto cq = static_cast<char *>(mCqRing);
+	mCqHead  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	mCqTail  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	mCqMask  = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	mCqes    = cq + params.cq_off.cqes;
+	return true;
+}
+
+bool IoUring::registerBuffers(const std::vector<struct iovec> &buffers) {
+	unregisterBuffers();
+	if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0)
+		return false;
+	mBuffersRegistered = true;
+	return true;
+}
+
+void IoUring::unregisterBuffers() {
+	if (!mBuffersRegistered)
+		return;
+	syscall(__NR_io_uring_register, mRingFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	mBuffersRegistered = false;
+}
+
+// The entry stays private to us until submitAndWait() publishes the tail, the kernel
+// must not see it before the caller has filled it in
+struct io_uring_sqe *IoUring::nextSqe() {
+	unsigned tail = mSqeTail;
+	if (tail - loadAcquire(mSqHead) >= mEntries)
+		return nullptr;
+	unsigned index = tail & *mSqMask;
+	auto sqe = static_cast<struct io_uring_sqe *>(mSqes) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	mSqArray[index] = index;
+	mSqeTail = tail + 1;
+	mToSubmit++;
+	return sqe;
+}
+
+// It queues a read into the registered buffer buf_index
+bool IoUring::prepRead(int fd, unsigned buf_index, void *buf, unsigned len, uint64_t user_data) {
+	if (!mBuffersRegistered)
+		return false;
+	auto sqe = nextSqe();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buf);
+	sqe->len = len;
+	sqe->buf_index = static_cast<uint16_t>(buf_index);
+	sqe->user_data = user_data;
+	return true;
+}
+
+// It queues a write from the registered buffer buf_index
+bool IoUring::prepWrite(int fd, unsigned buf_index, const void *buf, unsigned len, uint64_t user_data) {
+	if (!mBuffersRegistered)
+		return false;
+	auto sqe = nextSqe();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(buf);
+	sqe->len = len;
+	sqe->buf_index = static_cast<uint16_t>(buf_index);
+	sqe->user_data = user_data;
+	return true;
+}
+
+// It submits every queued entry and blocks until at least wait_nr completions are available
+int IoUring::submitAndWait(unsigned wait_nr) {
+	storeRelease(mSqTail, mSqeTail);
+	int ret;
+	do {
+		ret = static_cast<int>(syscall(__NR_io_uring_enter, mRingFd, mToSubmit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+	} while (ret < 0 && errno == EINTR);
+	if (ret >= 0)
+		mToSubmit -= static_cast<unsigned>(ret) > mToSubmit ? mToSubmit : static_cast<unsigned>(ret);
+	return ret;
+}
+
+bool IoUring::popCompletion(uint64_t &user_data, int &res) {
+	unsigned head = *mCqHead;
+	if (head == loadAcquire(mCqTail))
+		return false;
+	auto cqe = static_cast<struct io_uring_cqe *>(mCqes) + (head & *mCqMask);
+	user_data = cqe->user_data;
+	res = cqe->res;
+	storeRelease(mCqHead, head + 1);
+	return true;
+}
+#else
+bool IoUring::init() {
+	return false;
+}
+
+bool IoUring::registerBuffers(const std::vector<struct iovec> &) {
+	return false;
+}
+
+void IoUring::unregisterBuffers() {
+}
+
+bool IoUring::prepRead(int, unsigned, void *, unsigned, uint64_t) {
+	return false;
+}
+
+bool IoUring::prepWrite(int, unsigned, const void *, unsigned, uint64_t) {
+	return false;
+}
+
+int IoUring::submitAndWait(unsigned) {
+	return -1;
+}
+
+bool IoUring::popCompletion(uint64_t &, int &) {
+	return false;
+}
+#endif
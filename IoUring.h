@@ -0,0 +1,58 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_IOURING_H
+#define SPEEDTEST_IOURING_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+#include "SpeedTestConfig.h"
+#if defined(HAVE_LINUX_IO_URING_H)
+#	include <linux/io_uring.h>
+#endif
+
+// Minimal io_uring wrapper built on the raw system calls, so that no
+// liburing is required. init() fails on kernels without io_uring support
+// and callers are expected to fall back to plain read()/write().
+class IoUring {
+public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+
+	bool init();
+	bool registerBuffers(const std::vector<struct iovec> &buffers);
+	void unregisterBuffers();
+	bool prepRead(int fd, unsigned buf_index, void *buf, unsigned len, uint64_t user_data);
+	bool prepWrite(int fd, unsigned buf_index, const void *buf, unsigned len, uint64_t user_data);
+	int  submitAndWait(unsigned wait_nr);
+	bool popCompletion(uint64_t &user_data, int &res);
+	unsigned entries();
+private:
+#if defined(HAVE_LINUX_IO_URING_H)
+	struct io_uring_sqe *nextSqe();
+#endif
+	unsigned mEntries;
+	int      mRingFd;
+	bool     mBuffersRegistered;
+	unsigned mToSubmit;
+	unsigned mSqeTail;
+
+	void    *mSqRing;
+	size_t   mSqRingSize;
+	void    *mCqRing;
+	size_t   mCqRingSize;
+	void    *mSqes;
+	size_t   mSqesSize;
+
+	unsigned *mSqHead;
+	unsigned *mSqTail;
+	unsigned *mSqMask;
+	unsigned *mSqArray;
+	unsigned *mCqHead;
+	unsigned *mCqTail;
+	unsigned *mCqMask;
+	void     *mCqes;
+};
+#endif // SPEEDTEST_IOURING_H
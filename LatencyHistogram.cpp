@@ -0,0 +1,147 @@
+//
+// Created on 10/16/26.
+//
+
+#include <climits>
+#include <cmath>
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram() {
+	reset();
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram &other) {
+	reset();
+	merge(other);
+}
+
+LatencyHistogram &LatencyHistogram::operator=(const LatencyHistogram &other) {
+	if (this != &other) {
+		reset();
+		merge(other);
+	}
+	return *this;
+}
+
+void LatencyHistogram::record(long long ns) {
+	if (ns < 0)
+		ns = 0;
+	mCounts[index(ns)].fetch_add(1, std::memory_order_relaxed);
+	mCount.fetch_add(1, std::memory_order_relaxed);
+	mSum.fetch_add(ns, std::memory_order_relaxed);
+	long long seen = mMin.load(std::memory_order_relaxed);
+	while (ns < seen && !mMin.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+	}
+	seen = mMax.load(std::memory_order_relaxed);
+	while (ns > seen && !mMax.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+	}
+}
+
+// Histograms of separate runs or threads add up bucket by bucket, no raw sample is needed
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+	const long long count = other.mCount.load(std::memory_order_relaxed);
+	if (count == 0)
+		return;
+	for (int i = 0; i < BUCKETS; i++) {
+		long long c = other.mCounts[i].load(std::memory_order_relaxed);
+		if (c > 0)
+			mCounts[i].fetch_add(c, std::memory_order_relaxed);
+	}
+	mCount.fetch_add(count, std::memory_order_relaxed);
+	mSum.fetch_add(other.mSum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	long long value = other.mMin.load(std::memory_order_relaxed);
+	long long seen = mMin.load(std::memory_order_relaxed);
+	while (value < seen && !mMin.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+	}
+	value = other.mMax.load(std::memory_order_relaxed);
+	seen = mMax.load(std::memory_order_relaxed);
+	while (value > seen && !mMax.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+	}
+}
+
+// Not safe while other threads record
+void LatencyHistogram::reset() {
+	for (auto &c : mCounts)
+		c.store(0, std::memory_order_relaxed);
+	mCount.store(0, std::memory_order_relaxed);
+	mSum.store(0, std::memory_order_relaxed);
+	mMin.store(LLONG_MAX, std::memory_order_relaxed);
+	mMax.store(0, std::memory_order_relaxed);
+}
+
+long long LatencyHistogram::count() const {
+	return mCount.load(std::memory_order_relaxed);
+}
+
+// Percentiles and the standard deviation come from the bucket midpoints, clamped to the
+// exact min and max
+LatencyStats LatencyHistogram::stats() const {
+	LatencyStats stats = LatencyStats();
+	stats.count = count();
+	if (stats.count == 0)
+		return stats;
+	stats.min = mMin.load(std::memory_order_relaxed);
+	stats.max = mMax.load(std::memory_order_relaxed);
+	stats.mean = static_cast<double>(mSum.load(std::memory_order_relaxed)) / stats.count;
+	double squares = 0;
+	long long counted = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		long long c = mCounts[i].load(std::memory_order_relaxed);
+		if (c == 0)
+			continue;
+		double mid = (lowest(i) + highest(i)) / 2.0;
+		squares += c * (mid - stats.mean) * (mid - stats.mean);
+		counted += c;
+	}
+	stats.stddev = counted > 0 ? std::sqrt(squares / counted) : 0;
+	stats.p50 = percentile(0.50);
+	stats.p90 = percentile(0.90);
+	stats.p99 = percentile(0.99);
+	stats.p999 = percentile(0.999);
+	return stats;
+}
+
+// Smallest recorded value with at least p of the samples at or below it, within the
+// bucket resolution
+long long LatencyHistogram::percentile(double p) const {
+	const long long total = count();
+	if (total == 0)
+		return 0;
+	const long long min = mMin.load(std::memory_order_relaxed);
+	const long long max = mMax.load(std::memory_order_relaxed);
+	long long rank = static_cast<long long>(std::ceil(p * total));
+	if (rank < 1)
+		rank = 1;
+	long long seen = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += mCounts[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			long long mid = lowest(i) + (highest(i) - lowest(i)) / 2;
+			return mid < min ? min : mid > max ? max : mid;
+		}
+	}
+	return max;
+}
+
+int LatencyHistogram::index(long long ns) {
+	const long long top = (1LL << MAX_BITS) - 1;
+	unsigned long long v = static_cast<unsigned long long>(ns < 0 ? 0 : ns > top ? top : ns);
+	int msb = 63 - __builtin_clzll(v | 1);
+	int bucket = msb < SUB_BITS ? 0 : msb - (SUB_BITS - 1);
+	return (bucket << (SUB_BITS - 1)) + static_cast<int>(v >> bucket);
+}
+
+long long LatencyHistogram::lowest(int index) {
+	if (index < (1 << SUB_BITS))
+		return index;
+	int bucket = (index >> (SUB_BITS - 1)) - 1;
+	long long sub = index - (bucket << (SUB_BITS - 1));
+	return sub << bucket;
+}
+
+long long LatencyHistogram::highest(int index) {
+	if (index < (1 << SUB_BITS))
+		return index;
+	int bucket = (index >> (SUB_BITS - 1)) - 1;
+	return lowest(index) + (1LL << bucket) - 1;
+}
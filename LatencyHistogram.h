@@ -0,0 +1,41 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_LATENCYHISTOGRAM_H
+#define SPEEDTEST_LATENCYHISTOGRAM_H
+#include <atomic>
+#include "DataTypes.h"
+
+// Fixed-memory latency histogram in the HDR style: every power of two of nanoseconds is
+// split into 256 linear buckets, so any recorded value is known within 1/256 (0.4%) from
+// 1 ns up to 2^40 ns (18 minutes); larger values land in the last bucket. Count, sum,
+// min and max are exact.
+// record() and merge() are lock free and may run from any number of threads at once;
+// stats() reads a consistent enough snapshot while they do.
+class LatencyHistogram {
+public:
+	static const int SUB_BITS = 9;
+	static const int MAX_BITS = 40;
+	static const int BUCKETS = (MAX_BITS - SUB_BITS + 2) << (SUB_BITS - 1);
+
+	LatencyHistogram();
+	LatencyHistogram(const LatencyHistogram &other);
+	LatencyHistogram &operator=(const LatencyHistogram &other);
+	void record(long long ns);
+	void merge(const LatencyHistogram &other);
+	void reset();
+	long long count() const;
+	LatencyStats stats() const;
+	long long percentile(double p) const;
+	static int index(long long ns);
+	static long long lowest(int index);
+	static long long highest(int index);
+private:
+	std::atomic<long long> mCounts[BUCKETS];
+	std::atomic<long long> mCount;
+	std::atomic<long long> mSum;
+	std::atomic<long long> mMin;
+	std::atomic<long long> mMax;
+};
+#endif // SPEEDTEST_LATENCYHISTOGRAM_H
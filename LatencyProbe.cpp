@@ -0,0 +1,134 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "LatencyProbe.h"
+#include "SpeedTestClient.h"
+#include "MonotonicClock.h"
+
+LatencyProbe::LatencyProbe(const ServerInfo &server, const SocketOptions &options, long interval_ms):
+	mServerInfo(server),
+	mSocketOptions(options),
+	mIntervalMs(interval_ms),
+	mTimeouts(0),
+	mStart(0),
+	mStop(false) {
+}
+
+LatencyProbe::~LatencyProbe() {
+	LoadedLatency discard;
+	stop(0, discard);
+}
+
+// It connects synchronously, so that the handshake is not queued behind the transfer,
+// then samples on its own thread. bytes reads the byte counter of the test.
+bool LatencyProbe::start(std::function<long long()> bytes) {
+	mBytes = bytes;
+	mStart = MonotonicClock::now();
+	mClient = open();
+	if (!mClient)
+		return false;
+	mThread = std::thread(&LatencyProbe::run, this);
+	return true;
+}
+
+// The percentiles cover every sample taken; a PING that timed out or failed counts as a
+// timeout only. increase is the median over idle_ns.
+void LatencyProbe::stop(long long idle_ns, LoadedLatency &result) {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+		if (mClient)
+			mClient->interrupt();
+	}
+	mWake.notify_all();
+	if (mThread.joinable())
+		mThread.join();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	result = LoadedLatency();
+	result.samples = static_cast<int>(mSamples.size());
+	result.timeouts = mTimeouts;
+	result.idle = idle_ns;
+	result.timeline = mSamples;
+	if (mSamples.empty())
+		return;
+	std::vector<long long> rtts;
+	for (auto &sample : mSamples)
+		rtts.push_back(sample.rtt_ns);
+	std::sort(rtts.begin(), rtts.end());
+	result.p50 = percentile(rtts, 0.50);
+	result.p90 = percentile(rtts, 0.90);
+	result.p99 = percentile(rtts, 0.99);
+	result.max = rtts.back();
+	result.increase = std::max(0LL, result.p50 - idle_ns);
+}
+
+// PINGs go out on a fixed grid of start + n * interval, so the RTT does not stretch the
+// period. Slots missed by a slow PING or reconnect are skipped, not sent in a burst.
+void LatencyProbe::run() {
+	long long last = MonotonicClock::now();
+	long long last_bytes = mBytes ? mBytes() : 0;
+	const std::chrono::milliseconds interval(mIntervalMs);
+	auto due = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (!mStop) {
+		const auto now = std::chrono::steady_clock::now();
+		do {
+			due += interval;
+		} while (due <= now);
+		if (mWake.wait_until(lock, due, [this]() { return mStop; }))
+			break;
+		if (!mClient) {
+			lock.unlock();
+			auto client = open();
+			lock.lock();
+			if (mStop)
+				break;
+			if (!client) {
+				mTimeouts++;
+				continue;
+			}
+			mClient = std::move(client);
+		}
+		// The PING runs unlocked so that stop() can interrupt it
+		SpeedTestClient *client = mClient.get();
+		lock.unlock();
+		const long long at = MonotonicClock::now();
+		const long long bytes = mBytes ? mBytes() : 0;
+		long long rtt = 0;
+		bool success = client->ping(rtt);
+		lock.lock();
+		if (mStop)
+			break;
+		if (!success) {
+			// A late PONG would be read as the reply to the next PING
+			mTimeouts++;
+			mClient.reset();
+			continue;
+		}
+		LatencySample sample = LatencySample();
+		sample.offset_ns = at - mStart;
+		sample.rtt_ns = rtt;
+		sample.mbps = at > last ? (bytes - last_bytes) * 8 / (static_cast<double>(at - last) / 1000000000) / 1024 / 1024 : 0;
+		mSamples.push_back(sample);
+		last = at;
+		last_bytes = bytes;
+	}
+}
+
+std::unique_ptr<SpeedTestClient> LatencyProbe::open() {
+	std::unique_ptr<SpeedTestClient> client(new SpeedTestClient(mServerInfo, mSocketOptions));
+	if (!client->connect())
+		return nullptr;
+	client->setInteractive(SPEED_TEST_LOADED_LATENCY_TIMEOUT_MS);
+	return client;
+}
+
+long long LatencyProbe::percentile(std::vector<long long> &sorted, double p) {
+	size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+	return sorted[std::min(sorted.size(), std::max(rank, static_cast<size_t>(1))) - 1];
+}
@@ -0,0 +1,48 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_LATENCYPROBE_H
+#define SPEEDTEST_LATENCYPROBE_H
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "DataTypes.h"
+
+class SpeedTestClient;
+
+// Latency under load. A dedicated PING connection, opened before the transfer workers
+// start, samples the round trip every interval for as long as a transfer test runs. Every
+// sample sits on the throughput timeline: its offset from the start of the test and the
+// rate moved over the interval before it. The connection asks for interactive priority,
+// so that the queues of this host serve it ahead of the bulk connections and what it
+// measures is the queueing further along the path.
+class LatencyProbe {
+public:
+	LatencyProbe(const ServerInfo &server, const SocketOptions &options, long interval_ms);
+	~LatencyProbe();
+	bool start(std::function<long long()> bytes);
+	void stop(long long idle_ns, LoadedLatency &result);
+private:
+	void run();
+	std::unique_ptr<SpeedTestClient> open();
+	static long long percentile(std::vector<long long> &sorted, double p);
+
+	ServerInfo mServerInfo;
+	SocketOptions mSocketOptions;
+	long mIntervalMs;
+	std::unique_ptr<SpeedTestClient> mClient;
+	std::function<long long()> mBytes;
+	std::vector<LatencySample> mSamples;
+	int  mTimeouts;
+	long long mStart;
+	bool mStop;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::thread mThread;
+};
+#endif // SPEEDTEST_LATENCYPROBE_H
@@ -0,0 +1,253 @@
+//
+// Created on 10/16/26.
+//
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "Metrics.h"
+
+void MetricsRegistry::gauge(const std::string &name, const std::string &help) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	declare(name, "gauge", help);
+}
+
+void MetricsRegistry::counter(const std::string &name, const std::string &help) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	declare(name, "counter", help);
+}
+
+void MetricsRegistry::histogram(const std::string &name, const std::string &help, const std::vector<double> &bounds) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	declare(name, "histogram", help);
+	auto &family = mFamilies[name];
+	family.bounds = bounds;
+	family.buckets.assign(bounds.size() + 1, 0);
+}
+
+void MetricsRegistry::summary(const std::string &name, const std::string &help) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	declare(name, "summary", help);
+}
+
+// Callers hold mMutex
+void MetricsRegistry::declare(const std::string &name, const std::string &type, const std::string &help) {
+	if (mFamilies.find(name) == mFamilies.end())
+		mOrder.push_back(name);
+	auto &family = mFamilies[name];
+	family.type = type;
+	family.help = help;
+	family.sum = 0;
+	family.count = 0;
+}
+
+// labels is the inner part of the label set, e.g. result="done", see label()
+void MetricsRegistry::set(const std::string &name, double value, const std::string &labels) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFamilies[name].samples[labels] = value;
+}
+
+void MetricsRegistry::add(const std::string &name, double value, const std::string &labels) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFamilies[name].samples[labels] += value;
+}
+
+void MetricsRegistry::observe(const std::string &name, double value) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mFamilies.find(name);
+	if (it == mFamilies.end() || it->second.buckets.empty())
+		return;
+	auto &family = it->second;
+	size_t i = 0;
+	while (i < family.bounds.size() && value > family.bounds[i])
+		i++;
+	family.buckets[i]++;
+	family.sum += value;
+	family.count++;
+}
+
+void MetricsRegistry::summarize(const std::string &name, double sum, long long count) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto &family = mFamilies[name];
+	family.sum = sum;
+	family.count = count;
+}
+
+void MetricsRegistry::clear(const std::string &name) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mFamilies[name].samples.clear();
+}
+
+std::string MetricsRegistry::label(const std::string &name, const std::string &value) {
+	std::string escaped;
+	for (auto c : value) {
+		if (c == '\\' || c == '"')
+			escaped.push_back('\\');
+		if (c == '\n') {
+			escaped.append("\\n");
+			continue;
+		}
+		escaped.push_back(c);
+	}
+	return name + "=\"" + escaped + "\"";
+}
+
+std::string MetricsRegistry::render() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::ostringstream out;
+	out.precision(std::numeric_limits<double>::digits10);
+	for (auto &name : mOrder) {
+		auto &family = mFamilies.find(name)->second;
+		out << "# HELP " << name << " " << family.help << "\n";
+		out << "# TYPE " << name << " " << family.type << "\n";
+		if (family.type == "histogram") {
+			long long cumulative = 0;
+			for (size_t i = 0; i < family.buckets.size(); i++) {
+				cumulative += family.buckets[i];
+				out << name << "_bucket{le=\"";
+				if (i < family.bounds.size())
+					out << family.bounds[i];
+				else
+					out << "+Inf";
+				out << "\"} " << cumulative << "\n";
+			}
+			out << name << "_sum " << family.sum << "\n";
+			out << name << "_count " << family.count << "\n";
+			continue;
+		}
+		for (auto &sample : family.samples) {
+			out << name;
+			if (!sample.first.empty())
+				out << "{" << sample.first << "}";
+			out << " " << sample.second << "\n";
+		}
+		if (family.type == "summary" && family.count > 0) {
+			out << name << "_sum " << family.sum << "\n";
+			out << name << "_count " << family.count << "\n";
+		}
+	}
+	return out.str();
+}
+
+MetricsExporter::MetricsExporter(const std::string &address, int port, std::function<std::string()> render):
+	mAddress(address),
+	mPort(port),
+	mFd(-1),
+	mRender(render),
+	mStop(false) {
+}
+
+MetricsExporter::~MetricsExporter() {
+	stop();
+	wait();
+}
+
+bool MetricsExporter::start() {
+	mFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (mFd < 0) {
+		std::cerr << "MetricsExporter::start: " << strerror(errno) << std::endl;
+		return false;
+	}
+	int on = 1;
+	setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(static_cast<uint16_t>(mPort));
+	if (inet_pton(AF_INET, mAddress.c_str(), &addr.sin_addr) != 1) {
+		std::cerr << "MetricsExporter::start: Invalid address " << mAddress << std::endl;
+		::close(mFd);
+		mFd = -1;
+		return false;
+	}
+	if (bind(mFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(mFd, 16) < 0) {
+		std::cerr << "MetricsExporter::start: Unable to listen on " << mAddress << ":" << mPort << ": " << strerror(errno) << std::endl;
+		::close(mFd);
+		mFd = -1;
+		return false;
+	}
+	socklen_t len = sizeof(addr);
+	getsockname(mFd, (struct sockaddr *)&addr, &len);
+	mPort = ntohs(addr.sin_port);
+	mThread = std::thread(&MetricsExporter::loop, this);
+	return true;
+}
+
+void MetricsExporter::stop() {
+	mStop = true;
+}
+
+void MetricsExporter::wait() {
+	if (mThread.joinable())
+		mThread.join();
+	if (mFd >= 0) {
+		::close(mFd);
+		mFd = -1;
+	}
+}
+
+int MetricsExporter::port() const {
+	return mPort;
+}
+
+void MetricsExporter::loop() {
+	struct pollfd pfd;
+	pfd.fd = mFd;
+	pfd.events = POLLIN;
+	while (!mStop) {
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		int fd = accept4(mFd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		serve(fd);
+		::close(fd);
+	}
+}
+
+void MetricsExporter::serve(int fd) {
+	// A scraper that never sends its request must not block the next one for long
+	struct timeval tv;
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	std::string request;
+	char buf[1024];
+	while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			break;
+		request.append(buf, static_cast<size_t>(n));
+	}
+
+	std::string status = "404 Not Found";
+	std::string body = "Not Found\n";
+	if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+		status = "200 OK";
+		body = mRender();
+	}
+	std::ostringstream response;
+	response << "HTTP/1.0 " << status << "\r\n"
+	         << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+	         << "Content-Length: " << body.size() << "\r\n"
+	         << "Connection: close\r\n\r\n"
+	         << body;
+	std::string out = response.str();
+	size_t sent = 0;
+	while (sent < out.size()) {
+		ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += static_cast<size_t>(n);
+	}
+}
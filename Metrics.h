@@ -0,0 +1,71 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_METRICS_H
+#define SPEEDTEST_METRICS_H
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Metric families rendered in the Prometheus text exposition format. Gauges and
+// counters keep one sample per label set, histograms have fixed bucket bounds and
+// summaries take precomputed quantiles, set() with a quantile label, plus their sum and count.
+// Every method is thread safe.
+class MetricsRegistry {
+public:
+	void gauge(const std::string &name, const std::string &help);
+	void counter(const std::string &name, const std::string &help);
+	void histogram(const std::string &name, const std::string &help, const std::vector<double> &bounds);
+	void summary(const std::string &name, const std::string &help);
+	void set(const std::string &name, double value, const std::string &labels = "");
+	void add(const std::string &name, double value, const std::string &labels = "");
+	void observe(const std::string &name, double value);
+	void summarize(const std::string &name, double sum, long long count);
+	void clear(const std::string &name);
+	std::string render() const;
+	static std::string label(const std::string &name, const std::string &value);
+private:
+	typedef struct family_t {
+		std::string type;
+		std::string help;
+		std::map<std::string, double> samples;
+		std::vector<double> bounds;
+		std::vector<long long> buckets;
+		double    sum;
+		long long count;
+	} Family;
+
+	void declare(const std::string &name, const std::string &type, const std::string &help);
+
+	std::map<std::string, Family> mFamilies;
+	std::vector<std::string> mOrder;
+	mutable std::mutex mMutex;
+};
+
+// Minimal HTTP/1.0 endpoint answering GET /metrics with the output of render. Requests
+// are served one at a time on a single thread; scrapes are rare and tiny.
+class MetricsExporter {
+public:
+	MetricsExporter(const std::string &address, int port, std::function<std::string()> render);
+	~MetricsExporter();
+	bool start();
+	void stop();
+	void wait();
+	int  port() const;
+private:
+	void loop();
+	void serve(int fd);
+
+	std::string mAddress;
+	int mPort;
+	int mFd;
+	std::function<std::string()> mRender;
+	std::thread mThread;
+	std::atomic<bool> mStop;
+};
+#endif // SPEEDTEST_METRICS_H
@@ -0,0 +1,27 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_MONOTONICCLOCK_H
+#define SPEEDTEST_MONOTONICCLOCK_H
+#include <chrono>
+#include <time.h>
+
+// Monotonic nanosecond timestamps for the measurement path. On Linux it reads
+// CLOCK_MONOTONIC_RAW, which is not slewed by NTP, and std::chrono::steady_clock elsewhere.
+class MonotonicClock {
+public:
+	static long long now() {
+#if defined(CLOCK_MONOTONIC_RAW)
+		struct timespec ts;
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0)
+			return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+#endif
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static double toMillis(const long long nanosec) {
+		return static_cast<double>(nanosec) / 1000000.0;
+	}
+};
+#endif // SPEEDTEST_MONOTONICCLOCK_H
@@ -0,0 +1,65 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <thread>
+#include "PingEngine.h"
+#include "SpeedTestClient.h"
+#include "MonotonicClock.h"
+
+PingEngine::PingEngine(int depth, long long spacing_ns, long timeout_ms):
+	mDepth(std::max(1, depth)),
+	mSpacingNs(spacing_ns),
+	mTimeoutMs(timeout_ms) {
+}
+
+// Clients that are not connected yet are connected in parallel first; those that fail are
+// left out and the samples are shared among the others. result is in send order. It
+// fails when no client connects or a connection breaks during the train.
+bool PingEngine::run(const std::vector<SpeedTestClient *> &clients, int samples, std::vector<PingSample> &result) {
+	result.clear();
+	std::vector<char> connected(clients.size(), 0);
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < clients.size(); i++) {
+		workers.push_back(std::thread([&clients, &connected, i]() {
+			connected[i] = clients[i] && clients[i]->connect();
+		}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+	std::vector<SpeedTestClient *> active;
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (connected[i])
+			active.push_back(clients[i]);
+	}
+	if (active.empty())
+		return false;
+
+	const int n = static_cast<int>(active.size());
+	const long long start = MonotonicClock::now();
+	std::vector<std::vector<PingSample>> trains(active.size());
+	std::vector<char> success(active.size(), 0);
+	workers.clear();
+	for (int i = 0; i < n; i++) {
+		const int count = samples / n + (i < samples % n ? 1 : 0);
+		const long long offset = mSpacingNs * i / n;
+		workers.push_back(std::thread([this, &active, &trains, &success, i, count, start, offset]() {
+			success[i] = active[i]->pingTrain(count, mDepth, mSpacingNs, start + offset, mTimeoutMs, trains[i]);
+		}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+
+	bool all = true;
+	for (int i = 0; i < n; i++) {
+		all = all && success[i];
+		result.insert(result.end(), trains[i].begin(), trains[i].end());
+	}
+	std::sort(result.begin(), result.end(), [](const PingSample &a, const PingSample &b) -> bool {
+		return a.sent_ns < b.sent_ns;
+	});
+	return all;
+}
@@ -0,0 +1,26 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_PINGENGINE_H
+#define SPEEDTEST_PINGENGINE_H
+#include <vector>
+#include "DataTypes.h"
+
+class SpeedTestClient;
+
+// Latency samples over several connections at once instead of one PING after another on
+// one socket. Every connection pipelines up to depth PINGs spaced by spacing, and the
+// connections start staggered by spacing / connections, so that the probes interleave
+// rather than leave in bursts. On a long path the wall time of a train drops from one
+// round trip per sample to about samples / (connections * depth) round trips.
+class PingEngine {
+public:
+	PingEngine(int depth, long long spacing_ns, long timeout_ms);
+	bool run(const std::vector<SpeedTestClient *> &clients, int samples, std::vector<PingSample> &result);
+private:
+	int  mDepth;
+	long long mSpacingNs;
+	long mTimeoutMs;
+};
+#endif // SPEEDTEST_PINGENGINE_H
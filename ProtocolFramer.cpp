@@ -0,0 +1,96 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include "ProtocolFramer.h"
+
+ProtocolFramer::ProtocolFramer(size_t capacity):
+	mBuffer(capacity),
+	mStart(0),
+	mEnd(0) {
+}
+
+void ProtocolFramer::reset() {
+	mStart = 0;
+	mEnd = 0;
+}
+
+// It blocks until a complete, non empty line is available
+bool ProtocolFramer::readLine(int fd, std::string &line) {
+	if (fd <= 0)
+		return false;
+	while (!nextLine(line)) {
+		if (fill(fd) < 1)
+			return false;
+	}
+	return true;
+}
+
+// Non-blocking variant: 1 when a line was framed, 0 when the socket would block, -1 on error or EOF
+int ProtocolFramer::tryReadLine(int fd, std::string &line) {
+	while (!nextLine(line)) {
+		auto n = fill(fd);
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+	return 1;
+}
+
+// It discards up to len buffered bytes, returning how many were consumed
+size_t ProtocolFramer::drain(size_t len) {
+	size_t n = std::min(len, mEnd - mStart);
+	mStart += n;
+	if (mStart == mEnd)
+		reset();
+	return n;
+}
+
+size_t ProtocolFramer::buffered() const {
+	return mEnd - mStart;
+}
+
+bool ProtocolFramer::nextLine(std::string &line) {
+	while (mStart < mEnd) {
+		auto begin = &mBuffer[mStart];
+		auto eol = static_cast<char *>(memchr(begin, '\n', mEnd - mStart));
+		auto cr  = static_cast<char *>(memchr(begin, '\r', mEnd - mStart));
+		if (cr && (!eol || cr < eol))
+			eol = cr;
+		if (!eol)
+			return false;
+		size_t len = static_cast<size_t>(eol - begin);
+		mStart += len + 1;
+		if (mStart == mEnd)
+			reset();
+		if (len > 0) {
+			line.assign(begin, len);
+			return true;
+		}
+	}
+	return false;
+}
+
+ssize_t ProtocolFramer::fill(int fd) {
+	if (mStart > 0 && mEnd == mBuffer.size()) {
+		memmove(&mBuffer[0], &mBuffer[mStart], mEnd - mStart);
+		mEnd -= mStart;
+		mStart = 0;
+	}
+	if (mEnd == mBuffer.size())
+		mBuffer.resize(mBuffer.size() * 2);
+	ssize_t n;
+	do {
+		n = read(fd, &mBuffer[mEnd], mBuffer.size() - mEnd);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0)
+		mEnd += static_cast<size_t>(n);
+	return n;
+}
@@ -0,0 +1,29 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_PROTOCOLFRAMER_H
+#define SPEEDTEST_PROTOCOLFRAMER_H
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Per-connection receive buffer that frames protocol replies (HELLO, PONG, OK ...)
+// out of large reads instead of reading the socket one byte at a time.
+class ProtocolFramer {
+public:
+	explicit ProtocolFramer(size_t capacity = 4096);
+	void reset();
+	bool readLine(int fd, std::string &line);
+	int  tryReadLine(int fd, std::string &line);
+	size_t drain(size_t len);
+	size_t buffered() const;
+private:
+	bool nextLine(std::string &line);
+	ssize_t fill(int fd);
+	std::vector<char> mBuffer;
+	size_t mStart;
+	size_t mEnd;
+};
+#endif // SPEEDTEST_PROTOCOLFRAMER_H
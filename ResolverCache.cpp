@@ -0,0 +1,141 @@
+//
+// Created on 10/16/26.
+//
+
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include "ResolverCache.h"
+#include "MonotonicClock.h"
+#include "SpeedTestConfig.h"
+
+ResolverCache::ResolverCache(long ttl_s):
+	mTtlNs(ttl_s * 1000000000LL) {
+}
+
+ResolverCache &ResolverCache::instance() {
+	static ResolverCache cache(SPEED_TEST_DNS_CACHE_TTL);
+	return cache;
+}
+
+// A failed lookup is not cached, the next connection tries again
+bool ResolverCache::resolve(const std::string &host, int port, const SocketOptions &options, std::vector<Address> &addresses) {
+	const std::string s = scope(options);
+	const std::string k = key(host, port);
+	std::promise<std::vector<Address>> promise;
+	std::shared_future<std::vector<Address>> future;
+	bool owner = false;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto &entries = mEntries[s];
+		auto it = entries.find(k);
+		if (it != entries.end() && MonotonicClock::now() - it->second.resolved_ns > mTtlNs) {
+			entries.erase(it);
+			it = entries.end();
+		}
+		if (it == entries.end()) {
+			Entry entry;
+			entry.addresses = promise.get_future().share();
+			entry.resolved_ns = MonotonicClock::now();
+			entry.preferred = false;
+			memset(&entry.winner, 0, sizeof(entry.winner));
+			it = entries.insert(std::make_pair(k, entry)).first;
+			owner = true;
+		}
+		future = it->second.addresses;
+	}
+	if (owner) {
+		auto found = lookup(host, port);
+		if (found.empty()) {
+			std::lock_guard<std::mutex> lock(mMutex);
+			mEntries[s].erase(k);
+		}
+		promise.set_value(found);
+	}
+
+	addresses = future.get();
+	if (addresses.empty())
+		return false;
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto &entries = mEntries[s];
+	auto it = entries.find(k);
+	if (it == entries.end() || !it->second.preferred)
+		return true;
+	for (size_t i = 0; i < addresses.size(); i++) {
+		if (same(addresses[i], it->second.winner)) {
+			Address winner = addresses[i];
+			addresses.erase(addresses.begin() + static_cast<long>(i));
+			addresses.insert(addresses.begin(), winner);
+			break;
+		}
+	}
+	return true;
+}
+
+void ResolverCache::prefer(const std::string &host, int port, const SocketOptions &options, const Address &address) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto &entries = mEntries[scope(options)];
+	auto it = entries.find(key(host, port));
+	if (it == entries.end())
+		return;
+	it->second.preferred = true;
+	it->second.winner = address;
+}
+
+// Runners over other uplinks keep their entries
+void ResolverCache::clear(const SocketOptions &options) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mEntries.erase(scope(options));
+}
+
+// getaddrinfo sorts by RFC 6724; the families are then interleaved, the first family of
+// that order first. AI_ADDRCONFIG is left out: it hides the loopback addresses of hosts
+// without other ones, and a family the host cannot reach fails fast in the race anyway.
+std::vector<ResolverCache::Address> ResolverCache::lookup(const std::string &host, int port) {
+	std::vector<Address> result;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *info = nullptr;
+	int ret = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &info);
+	if (ret != 0) {
+		std::cerr << ("ResolverCache::lookup: Unable to resolve " + host + ": " + gai_strerror(ret) + "\n") << std::flush;
+		return result;
+	}
+	std::vector<Address> first;
+	std::vector<Address> second;
+	for (auto ai = info; ai != nullptr; ai = ai->ai_next) {
+		if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		Address address;
+		memset(&address, 0, sizeof(address));
+		memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+		address.len = ai->ai_addrlen;
+		if (first.empty() || first[0].addr.ss_family == ai->ai_family)
+			first.push_back(address);
+		else
+			second.push_back(address);
+	}
+	freeaddrinfo(info);
+	for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+		if (i < first.size())
+			result.push_back(first[i]);
+		if (i < second.size())
+			result.push_back(second[i]);
+	}
+	return result;
+}
+
+std::string ResolverCache::key(const std::string &host, int port) {
+	return host + " " + std::to_string(port);
+}
+
+std::string ResolverCache::scope(const SocketOptions &options) {
+	return options.source_address + " " + options.device + " " + std::to_string(options.mark);
+}
+
+bool ResolverCache::same(const Address &a, const Address &b) {
+	return a.len == b.len && memcmp(&a.addr, &b.addr, a.len) == 0;
+}
@@ -0,0 +1,51 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_RESOLVERCACHE_H
+#define SPEEDTEST_RESOLVERCACHE_H
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include "DataTypes.h"
+
+// Addresses of the servers, shared by every connection of the process. A host:port is
+// looked up once with getaddrinfo, IPv4 and IPv6 alike, however many connections ask for
+// it at the same time: the first one resolves, the others wait for its answer. Addresses
+// come with the families interleaved as RFC 8305 asks, and the one that won the last
+// connection race for the host goes first, so that later connections need no race.
+// Entries are kept per SocketOptions, as the winner over one uplink says nothing about
+// another, and expire after ttl_s or on clear() of their SocketOptions, once per test run.
+class ResolverCache {
+public:
+	typedef struct address_t {
+		struct sockaddr_storage addr;
+		socklen_t len;
+	} Address;
+
+	explicit ResolverCache(long ttl_s);
+	static ResolverCache &instance();
+	bool resolve(const std::string &host, int port, const SocketOptions &options, std::vector<Address> &addresses);
+	void prefer(const std::string &host, int port, const SocketOptions &options, const Address &address);
+	void clear(const SocketOptions &options);
+	static std::vector<Address> lookup(const std::string &host, int port);
+private:
+	typedef struct entry_t {
+		std::shared_future<std::vector<Address>> addresses;
+		long long resolved_ns;
+		bool   preferred;
+		Address winner;
+	} Entry;
+
+	static std::string key(const std::string &host, int port);
+	static std::string scope(const SocketOptions &options);
+	static bool same(const Address &a, const Address &b);
+
+	long long mTtlNs;
+	std::map<std::string, std::map<std::string, Entry>> mEntries;
+	std::mutex mMutex;
+};
+#endif // SPEEDTEST_RESOLVERCACHE_H
@@ -0,0 +1,279 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cstring>
+#include "ServerCatalog.h"
+
+ServerView::ServerView(const ServerCatalog *catalog, const size_t index):
+	mCatalog(catalog),
+	mIndex(index) {
+}
+
+size_t ServerView::index() const {
+	return mIndex;
+}
+
+int ServerView::id() const {
+	return mCatalog->id(mIndex);
+}
+
+float ServerView::lat() const {
+	return mCatalog->lat(mIndex);
+}
+
+float ServerView::lon() const {
+	return mCatalog->lon(mIndex);
+}
+
+float ServerView::distance() const {
+	return mCatalog->distance(mIndex);
+}
+
+const char *ServerView::url() const {
+	return mCatalog->str(ServerCatalog::url, mIndex);
+}
+
+const char *ServerView::name() const {
+	return mCatalog->str(ServerCatalog::name, mIndex);
+}
+
+const char *ServerView::country() const {
+	return mCatalog->str(ServerCatalog::country, mIndex);
+}
+
+const char *ServerView::countryCode() const {
+	return mCatalog->str(ServerCatalog::country_code, mIndex);
+}
+
+const char *ServerView::host() const {
+	return mCatalog->str(ServerCatalog::host, mIndex);
+}
+
+const char *ServerView::sponsor() const {
+	return mCatalog->str(ServerCatalog::sponsor, mIndex);
+}
+
+ServerInfo ServerView::info() const {
+	return mCatalog->info(mIndex);
+}
+
+ServerCatalog::ServerCatalog():
+	mStrings(0) {
+}
+
+size_t ServerCatalog::add(const ServerInfo &info) {
+	mId.push_back(info.id);
+	mLat.push_back(info.lat);
+	mLon.push_back(info.lon);
+	mDistance.push_back(info.distance);
+	mColumns[url].push_back(intern(info.url));
+	mColumns[name].push_back(intern(info.name));
+	mColumns[country].push_back(intern(info.country));
+	mColumns[country_code].push_back(intern(info.country_code));
+	mColumns[host].push_back(intern(info.host));
+	mColumns[sponsor].push_back(intern(info.sponsor));
+	return mId.size() - 1;
+}
+
+void ServerCatalog::clear() {
+	mId.clear();
+	mLat.clear();
+	mLon.clear();
+	mDistance.clear();
+	for (auto &column : mColumns)
+		column.clear();
+	mArena.clear();
+	mSlots.clear();
+	mStrings = 0;
+}
+
+void ServerCatalog::reserve(const size_t n) {
+	mId.reserve(n);
+	mLat.reserve(n);
+	mLon.reserve(n);
+	mDistance.reserve(n);
+	for (auto &column : mColumns)
+		column.reserve(n);
+}
+
+// Drops the spare capacity left behind by a build of unknown size
+void ServerCatalog::shrink() {
+	mId.shrink_to_fit();
+	mLat.shrink_to_fit();
+	mLon.shrink_to_fit();
+	mDistance.shrink_to_fit();
+	for (auto &column : mColumns)
+		column.shrink_to_fit();
+	mArena.shrink_to_fit();
+}
+
+size_t ServerCatalog::size() const {
+	return mId.size();
+}
+
+bool ServerCatalog::empty() const {
+	return mId.empty();
+}
+
+ServerView ServerCatalog::operator[](const size_t i) const {
+	return ServerView(this, i);
+}
+
+ServerInfo ServerCatalog::info(const size_t i) const {
+	ServerInfo info = ServerInfo();
+	info.url          = str(url, i);
+	info.lat          = mLat[i];
+	info.lon          = mLon[i];
+	info.name         = str(name, i);
+	info.country      = str(country, i);
+	info.country_code = str(country_code, i);
+	info.host         = str(host, i);
+	info.id           = mId[i];
+	info.sponsor      = str(sponsor, i);
+	info.distance     = mDistance[i];
+	return info;
+}
+
+int ServerCatalog::id(const size_t i) const {
+	return mId[i];
+}
+
+float ServerCatalog::lat(const size_t i) const {
+	return mLat[i];
+}
+
+float ServerCatalog::lon(const size_t i) const {
+	return mLon[i];
+}
+
+float ServerCatalog::distance(const size_t i) const {
+	return mDistance[i];
+}
+
+void ServerCatalog::setDistance(const size_t i, const float km) {
+	mDistance[i] = km;
+}
+
+const char *ServerCatalog::str(const Field field, const size_t i) const {
+	return mArena.data() + mColumns[field][i];
+}
+
+bool ServerCatalog::find(const int id, size_t &index) const {
+	auto it = std::find(mId.begin(), mId.end(), id);
+	if (it == mId.end())
+		return false;
+	index = static_cast<size_t>(it - mId.begin());
+	return true;
+}
+
+bool ServerCatalog::findHost(const std::string &value, size_t &index) const {
+	uint32_t offset;
+	if (!lookup(value, offset))
+		return false;
+	auto &column = mColumns[host];
+	auto it = std::find(column.begin(), column.end(), offset);
+	if (it == column.end())
+		return false;
+	index = static_cast<size_t>(it - column.begin());
+	return true;
+}
+
+std::vector<size_t> ServerCatalog::where(const Field field, const std::string &value) const {
+	std::vector<size_t> rows;
+	uint32_t offset;
+	if (!lookup(value, offset))
+		return rows;
+	auto &column = mColumns[field];
+	for (size_t i = 0; i < column.size(); i++) {
+		if (column[i] == offset)
+			rows.push_back(i);
+	}
+	return rows;
+}
+
+std::vector<size_t> ServerCatalog::orderBy(const Field field) const {
+	std::vector<size_t> rows(size());
+	for (size_t i = 0; i < rows.size(); i++)
+		rows[i] = i;
+	auto &column = mColumns[field];
+	std::stable_sort(rows.begin(), rows.end(), [this, &column](size_t a, size_t b) -> bool {
+		return column[a] != column[b] && strcmp(mArena.data() + column[a], mArena.data() + column[b]) < 0;
+	});
+	return rows;
+}
+
+std::vector<size_t> ServerCatalog::orderByDistance() const {
+	std::vector<size_t> rows(size());
+	for (size_t i = 0; i < rows.size(); i++)
+		rows[i] = i;
+	std::stable_sort(rows.begin(), rows.end(), [this](size_t a, size_t b) -> bool {
+		return mDistance[a] < mDistance[b];
+	});
+	return rows;
+}
+
+size_t ServerCatalog::memoryUsage() const {
+	size_t bytes = sizeof(*this);
+	bytes += mId.capacity() * sizeof(int32_t);
+	bytes += (mLat.capacity() + mLon.capacity() + mDistance.capacity()) * sizeof(float);
+	for (auto &column : mColumns)
+		bytes += column.capacity() * sizeof(uint32_t);
+	bytes += mArena.capacity();
+	bytes += mSlots.capacity() * sizeof(uint32_t);
+	return bytes;
+}
+
+// Open addressing table of arena offsets + 1, 0 marks a free slot. FNV-1a over the bytes.
+uint32_t ServerCatalog::slotOf(const char *s, const size_t len) const {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= static_cast<unsigned char>(s[i]);
+		hash *= 16777619u;
+	}
+	const uint32_t mask = static_cast<uint32_t>(mSlots.size() - 1);
+	uint32_t slot = hash & mask;
+	while (mSlots[slot] != 0) {
+		const char *candidate = mArena.data() + mSlots[slot] - 1;
+		if (strncmp(candidate, s, len) == 0 && candidate[len] == '\0')
+			break;
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// The arena only ever holds distinct strings, back to back
+void ServerCatalog::rehash(const size_t slots) {
+	mSlots.assign(slots, 0);
+	for (size_t offset = 0; offset < mArena.size(); ) {
+		const char *s = mArena.data() + offset;
+		const size_t len = strlen(s);
+		mSlots[slotOf(s, len)] = static_cast<uint32_t>(offset + 1);
+		offset += len + 1;
+	}
+}
+
+bool ServerCatalog::lookup(const std::string &s, uint32_t &offset) const {
+	if (mSlots.empty())
+		return false;
+	const uint32_t slot = slotOf(s.c_str(), s.length());
+	if (mSlots[slot] == 0)
+		return false;
+	offset = mSlots[slot] - 1;
+	return true;
+}
+
+uint32_t ServerCatalog::intern(const std::string &s) {
+	if ((mStrings + 1) * 4 > mSlots.size() * 3)
+		rehash(std::max<size_t>(64, mSlots.size() * 2));
+	const uint32_t slot = slotOf(s.c_str(), s.length());
+	if (mSlots[slot] != 0)
+		return mSlots[slot] - 1;
+	const uint32_t offset = static_cast<uint32_t>(mArena.size());
+	mArena.insert(mArena.end(), s.begin(), s.end());
+	mArena.push_back('\0');
+	mSlots[slot] = offset + 1;
+	mStrings++;
+	return offset;
+}
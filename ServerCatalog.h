@@ -0,0 +1,78 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SERVERCATALOG_H
+#define SPEEDTEST_SERVERCATALOG_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "DataTypes.h"
+
+class ServerCatalog;
+
+// Lightweight handle on one row of a ServerCatalog. It stays valid as long as the
+// catalog is not modified; info() materializes the row as a ServerInfo.
+class ServerView {
+public:
+	ServerView(const ServerCatalog *catalog, const size_t index);
+	size_t index() const;
+	int   id() const;
+	float lat() const;
+	float lon() const;
+	float distance() const;
+	const char *url() const;
+	const char *name() const;
+	const char *country() const;
+	const char *countryCode() const;
+	const char *host() const;
+	const char *sponsor() const;
+	ServerInfo info() const;
+private:
+	const ServerCatalog *mCatalog;
+	size_t mIndex;
+};
+
+// Server list stored column-wise. Numeric fields live in packed arrays and every string
+// is interned once into a single NUL-terminated arena, so rows are a handful of 32 bit
+// arena offsets and repeated values (countries, sponsors) cost nothing after the first.
+// Filtering on a string column compares ids, not characters.
+class ServerCatalog {
+public:
+	enum Field { url, name, country, country_code, host, sponsor, fields };
+	ServerCatalog();
+	size_t add(const ServerInfo &info);
+	void clear();
+	void reserve(const size_t n);
+	void shrink();
+	size_t size() const;
+	bool empty() const;
+	ServerView operator[](const size_t i) const;
+	ServerInfo info(const size_t i) const;
+	int   id(const size_t i) const;
+	float lat(const size_t i) const;
+	float lon(const size_t i) const;
+	float distance(const size_t i) const;
+	void  setDistance(const size_t i, const float km);
+	const char *str(const Field field, const size_t i) const;
+	bool find(const int id, size_t &index) const;
+	bool findHost(const std::string &host, size_t &index) const;
+	std::vector<size_t> where(const Field field, const std::string &value) const;
+	std::vector<size_t> orderBy(const Field field) const;
+	std::vector<size_t> orderByDistance() const;
+	size_t memoryUsage() const;
+private:
+	uint32_t intern(const std::string &s);
+	bool lookup(const std::string &s, uint32_t &offset) const;
+	uint32_t slotOf(const char *s, const size_t len) const;
+	void rehash(const size_t slots);
+	std::vector<int32_t>  mId;
+	std::vector<float>    mLat;
+	std::vector<float>    mLon;
+	std::vector<float>    mDistance;
+	std::vector<uint32_t> mColumns[fields];
+	std::vector<char>     mArena;
+	size_t                mStrings;
+	std::vector<uint32_t> mSlots;
+};
+#endif // SPEEDTEST_SERVERCATALOG_H
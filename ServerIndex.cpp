@@ -0,0 +1,167 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "ServerIndex.h"
+
+ServerIndex::ServerIndex() {
+}
+
+void ServerIndex::toUnit(const float lat, const float lon, float &x, float &y, float &z) {
+	const double latr = lat * M_PI / 180;
+	const double lonr = lon * M_PI / 180;
+	x = static_cast<float>(std::cos(latr) * std::cos(lonr));
+	y = static_cast<float>(std::cos(latr) * std::sin(lonr));
+	z = static_cast<float>(std::sin(latr));
+}
+
+void ServerIndex::build(const ServerCatalog &servers) {
+	const size_t n = servers.size();
+	mX.resize(n);
+	mY.resize(n);
+	mZ.resize(n);
+	mOrder.resize(n);
+	mAxis.assign(n, 0);
+	for (size_t i = 0; i < n; i++) {
+		toUnit(servers.lat(i), servers.lon(i), mX[i], mY[i], mZ[i]);
+		mOrder[i] = i;
+	}
+	buildRange(0, n);
+}
+
+size_t ServerIndex::size() const {
+	return mOrder.size();
+}
+
+// The node of [lo, hi) is its median mOrder[(lo + hi) / 2], split on the axis of widest spread
+void ServerIndex::buildRange(const size_t lo, const size_t hi) {
+	if (hi - lo < 2)
+		return;
+	const std::vector<float> *coords[3] = { &mX, &mY, &mZ };
+	unsigned char axis = 0;
+	float widest = -1;
+	for (unsigned char a = 0; a < 3; a++) {
+		float min = 2, max = -2;
+		for (size_t i = lo; i < hi; i++) {
+			float v = (*coords[a])[mOrder[i]];
+			min = std::min(min, v);
+			max = std::max(max, v);
+		}
+		if (max - min > widest) {
+			widest = max - min;
+			axis = a;
+		}
+	}
+	const std::vector<float> &c = *coords[axis];
+	const size_t mid = lo + (hi - lo) / 2;
+	std::nth_element(mOrder.begin() + lo, mOrder.begin() + mid, mOrder.begin() + hi, [&c](size_t a, size_t b) -> bool {
+		return c[a] < c[b];
+	});
+	mAxis[mid] = axis;
+	buildRange(lo, mid);
+	buildRange(mid + 1, hi);
+}
+
+float ServerIndex::chord2(const size_t i, const float x, const float y, const float z) const {
+	const float dx = mX[i] - x;
+	const float dy = mY[i] - y;
+	const float dz = mZ[i] - z;
+	return dx * dx + dy * dy + dz * dz;
+}
+
+// best is kept as a max-heap on squared chord, bounded to query.k entries
+void ServerIndex::search(const size_t lo, const size_t hi, Query &query, std::vector<std::pair<float, size_t>> &best) const {
+	if (lo >= hi)
+		return;
+	const size_t mid = lo + (hi - lo) / 2;
+	const size_t node = mOrder[mid];
+	const float d2 = chord2(node, query.x, query.y, query.z);
+	if (d2 <= query.limit) {
+		best.push_back(std::make_pair(d2, node));
+		std::push_heap(best.begin(), best.end());
+		if (best.size() > query.k) {
+			std::pop_heap(best.begin(), best.end());
+			best.pop_back();
+		}
+		if (best.size() == query.k)
+			query.limit = best.front().first;
+	}
+	if (hi - lo == 1)
+		return;
+
+	float delta;
+	switch (mAxis[mid]) {
+		case 0:  delta = query.x - mX[node]; break;
+		case 1:  delta = query.y - mY[node]; break;
+		default: delta = query.z - mZ[node]; break;
+	}
+	const bool left_first = delta < 0;
+	if (left_first)
+		search(lo, mid, query, best);
+	else
+		search(mid + 1, hi, query, best);
+	if (delta * delta <= query.limit) {
+		if (left_first)
+			search(mid + 1, hi, query, best);
+		else
+			search(lo, mid, query, best);
+	}
+}
+
+std::vector<size_t> ServerIndex::kNearest(const float lat, const float lon, const size_t k) const {
+	std::vector<size_t> result;
+	if (k == 0 || mOrder.empty())
+		return result;
+	Query query = Query();
+	toUnit(lat, lon, query.x, query.y, query.z);
+	query.k = k;
+	query.limit = 5; // above the largest squared chord of the unit sphere (4)
+	std::vector<std::pair<float, size_t>> best;
+	best.reserve(std::min(k, mOrder.size()) + 1);
+	search(0, mOrder.size(), query, best);
+	std::sort_heap(best.begin(), best.end());
+	for (auto &entry : best)
+		result.push_back(entry.second);
+	return result;
+}
+
+std::vector<size_t> ServerIndex::withinRadius(const float lat, const float lon, const float radius_km) const {
+	std::vector<size_t> result;
+	if (radius_km < 0 || mOrder.empty())
+		return result;
+	Query query = Query();
+	toUnit(lat, lon, query.x, query.y, query.z);
+	const double chord = 2 * std::sin(std::min(radius_km / EARTH_RADIUS_KM, static_cast<float>(M_PI)) / 2);
+	query.k = mOrder.size();
+	query.limit = static_cast<float>(chord * chord);
+	std::vector<std::pair<float, size_t>> best;
+	search(0, mOrder.size(), query, best);
+	std::sort_heap(best.begin(), best.end());
+	for (auto &entry : best)
+		result.push_back(entry.second);
+	return result;
+}
+
+// Great-circle distance in km from (lat, lon) to every server, in index order.
+// Both passes are straight loops over the coordinate arrays so the compiler can vectorize them.
+void ServerIndex::distances(const float lat, const float lon, std::vector<float> &km) const {
+	const size_t n = mOrder.size();
+	km.resize(n);
+	float x, y, z;
+	toUnit(lat, lon, x, y, z);
+	const float *px = mX.data();
+	const float *py = mY.data();
+	const float *pz = mZ.data();
+	float *out = km.data();
+	for (size_t i = 0; i < n; i++) {
+		const float dx = px[i] - x;
+		const float dy = py[i] - y;
+		const float dz = pz[i] - z;
+		out[i] = dx * dx + dy * dy + dz * dz;
+	}
+	for (size_t i = 0; i < n; i++) {
+		out[i] = 2 * EARTH_RADIUS_KM * std::asin(std::min(1.0f, 0.5f * std::sqrt(out[i])));
+	}
+}
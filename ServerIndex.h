@@ -0,0 +1,41 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SERVERINDEX_H
+#define SPEEDTEST_SERVERINDEX_H
+#include <vector>
+#include <cstddef>
+#include "DataTypes.h"
+#include "ServerCatalog.h"
+
+// Spatial index over server coordinates. Every server is mapped to a point on the unit
+// sphere and stored structure-of-arrays; an implicit k-d tree over those points answers
+// k-nearest and radius queries. Straight-line (chord) distance in 3D is monotonic with
+// great-circle distance, so the tree only ever compares squared chords.
+// Queries return indices into the list the index was built from, nearest first.
+class ServerIndex {
+public:
+	ServerIndex();
+	void build(const ServerCatalog &servers);
+	size_t size() const;
+	std::vector<size_t> kNearest(const float lat, const float lon, const size_t k) const;
+	std::vector<size_t> withinRadius(const float lat, const float lon, const float radius_km) const;
+	void distances(const float lat, const float lon, std::vector<float> &km) const;
+private:
+	typedef struct query_t {
+		float x, y, z;
+		size_t k;
+		float limit;
+	} Query;
+	void buildRange(const size_t lo, const size_t hi);
+	void search(const size_t lo, const size_t hi, Query &query, std::vector<std::pair<float, size_t>> &best) const;
+	float chord2(const size_t i, const float x, const float y, const float z) const;
+	static void toUnit(const float lat, const float lon, float &x, float &y, float &z);
+	std::vector<float> mX;
+	std::vector<float> mY;
+	std::vector<float> mZ;
+	std::vector<size_t> mOrder;
+	std::vector<unsigned char> mAxis;
+};
+#endif // SPEEDTEST_SERVERINDEX_H
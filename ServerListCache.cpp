@@ -0,0 +1,201 @@
+//
+// Created on 10/16/26.
+//
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ServerListCache.h"
+
+static const char     CACHE_MAGIC[4] = {'S', 'T', 'S', 'L'};
+static const uint32_t CACHE_VERSION  = 1;
+
+typedef struct cache_string_t {
+	uint32_t offset;
+	uint32_t length;
+} CacheString;
+
+typedef struct cache_header_t {
+	char        magic[4];
+	uint32_t    version;
+	int64_t     created;
+	uint32_t    count;
+	uint32_t    string_bytes;
+	CacheString ip_address;
+	CacheString isp;
+	float       lat;
+	float       lon;
+} CacheHeader;
+
+typedef struct cache_record_t {
+	int32_t     id;
+	float       lat;
+	float       lon;
+	float       distance;
+	CacheString url;
+	CacheString name;
+	CacheString country;
+	CacheString country_code;
+	CacheString host;
+	CacheString sponsor;
+} CacheRecord;
+
+ServerListCache::ServerListCache(const std::string &path, const long ttl_seconds):
+	mPath(path),
+	mTtl(ttl_seconds) {
+}
+
+// $XDG_CACHE_HOME/SpeedTest/servers.bin, or ~/.cache/SpeedTest/servers.bin
+std::string ServerListCache::defaultPath() {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	if (xdg && *xdg)
+		return std::string(xdg) + "/SpeedTest/servers.bin";
+	const char *home = getenv("HOME");
+	if (home && *home)
+		return std::string(home) + "/.cache/SpeedTest/servers.bin";
+	return "";
+}
+
+bool ServerListCache::enabled() const {
+	return !mPath.empty() && mTtl > 0;
+}
+
+bool ServerListCache::load(ServerCatalog &servers, IPInfo &info, bool &stale) const {
+	if (!enabled())
+		return false;
+	int fd = open(mPath.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader)) {
+		close(fd);
+		return false;
+	}
+	size_t size = static_cast<size_t>(st.st_size);
+	void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	auto base = static_cast<const char *>(map);
+	CacheHeader header;
+	memcpy(&header, base, sizeof(header));
+	size_t records_end = sizeof(CacheHeader) + static_cast<size_t>(header.count) * sizeof(CacheRecord);
+	bool valid = memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0
+		&& header.version == CACHE_VERSION
+		&& records_end + header.string_bytes == size;
+	if (!valid) {
+		munmap(map, size);
+		return false;
+	}
+
+	const char *blob = base + records_end;
+	auto str = [blob, &header](const CacheString &s, std::string &out) -> bool {
+		if (static_cast<uint64_t>(s.offset) + s.length > header.string_bytes)
+			return false;
+		out.assign(blob + s.offset, s.length);
+		return true;
+	};
+
+	ServerCatalog loaded;
+	loaded.reserve(header.count);
+	IPInfo ip = IPInfo();
+	valid = str(header.ip_address, ip.ip_address) && str(header.isp, ip.isp);
+	ip.lat = header.lat;
+	ip.lon = header.lon;
+	for (uint32_t i = 0; valid && i < header.count; i++) {
+		CacheRecord record;
+		memcpy(&record, base + sizeof(CacheHeader) + i * sizeof(CacheRecord), sizeof(record));
+		ServerInfo server = ServerInfo();
+		server.id = record.id;
+		server.lat = record.lat;
+		server.lon = record.lon;
+		server.distance = record.distance;
+		valid = str(record.url, server.url)
+			&& str(record.name, server.name)
+			&& str(record.country, server.country)
+			&& str(record.country_code, server.country_code)
+			&& str(record.host, server.host)
+			&& str(record.sponsor, server.sponsor);
+		loaded.add(server);
+	}
+	munmap(map, size);
+	if (!valid || loaded.empty())
+		return false;
+
+	servers = std::move(loaded);
+	info = ip;
+	stale = static_cast<int64_t>(time(nullptr)) - header.created > mTtl;
+	return true;
+}
+
+bool ServerListCache::store(const ServerCatalog &servers, const IPInfo &info) const {
+	if (!enabled() || servers.empty())
+		return false;
+
+	std::string blob;
+	auto add = [&blob](const std::string &s) -> CacheString {
+		CacheString ref;
+		ref.offset = static_cast<uint32_t>(blob.size());
+		ref.length = static_cast<uint32_t>(s.size());
+		blob.append(s);
+		return ref;
+	};
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.created = static_cast<int64_t>(time(nullptr));
+	header.count = static_cast<uint32_t>(servers.size());
+	header.ip_address = add(info.ip_address);
+	header.isp = add(info.isp);
+	header.lat = info.lat;
+	header.lon = info.lon;
+
+	std::vector<CacheRecord> records(servers.size());
+	for (size_t i = 0; i < servers.size(); i++) {
+		CacheRecord &record = records[i];
+		memset(&record, 0, sizeof(record));
+		record.id = servers.id(i);
+		record.lat = servers.lat(i);
+		record.lon = servers.lon(i);
+		record.distance = servers.distance(i);
+		record.url = add(servers.str(ServerCatalog::url, i));
+		record.name = add(servers.str(ServerCatalog::name, i));
+		record.country = add(servers.str(ServerCatalog::country, i));
+		record.country_code = add(servers.str(ServerCatalog::country_code, i));
+		record.host = add(servers.str(ServerCatalog::host, i));
+		record.sponsor = add(servers.str(ServerCatalog::sponsor, i));
+	}
+	header.string_bytes = static_cast<uint32_t>(blob.size());
+
+	// mkdir -p of the cache directory
+	for (size_t pos = mPath.find('/', 1); pos != std::string::npos; pos = mPath.find('/', pos + 1))
+		mkdir(mPath.substr(0, pos).c_str(), 0755);
+
+	// A unique temporary file per call, concurrent writers in one process or several
+	// each rename a complete file of their own
+	std::string path = mPath + ".tmp.XXXXXX";
+	std::vector<char> tmp(path.begin(), path.end());
+	tmp.push_back('\0');
+	int fd = mkstemp(tmp.data());
+	if (fd < 0)
+		return false;
+	bool ok = fchmod(fd, 0644) == 0
+		&& write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header))
+		&& write(fd, records.data(), records.size() * sizeof(CacheRecord)) == static_cast<ssize_t>(records.size() * sizeof(CacheRecord))
+		&& write(fd, blob.data(), blob.size()) == static_cast<ssize_t>(blob.size())
+		&& fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp.data(), mPath.c_str()) != 0) {
+		unlink(tmp.data());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,26 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SERVERLISTCACHE_H
+#define SPEEDTEST_SERVERLISTCACHE_H
+#include <string>
+#include <vector>
+#include "DataTypes.h"
+#include "ServerCatalog.h"
+
+// On-disk cache of the parsed server list and of the IP info it was ranked against.
+// The file is a fixed-layout binary image (header, fixed-size records, string blob)
+// read back through mmap; it is replaced atomically with a write-then-rename.
+class ServerListCache {
+public:
+	ServerListCache(const std::string &path, const long ttl_seconds);
+	static std::string defaultPath();
+	bool enabled() const;
+	bool load(ServerCatalog &servers, IPInfo &info, bool &stale) const;
+	bool store(const ServerCatalog &servers, const IPInfo &info) const;
+private:
+	std::string mPath;
+	long mTtl;
+};
+#endif // SPEEDTEST_SERVERLISTCACHE_H
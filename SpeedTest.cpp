@@ -2,128 +2,351 @@
 // Created by Francesco Laurita on 5/29/16.
 //
 
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include "SpeedTest.h"
 #include "MD5Util.h"
+#include "MonotonicClock.h"
+#include "ThroughputEstimator.h"
 #include <netdb.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 SpeedTest::SpeedTest(float minServerVersion):
 	mLatency(0),
 	mUploadSpeed(0),
-	mDownloadSpeed(0) {
+	mDownloadSpeed(0),
+	mEngine(TransferEngine::threads),
+	mMode(TransferMode::chunked),
+	mTolerance(SPEED_TEST_CONVERGENCE_TOLERANCE),
+	mCancelled(false),
+	mSocketOptions(),
+	mCache(ServerListCache::defaultPath(), SPEED_TEST_SERVER_CACHE_TTL),
+	mCacheLoaded(false),
+	mPool(SPEED_TEST_CONNECTION_POOL_SIZE),
+	mLoadedLatency(false) {
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 	mIpInfo = IPInfo();
-	mServerList = std::vector<ServerInfo>();
+	mDownloadResult = ThroughputResult();
+	mUploadResult = ThroughputResult();
 	mMinSupportedServer = minServerVersion;
 }
 
+// A refresh still running on exit is cancelled rather than waited for, the next run tries again
 SpeedTest::~SpeedTest() {
+	if (mCacheRefresher)
+		mCacheRefresher->setCancelled(true);
+	if (mCacheRefresh.joinable())
+		mCacheRefresh.join();
 	mServerList.clear();
 	curl_global_cleanup();
 }
 
 bool SpeedTest::ipInfo(IPInfo &info) {
-	if (!mIpInfo.ip_address.empty()) {
-		info = mIpInfo;
-		return true;
-	}
+	loadServerListCache();
+	if (mIpInfo.ip_address.empty() && !requestIpInfo(mIpInfo))
+		return false;
+	info = mIpInfo;
+	return true;
+}
+
+bool SpeedTest::requestIpInfo(IPInfo &info) {
 	std::string postdata = "";
 	std::stringstream rs;
 	auto code = httpRequest(SPEED_TEST_IP_INFO_API_URL, postdata, rs);
 	if (code == CURLE_OK) {
 		auto values = SpeedTest::parseQueryString(rs.str());
 		rs.clear();
-		mIpInfo.ip_address = values["ip_address"];
-		mIpInfo.isp = values["isp"];
-		mIpInfo.lat = std::stof(values["lat"]);
-		mIpInfo.lon = std::stof(values["lon"]);
+		info.ip_address = values["ip_address"];
+		info.isp = values["isp"];
+		info.lat = std::stof(values["lat"]);
+		info.lon = std::stof(values["lon"]);
 		values.clear();
-		info = mIpInfo;
 		return true;
 	}
 	return false;
 }
 
-const std::vector<ServerInfo> &SpeedTest::serverList() {
-	if (!mServerList.empty())
+// cb, when given, sees every server as soon as it is parsed, in document order, while the list is
+// still downloading. A cached list is replayed through it.
+const ServerCatalog &SpeedTest::serverList(std::function<void(const ServerInfo &)> cb) {
+	loadServerListCache();
+	if (!mServerList.empty()) {
+		if (cb) {
+			for (size_t i = 0; i < mServerList.size(); i++)
+				cb(mServerList.info(i));
+		}
+		return mServerList;
+	}
+	IPInfo info;
+	if (!ipInfo(info)) {
+		std::cerr << "SpeedTest::serverList: Unable to retrieve your IP info." << std::endl;
 		return mServerList;
+	}
 	int http_code = 0;
-	fetchServers(SPEED_TEST_SERVER_LIST_URL, mServerList, http_code);
+	if (fetchServers(SPEED_TEST_SERVER_LIST_URL, info, mServerList, http_code, cb) && !mServerList.empty()) {
+		indexServerList();
+		mCache.store(mServerList, info);
+	}
 	return mServerList;
 }
 
+// The servers nearest to (lat, lon), nearest first, with distance relative to that point.
+// Cheap enough to re-rank the same list from many vantage points.
+std::vector<ServerInfo> SpeedTest::nearestServers(const float lat, const float lon, const size_t k) {
+	serverList();
+	std::vector<ServerInfo> nearest;
+	for (auto i : mServerIndex.kNearest(lat, lon, k)) {
+		ServerInfo info = mServerList.info(i);
+		info.distance = harversine(std::make_pair(lat, lon), std::make_pair(info.lat, info.lon));
+		nearest.push_back(info);
+	}
+	return nearest;
+}
+
+std::vector<ServerInfo> SpeedTest::serversWithin(const float lat, const float lon, const float radius_km) {
+	serverList();
+	std::vector<ServerInfo> within;
+	for (auto i : mServerIndex.withinRadius(lat, lon, radius_km)) {
+		ServerInfo info = mServerList.info(i);
+		info.distance = harversine(std::make_pair(lat, lon), std::make_pair(info.lat, info.lon));
+		within.push_back(info);
+	}
+	return within;
+}
+
+// It rebuilds the spatial index and refreshes every distance from the current IP location in one batch
+void SpeedTest::indexServerList() {
+	mServerIndex.build(mServerList);
+	std::vector<float> km;
+	mServerIndex.distances(mIpInfo.lat, mIpInfo.lon, km);
+	for (size_t i = 0; i < mServerList.size(); i++)
+		mServerList.setDistance(i, km[i]);
+}
+
+// An empty path or a non positive TTL disables the cache. It must be set before ipInfo() and serverList()
+void SpeedTest::setServerListCache(const std::string &path, long ttl_seconds) {
+	mCache = ServerListCache(path, ttl_seconds);
+}
+
+// A cached list is used as is, even when stale: in that case a fresh copy is written
+// to disk in the background for the next run, by an instance of its own.
+void SpeedTest::loadServerListCache() {
+	if (mCacheLoaded)
+		return;
+	mCacheLoaded = true;
+	ServerCatalog servers;
+	IPInfo info = IPInfo();
+	bool stale = false;
+	if (!mCache.load(servers, info, stale))
+		return;
+	mServerList = std::move(servers);
+	// Behind a given uplink the public address may not be the one cached
+	if (mSocketOptions.source_address.empty() && mSocketOptions.device.empty())
+		mIpInfo = info;
+	indexServerList();
+	if (stale) {
+		mCacheRefresher.reset(new SpeedTest(mMinSupportedServer));
+		mCacheRefresher->mSocketOptions = mSocketOptions;
+		mCacheRefresher->mCache = mCache;
+		mCacheRefresh = std::thread(&SpeedTest::refreshServerListCache, mCacheRefresher.get());
+	}
+}
+
+// It runs off the main thread on the refresher instance, which shares no state with its owner
+void SpeedTest::refreshServerListCache() {
+	IPInfo info = IPInfo();
+	if (!requestIpInfo(info))
+		return;
+	ServerCatalog servers;
+	int http_code = 0;
+	if (fetchServers(SPEED_TEST_SERVER_LIST_URL, info, servers, http_code) && !servers.empty())
+		mCache.store(servers, info);
+}
+
 const ServerInfo SpeedTest::bestServer(const int sample_size, std::function<void(bool)> cb) {
-	auto best = findBestServerWithin(serverList(), mLatency, sample_size, cb);
-	setServer(best);
-	return best;
+	serverList();
+	mRankedServers = findBestServerWithin(nearestServers(mIpInfo.lat, mIpInfo.lon, static_cast<size_t>(sample_size) * 4), sample_size, cb);
+	if (mRankedServers.empty()) {
+		auto nearest = nearestServers(mIpInfo.lat, mIpInfo.lon, 1);
+		auto best = nearest.empty() ? ServerInfo() : nearest[0];
+		setServer(best);
+		return best;
+	}
+	mLatency = mRankedServers[0].min;
+	mPool.setServer(mRankedServers[0].server);
+	mPool.warm(SPEED_TEST_CONNECTION_POOL_SIZE);
+	return mRankedServers[0].server;
+}
+
+const std::vector<ServerLatency> &SpeedTest::rankedServers() {
+	return mRankedServers;
 }
 
+// The connection pool is warmed up in the background while latency is measured
 bool SpeedTest::setServer(ServerInfo &server) {
-	SpeedTestClient client = SpeedTestClient(server);
-	if (client.connect() && client.version() >= mMinSupportedServer && testLatency(client, SPEED_TEST_LATENCY_SAMPLE_SIZE, mLatency)) {
-		client.close();
-		return true;
-	}
-	client.close();
-	return false;
+	mPool.setServer(server);
+	mPool.warm(SPEED_TEST_CONNECTION_POOL_SIZE - 1);
+	mLatencyHistogram.reset();
+	auto client = mPool.acquire(server);
+	if (!client || client->version() < mMinSupportedServer)
+		return false;
+	auto clients = pingClients(server, std::move(client));
+	bool success = testLatency(clients, SPEED_TEST_LATENCY_SAMPLE_SIZE, mLatency, mLatencyHistogram);
+	for (auto &c : clients)
+		mPool.release(std::move(c));
+	return success;
 }
 
 bool SpeedTest::downloadSpeed(const ServerInfo &server, const TestConfig &config, double &result, std::function<void(bool)> cb) {
-	opFn pfunc = &SpeedTestClient::download;
-	mDownloadSpeed = execute(server, config, pfunc, cb);
+	if (mMode == TransferMode::streaming) {
+		streamFn sfunc = &SpeedTestClient::downloadStream;
+		mDownloadResult = executeStreaming(server, config, sfunc, cb);
+	} else {
+		opFn pfunc = &SpeedTestClient::download;
+		mDownloadResult = execute(server, config, pfunc, cb);
+	}
+	mDownloadSpeed = mDownloadResult.speed;
 	result = mDownloadSpeed;
 	return true;
 }
 
 bool SpeedTest::uploadSpeed(const ServerInfo &server, const TestConfig &config, double &result, std::function<void(bool)> cb) {
-	opFn pfunc = &SpeedTestClient::upload;
-	mUploadSpeed = execute(server, config, pfunc, cb);
+	if (mMode == TransferMode::streaming) {
+		streamFn sfunc = &SpeedTestClient::uploadStream;
+		mUploadResult = executeStreaming(server, config, sfunc, cb);
+	} else {
+		opFn pfunc = &SpeedTestClient::upload;
+		mUploadResult = execute(server, config, pfunc, cb);
+	}
+	mUploadSpeed = mUploadResult.speed;
 	result = mUploadSpeed;
 	return true;
 }
 
-const long &SpeedTest::latency() {
+bool SpeedTest::downloadSpeed(const ServerInfo &server, const AdaptiveConfig &config, double &result, TestConfig &selected, std::function<void(bool)> cb) {
+	opFn pfunc = &SpeedTestClient::download;
+	streamFn sfunc = &SpeedTestClient::downloadStream;
+	mDownloadResult = executeAdaptive(server, config, pfunc, sfunc, selected, cb);
+	mDownloadSpeed = mDownloadResult.speed;
+	result = mDownloadSpeed;
+	return selected.concurrency > 0;
+}
+
+bool SpeedTest::uploadSpeed(const ServerInfo &server, const AdaptiveConfig &config, double &result, TestConfig &selected, std::function<void(bool)> cb) {
+	opFn pfunc = &SpeedTestClient::upload;
+	streamFn sfunc = &SpeedTestClient::uploadStream;
+	mUploadResult = executeAdaptive(server, config, pfunc, sfunc, selected, cb);
+	mUploadSpeed = mUploadResult.speed;
+	result = mUploadSpeed;
+	return selected.concurrency > 0;
+}
+
+// Aggregate download from every server in servers, e.g. the first entries of rankedServers()
+bool SpeedTest::downloadSpeed(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, double &result, TestConfig &selected, std::vector<ServerThroughput> &perServer, std::function<void(bool)> cb) {
+	opFn pfunc = &SpeedTestClient::download;
+	streamFn sfunc = &SpeedTestClient::downloadStream;
+	mDownloadResult = executeMulti(servers, config, pfunc, sfunc, perServer, selected, cb);
+	mDownloadSpeed = mDownloadResult.speed;
+	result = mDownloadSpeed;
+	return selected.concurrency > 0;
+}
+
+bool SpeedTest::uploadSpeed(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, double &result, TestConfig &selected, std::vector<ServerThroughput> &perServer, std::function<void(bool)> cb) {
+	opFn pfunc = &SpeedTestClient::upload;
+	streamFn sfunc = &SpeedTestClient::uploadStream;
+	mUploadResult = executeMulti(servers, config, pfunc, sfunc, perServer, selected, cb);
+	mUploadSpeed = mUploadResult.speed;
+	result = mUploadSpeed;
+	return selected.concurrency > 0;
+}
+
+const ThroughputResult &SpeedTest::downloadResult() {
+	return mDownloadResult;
+}
+
+const ThroughputResult &SpeedTest::uploadResult() {
+	return mUploadResult;
+}
+
+// Idle latency of the selected server, in nanoseconds
+const long long &SpeedTest::latency() {
 	return mLatency;
 }
 
-bool SpeedTest::jitter(const ServerInfo &server, long &result, const int sample) {
-	auto client = SpeedTestClient(server);
-	double current_jitter = 0;
-	long previous_ms = LONG_MAX;
-	size_t iter = 0;
-	if (client.connect()) {
-		for (int i = 0; i < sample; i++) {
-			long ms = 0;
-			if (client.ping(ms)) {
-				iter++;
-				if (previous_ms == LONG_MAX) {
-					previous_ms = ms;
-				} else {
-					current_jitter += std::abs(previous_ms - ms);
-				}
-			}
-		}
-		client.close();
-	} else {
+// Every ping to the selected server since it was chosen: the selection samples and the
+// jitter samples
+const LatencyHistogram &SpeedTest::latencyHistogram() {
+	return mLatencyHistogram;
+}
+
+// Mean absolute difference between successive ping samples, in send order across the
+// connections, in nanoseconds
+bool SpeedTest::jitter(const ServerInfo &server, long long &result, const int sample) {
+	auto client = mPool.acquire(server);
+	if (!client)
 		return false;
+	auto clients = pingClients(server, std::move(client));
+	std::vector<SpeedTestClient *> ptrs;
+	for (auto &c : clients)
+		ptrs.push_back(c.get());
+	PingEngine engine(SPEED_TEST_PING_DEPTH, SPEED_TEST_PING_SPACING_US * 1000LL, SPEED_TEST_PING_TIMEOUT_MS);
+	std::vector<PingSample> samples;
+	engine.run(ptrs, sample, samples);
+	for (auto &c : clients)
+		mPool.release(std::move(c));
+
+	double current_jitter = 0;
+	for (size_t i = 0; i < samples.size(); i++) {
+		mLatencyHistogram.record(samples[i].rtt_ns);
+		if (i > 0)
+			current_jitter += std::llabs(samples[i].rtt_ns - samples[i - 1].rtt_ns);
 	}
-	result = (long) std::ceil(current_jitter / iter);
+	if (samples.size() < 2)
+		return false;
+	result = std::llround(current_jitter / (samples.size() - 1));
 	return true;
 }
 
+// The first connection is the given one; the others are pooled ones or new ones, which the
+// ping engine connects in parallel. All of them go back to the pool afterwards.
+std::vector<std::unique_ptr<SpeedTestClient>> SpeedTest::pingClients(const ServerInfo &server, std::unique_ptr<SpeedTestClient> first) {
+	std::vector<std::unique_ptr<SpeedTestClient>> clients;
+	clients.push_back(std::move(first));
+	for (int i = 1; i < SPEED_TEST_PING_CONNECTIONS; i++) {
+		std::unique_ptr<SpeedTestClient> client = mPool.idle() > 0 ? mPool.acquire(server) : nullptr;
+		if (!client)
+			client.reset(new SpeedTestClient(server, mSocketOptions));
+		clients.push_back(std::move(client));
+	}
+	return clients;
+}
+
+// Loss, reordering, duplication and jitter of a UDP probe train to the server's UDP port.
+// It fails when nothing reflects the probes there.
+bool SpeedTest::packetLoss(const ServerInfo &server, const UdpProbeConfig &config, UdpProbeResult &result, std::function<void(bool)> cb) {
+	UdpProbeEngine engine(server, config);
+	engine.setSocketOptions(mSocketOptions);
+	engine.setStop(&mCancelled);
+	return engine.run(result, cb);
+}
+
 bool SpeedTest::share(const ServerInfo &server, std::string &image_url) {
 	image_url.clear();
 
 	std::stringstream hash;
-	hash << std::setprecision(0) << std::fixed << mLatency
+	hash << std::setprecision(0) << std::fixed << MonotonicClock::toMillis(mLatency)
 	<< "-" << std::setprecision(2) << std::fixed << (mUploadSpeed * 1000)
 	<< "-" << std::setprecision(2) << std::fixed << (mDownloadSpeed * 1000)
 	<< "-" << SPEED_TEST_API_KEY;
 	std::string hex_digest = MD5Util::hexDigest(hash.str());
 
 	std::stringstream post_data;
-	post_data << "ping=" << std::setprecision(0) << std::fixed << mLatency << "&";
+	post_data << "ping=" << std::setprecision(0) << std::fixed << MonotonicClock::toMillis(mLatency) << "&";
 	post_data << "upload=" << std::setprecision(2) << std::fixed << (mUploadSpeed * 1000) << "&";
 	post_data << "download=" << std::setprecision(2) << std::fixed << (mDownloadSpeed * 1000) << "&";
 	post_data << "pingselect=1&";
@@ -138,7 +361,7 @@ bool SpeedTest::share(const ServerInfo &server, std::string &image_url) {
 	curl_easy_setopt(c, CURLOPT_REFERER, SPEED_TEST_API_REFERER);
 	auto code = httpRequest(SPEED_TEST_API_URL, post_data.str(), rs, c);
 	if (code == CURLE_OK) {
-		int http_code = 0;
+		long http_code = 0;
 		curl_easy_getinfo(c, CURLINFO_HTTP_CODE, &http_code);
 		if (http_code == 200 && !rs.str().empty()) {
 			auto data = SpeedTest::parseQueryString(rs.str());
@@ -152,71 +375,563 @@ bool SpeedTest::share(const ServerInfo &server, std::string &image_url) {
 	return !image_url.empty();
 }
 
-double SpeedTest::execute(const ServerInfo &server, const TestConfig &config, const opFn &pfunc, std::function<void(bool)> cb) {
+void SpeedTest::setTransferEngine(TransferEngine engine) {
+	mEngine = engine;
+}
+
+void SpeedTest::setTransferMode(TransferMode mode) {
+	mMode = mode;
+}
+
+// Relative half-width of the 95% confidence interval at which a test ends early, 0 disables it
+void SpeedTest::setConvergenceTolerance(double tolerance) {
+	mTolerance = tolerance;
+}
+
+// Every connection, HTTP requests included, leaves through the source address and/or device
+// in options and carries its routing mark. It must be set before the first request.
+void SpeedTest::setSocketOptions(const SocketOptions &options) {
+	if (options.source_address == mSocketOptions.source_address && options.device == mSocketOptions.device && options.mark == mSocketOptions.mark)
+		return;
+	mSocketOptions = options;
+	mPool.setSocketOptions(options);
+}
+
+// Transfer workers are pinned to the cores that service the uplink interface IRQs, then to
+// the other cores, round robin. The interface is the bound device or the one of the default
+// route, so socket options go first.
+void SpeedTest::setCpuAffinity(bool enabled) {
+	if (enabled)
+		mAffinity.plan(mSocketOptions.device);
+	else
+		mAffinity.clear();
+}
+
+// A cancelled instance winds down any running transfer test at its next sample and aborts any
+// HTTP request within a second; it may be called from any thread. It stays cancelled until setCancelled(false).
+void SpeedTest::setCancelled(bool cancelled) {
+	mCancelled = cancelled;
+}
+
+bool SpeedTest::cancelled() const {
+	return mCancelled;
+}
+
+ThroughputResult SpeedTest::execute(const ServerInfo &server, const TestConfig &config, const opFn &pfunc, std::function<void(bool)> cb) {
+	std::atomic<long long> bytes(0);
+	std::atomic<bool> stop(false);
+	std::atomic<int> alive(0);
 	std::vector<std::thread> workers;
-	double overall_speed = 0;
 	std::mutex mtx;
-	for (int i = 0; i < config.concurrency; i++) {
-		workers.push_back(std::thread([&server, &overall_speed, &pfunc, &config, &mtx, cb]() {
-			long start_size = config.start_size;
-			long max_size   = config.max_size;
-			long incr_size  = config.incr_size;
-			long curr_size  = start_size;
-
-			auto spClient = SpeedTestClient(server);
-			if (spClient.connect()) {
-				long total_size = 0;
-				long total_time = 0;
-				std::vector<double> partial_results;
-				auto start = std::chrono::high_resolution_clock::now();
-				while (curr_size < max_size) {
-					long op_time = 0;
-					if ((spClient.*pfunc)(curr_size, config.buff_size, op_time)) {
-						total_size += curr_size;
-						total_time += op_time;
-						double metric = (curr_size * 8) / (static_cast<double>(op_time) / 1000);
-						partial_results.push_back(metric);
-						if (cb)
-							cb(true);
-					} else {
-						if (cb)
-							cb(false);
+	CpuMeter meter;
+	meter.start();
+	LatencyProbe probe(server, mSocketOptions, SPEED_TEST_LOADED_LATENCY_INTERVAL_MS);
+	if (mLoadedLatency)
+		probe.start([&bytes]() { return bytes.load(std::memory_order_relaxed); });
+	auto notify = [&mtx, &stop, cb](bool success) {
+		if (cb && !stop.load()) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(success);
+		}
+	};
+
+	if (mEngine == TransferEngine::epoll && EpollTransferEngine::supported()) {
+		auto direction = pfunc == &SpeedTestClient::upload ? EpollTransferEngine::upload : EpollTransferEngine::download;
+		alive = 1;
+		workers.push_back(std::thread([this, &server, &config, &bytes, &stop, &alive, &meter, direction, cb]() {
+			EpollTransferEngine engine(server, config, direction, mMinSupportedServer);
+			engine.setTransferControl(&bytes, &stop);
+			engine.setSocketOptions(mSocketOptions);
+			engine.setCpuControl(&mAffinity, &meter);
+			engine.run(cb);
+			alive--;
+		}));
+	} else {
+		const bool uring = mEngine == TransferEngine::uring;
+		for (int i = 0; i < config.concurrency; i++) {
+			alive++;
+			workers.push_back(std::thread([this, &server, &pfunc, &config, &bytes, &stop, &alive, &notify, &meter, uring]() {
+				auto cpu = startWorker();
+				long curr_size = config.start_size;
+
+				auto spClient = mPool.acquire(server);
+				if (spClient) {
+					if (uring)
+						spClient->enableIoUring(SPEED_TEST_IO_URING_DEPTH);
+					spClient->setTransferControl(&bytes, &stop);
+					bool success = true;
+					while (curr_size < config.max_size && !stop.load()) {
+						long long op_time = 0;
+						success = ((*spClient).*pfunc)(curr_size, config.buff_size, op_time);
+						notify(success);
+						curr_size += config.incr_size;
 					}
-					curr_size += incr_size;
-					auto stop = std::chrono::high_resolution_clock::now();
-					if (std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() > config.min_test_time_ms)
-						break;
-				}
-				spClient.close();
-				std::sort(partial_results.begin(), partial_results.end());
-
-				size_t skip = 0;
-				size_t drop = 0;
-				/*if (partial_results.size() >= 10) {
-					skip = partial_results.size() / 4;
-					drop = 2;
-				} -- */
-
-				size_t iter = 0;
-				double real_sum = 0;
-				for (auto it = partial_results.begin() + skip; it != partial_results.end() - drop; ++it ) {
-					iter++;
-					real_sum += (*it);
+					// A request cut short by stop leaves the connection dirty; release() drops it
+					if (success)
+						mPool.release(std::move(spClient));
+					else
+						spClient->abort();
+				} else {
+					notify(false);
 				}
-				mtx.lock();
-				overall_speed += (real_sum / iter);
-				mtx.unlock();
-			} else {
-				if (cb)
-					cb(false);
+				meter.add(cpu);
+				alive--;
+			}));
+		}
+	}
+
+	auto result = monitor(bytes, alive, config.min_test_time_ms, nullptr);
+	if (mLoadedLatency)
+		probe.stop(mLatency, result.loaded);
+	stop = true;
+	for (auto &t : workers) {
+		t.join();
+	}
+	workers.clear();
+	meter.stop(result);
+	return result;
+}
+
+// Every worker keeps its connection busy for config.min_test_time_ms with back-to-back
+// requests of config.max_size bytes, or less when the estimate converges earlier.
+ThroughputResult SpeedTest::executeStreaming(const ServerInfo &server, const TestConfig &config, const streamFn &sfunc, std::function<void(bool)> cb) {
+	std::vector<std::thread> workers;
+	std::atomic<long long> bytes(0);
+	std::atomic<bool> stop(false);
+	std::atomic<int> alive(0);
+	std::mutex mtx;
+	CpuMeter meter;
+	meter.start();
+	LatencyProbe probe(server, mSocketOptions, SPEED_TEST_LOADED_LATENCY_INTERVAL_MS);
+	if (mLoadedLatency)
+		probe.start([&bytes]() { return bytes.load(std::memory_order_relaxed); });
+	for (int i = 0; i < config.concurrency; i++) {
+		alive++;
+		workers.push_back(std::thread([this, &server, &config, &sfunc, &bytes, &stop, &alive, &mtx, &meter, cb]() {
+			auto cpu = startWorker();
+			// Streams always end with requests in flight, the connection cannot go back to the pool
+			auto spClient = mPool.acquire(server);
+			bool success = spClient && ((*spClient).*sfunc)(config.max_size, config.buff_size, bytes, stop);
+			if (spClient)
+				spClient->abort();
+			meter.add(cpu);
+			alive--;
+			if (cb && !success) {
+				std::lock_guard<std::mutex> lock(mtx);
+				cb(false);
 			}
 		}));
 	}
+
+	auto result = monitor(bytes, alive, config.min_test_time_ms, [&mtx, cb]() {
+		if (cb) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(true);
+		}
+	});
+	if (mLoadedLatency)
+		probe.stop(mLatency, result.loaded);
+	stop = true;
+	for (auto &t : workers) {
+		t.join();
+	}
+	workers.clear();
+	meter.stop(result);
+	return result;
+}
+
+// Closed-loop concurrency control: it starts with config.start_concurrency streams and,
+// every step of config.step_ms, doubles the streams and the buffer size for as long as
+// aggregate throughput grows by more than config.min_gain. The step that does not is
+// undone, and that stream set is held for up to config.hold_time_ms; the result is
+// measured over that window only.
+ThroughputResult SpeedTest::executeAdaptive(const ServerInfo &server, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, TestConfig &selected, std::function<void(bool)> cb) {
+	std::vector<std::thread> workers;
+	std::vector<std::shared_ptr<std::atomic<bool>>> stops;
+	std::atomic<long long> bytes(0);
+	std::atomic<bool> stop(false);
+	std::atomic<int> alive(0);
+	std::mutex mtx;
+	CpuMeter meter;
+	meter.start();
+	LatencyProbe probe(server, mSocketOptions, SPEED_TEST_LOADED_LATENCY_INTERVAL_MS);
+	if (mLoadedLatency)
+		probe.start([&bytes]() { return bytes.load(std::memory_order_relaxed); });
+
+	// Every live stream reads and writes chunks of this size, so a step grows them all
+	std::atomic<long> chunk(config.start_buff_size);
+	auto failed = [&mtx, cb]() {
+		if (cb) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(false);
+		}
+	};
+	auto engine = streamEngine(server, config, config.max_concurrency, pfunc, chunk, stop, meter, failed);
+	auto spawn = [&](int count) {
+		for (int i = 0; i < count; i++) {
+			std::shared_ptr<std::atomic<bool>> retired(new std::atomic<bool>(false));
+			stops.push_back(retired);
+			startStream(workers, engine.get(), server, config, pfunc, sfunc, chunk, bytes, retired, alive, meter, failed);
+		}
+	};
+	auto retire = [&](int count) {
+		for (int i = 0; i < count && !stops.empty(); i++) {
+			stops.back()->store(true);
+			stops.pop_back();
+		}
+	};
+	auto tick = [&mtx, cb]() {
+		if (cb) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(true);
+		}
+	};
+	auto measure = [&](const long duration_ms) -> double {
+		const long long start = MonotonicClock::now();
+		const long long start_bytes = bytes.load(std::memory_order_relaxed);
+		long long now = start;
+		while (now - start < duration_ms * 1000000LL && alive.load() > 0 && !mCancelled) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(SPEED_TEST_STREAM_SAMPLE_MS));
+			now = MonotonicClock::now();
+			tick();
+		}
+		if (now <= start)
+			return 0;
+		return (bytes.load(std::memory_order_relaxed) - start_bytes) * 8 / (static_cast<double>(now - start) / 1000000000);
+	};
+
+	// New streams connect, handshake and leave slow start for one estimator window before
+	// a step is measured, so that the step sees what they add rather than their ramp
+	int streams = config.start_concurrency;
+	spawn(streams);
+	measure(SPEED_TEST_ESTIMATOR_WINDOW_MS);
+	double best_rate = measure(config.step_ms);
+	while (streams < config.max_concurrency && alive.load() > 0 && !mCancelled) {
+		int added = std::min(streams, config.max_concurrency - streams);
+		const long previous_chunk = chunk.load();
+		chunk = std::min(previous_chunk * 2, config.max_buff_size);
+		spawn(added);
+		measure(SPEED_TEST_ESTIMATOR_WINDOW_MS);
+		double rate = measure(config.step_ms);
+		if (rate < best_rate * (1 + config.min_gain)) {
+			// Past the knee: the hold runs with the set before the step that added nothing
+			retire(added);
+			chunk = previous_chunk;
+			break;
+		}
+		streams += added;
+		best_rate = rate;
+	}
+
+	auto result = monitor(bytes, alive, config.hold_time_ms, tick);
+	if (mLoadedLatency)
+		probe.stop(mLatency, result.loaded);
+	stop = true;
+	for (auto &s : stops)
+		s->store(true);
+	if (engine)
+		engine->wait();
+	for (auto &t : workers) {
+		t.join();
+	}
+	workers.clear();
+	meter.stop(result);
+
+	std::stringstream label;
+	label << config.label << ": " << streams << " streams, " << chunk.load() << " bytes buffer";
+	selected = TestConfig();
+	selected.start_size = config.request_size;
+	selected.max_size = config.request_size;
+	selected.buff_size = chunk.load();
+	selected.min_test_time_ms = config.hold_time_ms;
+	selected.concurrency = result.speed > 0 ? streams : 0;
+	selected.label = label.str();
+	return result;
+}
+
+// Aggregate test over several servers at once, for links faster than any single server can
+// fill. Every server starts with config.start_concurrency streams. Every config.step_ms the
+// stream budget doubles for as long as aggregate throughput grows by more than
+// config.min_gain, and it is split across servers by their observed throughput per stream:
+// extra streams to a saturated server add nothing, so its share drops and its streams move
+// to the servers that still scale. Past the knee the allocation is held for up to
+// config.hold_time_ms; aggregate and per-server results are measured over that window only.
+ThroughputResult SpeedTest::executeMulti(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, std::vector<ServerThroughput> &perServer, TestConfig &selected, std::function<void(bool)> cb) {
+	const size_t count = servers.size();
+	std::vector<std::thread> workers;
+	std::atomic<bool> stop(false);
+	std::vector<std::unique_ptr<std::atomic<long long>>> bytes;
+	std::vector<std::vector<std::shared_ptr<std::atomic<bool>>>> stops(count);
+	std::vector<int> streams(count, 0);
+	std::vector<double> rates(count, 0);
+	std::atomic<int> alive(0);
+	std::mutex mtx;
+	CpuMeter meter;
+	meter.start();
+	LatencyProbe probe(servers[0], mSocketOptions, SPEED_TEST_LOADED_LATENCY_INTERVAL_MS);
+	for (size_t i = 0; i < count; i++)
+		bytes.push_back(std::unique_ptr<std::atomic<long long>>(new std::atomic<long long>(0)));
+	if (mLoadedLatency)
+		probe.start([&bytes]() {
+			long long sum = 0;
+			for (auto &b : bytes)
+				sum += b->load(std::memory_order_relaxed);
+			return sum;
+		});
+
+	// Every live stream reads and writes chunks of this size, so a step grows them all
+	std::atomic<long> chunk(config.start_buff_size);
+	auto failed = [&mtx, cb]() {
+		if (cb) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(false);
+		}
+	};
+	auto engine = streamEngine(servers[0], config, config.max_concurrency * static_cast<int>(count), pfunc, chunk, stop, meter, failed);
+	auto spawn = [&](size_t i, int n) {
+		for (int k = 0; k < n; k++) {
+			std::shared_ptr<std::atomic<bool>> retired(new std::atomic<bool>(false));
+			stops[i].push_back(retired);
+			streams[i]++;
+			startStream(workers, engine.get(), servers[i], config, pfunc, sfunc, chunk, *bytes[i], retired, alive, meter, failed);
+		}
+	};
+	auto retire = [&](size_t i, int n) {
+		for (int k = 0; k < n && !stops[i].empty(); k++) {
+			stops[i].back()->store(true);
+			stops[i].pop_back();
+			streams[i]--;
+		}
+	};
+	auto total = [&]() -> long long {
+		long long sum = 0;
+		for (auto &b : bytes)
+			sum += b->load(std::memory_order_relaxed);
+		return sum;
+	};
+	auto tick = [&mtx, cb]() {
+		if (cb) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cb(true);
+		}
+	};
+	// Aggregate rate in bit/s over duration_ms, per-server rates go to rates
+	auto measure = [&](const long duration_ms) -> double {
+		std::vector<long long> start_bytes(count);
+		for (size_t i = 0; i < count; i++)
+			start_bytes[i] = bytes[i]->load(std::memory_order_relaxed);
+		const long long start = MonotonicClock::now();
+		long long now = start;
+		while (now - start < duration_ms * 1000000LL && alive.load() > 0 && !mCancelled) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(SPEED_TEST_STREAM_SAMPLE_MS));
+			now = MonotonicClock::now();
+			tick();
+		}
+		double rate = 0;
+		for (size_t i = 0; i < count; i++) {
+			rates[i] = now <= start ? 0 : (bytes[i]->load(std::memory_order_relaxed) - start_bytes[i]) * 8 / (static_cast<double>(now - start) / 1000000000);
+			rate += rates[i];
+		}
+		return rate;
+	};
+	// A server that moved nothing in the last step is left without streams
+	auto rebalance = [&](int budget) {
+		double weights = 0;
+		for (size_t i = 0; i < count; i++)
+			weights += rates[i] / std::max(streams[i], 1);
+		if (weights <= 0)
+			return;
+		std::vector<int> targets(count);
+		for (size_t i = 0; i < count; i++) {
+			int target = static_cast<int>(std::lround(budget * rates[i] / std::max(streams[i], 1) / weights));
+			targets[i] = std::min(std::max(target, rates[i] > 0 ? 1 : 0), config.max_concurrency);
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (targets[i] < streams[i])
+				retire(i, streams[i] - targets[i]);
+			else if (targets[i] > streams[i])
+				spawn(i, targets[i] - streams[i]);
+		}
+	};
+
+	const int max_budget = config.max_concurrency * static_cast<int>(count);
+	int budget = config.start_concurrency * static_cast<int>(count);
+	// As in executeAdaptive, new streams get one estimator window to ramp up before a step
+	// is measured
+	for (size_t i = 0; i < count; i++)
+		spawn(i, config.start_concurrency);
+	measure(SPEED_TEST_ESTIMATOR_WINDOW_MS);
+	double best_rate = measure(config.step_ms);
+	while (budget < max_budget && alive.load() > 0 && !mCancelled) {
+		const int previous_budget = budget;
+		const long previous_chunk = chunk.load();
+		budget = std::min(budget * 2, max_budget);
+		chunk = std::min(previous_chunk * 2, config.max_buff_size);
+		rebalance(budget);
+		measure(SPEED_TEST_ESTIMATOR_WINDOW_MS);
+		double rate = measure(config.step_ms);
+		if (rate < best_rate * (1 + config.min_gain)) {
+			// Past the knee: back to the budget before the step that added nothing
+			budget = previous_budget;
+			chunk = previous_chunk;
+			break;
+		}
+		best_rate = rate;
+	}
+	// The last step tells which servers saturated, hold the budget with that split
+	rebalance(budget);
+
+	std::vector<long long> hold_bytes(count);
+	for (size_t i = 0; i < count; i++)
+		hold_bytes[i] = bytes[i]->load(std::memory_order_relaxed);
+	const long long hold_start = MonotonicClock::now();
+	auto result = monitor(total, alive, config.hold_time_ms, tick);
+	if (mLoadedLatency)
+		probe.stop(mLatency, result.loaded);
+	const double hold_s = static_cast<double>(MonotonicClock::now() - hold_start) / 1000000000;
+
+	perServer.clear();
+	int used = 0;
+	for (size_t i = 0; i < count; i++) {
+		ServerThroughput server = ServerThroughput();
+		server.server = servers[i];
+		server.streams = streams[i];
+		server.speed = hold_s > 0 ? (bytes[i]->load(std::memory_order_relaxed) - hold_bytes[i]) * 8 / hold_s / 1024 / 1024 : 0;
+		perServer.push_back(server);
+		used += streams[i];
+		retire(i, streams[i]);
+	}
+	stop = true;
+	if (engine)
+		engine->wait();
 	for (auto &t : workers) {
 		t.join();
 	}
 	workers.clear();
-	return overall_speed / 1024 / 1024;
+	meter.stop(result);
+
+	std::stringstream label;
+	label << config.label << ": " << count << " servers, " << used << " streams, " << chunk.load() << " bytes buffer";
+	selected = TestConfig();
+	selected.start_size = config.request_size;
+	selected.max_size = config.request_size;
+	selected.buff_size = chunk.load();
+	selected.min_test_time_ms = config.hold_time_ms;
+	selected.concurrency = result.speed > 0 ? used : 0;
+	selected.label = label.str();
+	return result;
+}
+
+// The epoll loops that carry the streams of an adaptive test with the epoll engine, null
+// with the others. Every stream on it runs back to back requests of config.request_size.
+std::unique_ptr<EpollTransferEngine> SpeedTest::streamEngine(const ServerInfo &server, const AdaptiveConfig &config, const int max_streams, const opFn &pfunc, const std::atomic<long> &chunk, const std::atomic<bool> &stop, CpuMeter &meter, std::function<void()> failed) {
+	std::unique_ptr<EpollTransferEngine> engine;
+	if (mEngine != TransferEngine::epoll || !EpollTransferEngine::supported())
+		return engine;
+	TestConfig streamConfig = TestConfig();
+	streamConfig.start_size = config.request_size;
+	streamConfig.max_size = LONG_MAX;
+	streamConfig.incr_size = 0;
+	streamConfig.buff_size = config.max_buff_size;
+	streamConfig.min_test_time_ms = config.hold_time_ms;
+	streamConfig.concurrency = max_streams;
+	auto direction = pfunc == &SpeedTestClient::upload ? EpollTransferEngine::upload : EpollTransferEngine::download;
+	engine.reset(new EpollTransferEngine(server, streamConfig, direction, mMinSupportedServer));
+	engine->setTransferControl(nullptr, &stop);
+	engine->setChunkControl(&chunk);
+	engine->setSocketOptions(mSocketOptions);
+	engine->setCpuControl(&mAffinity, &meter);
+	engine->start([failed](bool success) {
+		if (!success)
+			failed();
+	});
+	return engine;
+}
+
+// One stream of an adaptive test, until stop is raised: a connection on the loops of engine
+// when there is one, else a worker thread. With the uring engine the worker runs chunked
+// requests through io_uring, with the threads engine chunked requests or, in streaming
+// mode, pipelined ones.
+void SpeedTest::startStream(std::vector<std::thread> &workers, EpollTransferEngine *engine, const ServerInfo &server, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, const std::atomic<long> &chunk, std::atomic<long long> &bytes, std::shared_ptr<std::atomic<bool>> stop, std::atomic<int> &alive, CpuMeter &meter, std::function<void()> failed) {
+	alive++;
+	if (engine) {
+		if (!engine->add(server, &bytes, stop, &alive)) {
+			alive--;
+			failed();
+		}
+		return;
+	}
+	workers.push_back(std::thread([this, &server, &config, pfunc, sfunc, &chunk, &bytes, stop, &alive, &meter, failed]() {
+		auto cpu = startWorker();
+		auto spClient = mPool.acquire(server);
+		bool success = spClient != nullptr;
+		if (success) {
+			spClient->setChunkControl(&chunk);
+			if (mMode == TransferMode::streaming) {
+				success = ((*spClient).*sfunc)(config.request_size, config.max_buff_size, bytes, *stop);
+			} else {
+				if (mEngine == TransferEngine::uring)
+					spClient->enableIoUring(SPEED_TEST_IO_URING_DEPTH);
+				spClient->setTransferControl(&bytes, stop.get());
+				while (success && !stop->load()) {
+					long long op_time = 0;
+					success = ((*spClient).*pfunc)(config.request_size, config.max_buff_size, op_time);
+				}
+				// The request that stop cuts short fails, the stream does not
+				success = success || stop->load();
+			}
+			// Streams always end with requests in flight, the connection cannot go back to the pool
+			spClient->abort();
+		}
+		meter.add(cpu);
+		alive--;
+		if (!success)
+			failed();
+	}));
+}
+
+// With loaded latency enabled every transfer test keeps a PING connection next to its
+// workers and reports loaded latency percentiles in ThroughputResult::loaded
+void SpeedTest::setLoadedLatency(bool enabled) {
+	mLoadedLatency = enabled;
+}
+
+// A transfer worker calls it first: it pins the thread to the next planned core, if any,
+// lowers its priority under loaded latency and returns the CPU sample its time is charged from
+CpuMeter::Sample SpeedTest::startWorker() {
+	if (mAffinity.enabled())
+		CpuAffinity::pin(mAffinity.next());
+#if defined(__linux__)
+	// Bulk workers yield the CPU to the latency probe when the client runs out of it
+	if (mLoadedLatency)
+		setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), SPEED_TEST_LOADED_LATENCY_WORKER_NICE);
+#endif
+	return CpuMeter::thread();
+}
+
+// It samples the shared byte counter every SPEED_TEST_STREAM_SAMPLE_MS until duration_ms
+// elapsed, every worker is gone or the estimate converged, and returns it in Mbit/s.
+ThroughputResult SpeedTest::monitor(std::atomic<long long> &bytes, const std::atomic<int> &alive, const long duration_ms, std::function<void()> tick) {
+	return monitor([&bytes]() { return bytes.load(std::memory_order_relaxed); }, alive, duration_ms, tick);
+}
+
+ThroughputResult SpeedTest::monitor(std::function<long long()> bytes, const std::atomic<int> &alive, const long duration_ms, std::function<void()> tick) {
+	ThroughputEstimator estimator(SPEED_TEST_ESTIMATOR_WINDOW_MS, SPEED_TEST_ESTIMATOR_MIN_WINDOWS, mTolerance);
+	const long long start = MonotonicClock::now();
+	long long now = start;
+	estimator.sample(now, bytes());
+	while (now - start < duration_ms * 1000000LL && alive.load() > 0 && !estimator.converged() && !mCancelled) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(SPEED_TEST_STREAM_SAMPLE_MS));
+		now = MonotonicClock::now();
+		estimator.sample(now, bytes());
+		if (tick)
+			tick();
+	}
+	auto result = estimator.result();
+	result.speed = result.speed / 1024 / 1024;
+	result.lower = result.lower / 1024 / 1024;
+	result.upper = result.upper / 1024 / 1024;
+	return result;
 }
 
 template<typename T>
@@ -235,19 +950,38 @@ T SpeedTest::harversine(std::pair<T, T> n1, std::pair<T, T> n2) {
 	return 2.0 * EARTH_RADIUS_KM * std::asin(std::sqrt(u * u + std::cos(lat1r) * std::cos(lat2r) * v * v));
 }
 
+template float SpeedTest::harversine<float>(std::pair<float, float> n1, std::pair<float, float> n2);
+
 CURLcode SpeedTest::httpRequest(const std::string &url, const std::string &postdata, std::stringstream &ss, CURL *handler, long timeout) {
+	return httpRequest(url, postdata, &writeFunc, &ss, handler, timeout);
+}
+
+CURLcode SpeedTest::httpRequest(const std::string &url, const std::string &postdata, writeFn writer, void *userp, CURL *handler, long timeout) {
 	CURLcode code(CURLE_FAILED_INIT);
 	CURL *curl = handler == nullptr ? curl_easy_init() : handler;
 
 	if (curl) {
-		if (CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeFunc))
-		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L))
+		std::string interface;
+		if (!mSocketOptions.device.empty())
+			interface = "if!" + mSocketOptions.device;
+		else if (!mSocketOptions.source_address.empty())
+			interface = "host!" + mSocketOptions.source_address;
+		if (!interface.empty())
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, interface.c_str());
+		if (mSocketOptions.mark != 0) {
+			curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, &curlSocketOptions);
+			curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, &mSocketOptions.mark);
+		}
+		if (CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writer))
+		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L))
+		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, &curlProgress))
+		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &mCancelled))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip, deflate"))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_USERAGENT, SPEED_TEST_USER_AGENT))
-		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_FILE, &ss))
+		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_FILE, userp))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout))
 		 && CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_URL, url.c_str()))
 		 && (postdata.empty() || CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata.c_str())))
@@ -261,6 +995,20 @@ CURLcode SpeedTest::httpRequest(const std::string &url, const std::string &postd
 	return code;
 }
 
+// CURLOPT_INTERFACE covers address and device, only the routing mark is left
+int SpeedTest::curlSocketOptions(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+	SocketOptions options = SocketOptions();
+	options.mark = *static_cast<int *>(clientp);
+	if (purpose == CURLSOCKTYPE_IPCXN && !SpeedTestClient::applySocketOptions(fd, options))
+		return CURL_SOCKOPT_ERROR;
+	return CURL_SOCKOPT_OK;
+}
+
+// libcurl calls it at least once a second, even while stalled
+int SpeedTest::curlProgress(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+	return static_cast<std::atomic<bool> *>(clientp)->load() ? 1 : 0;
+}
+
 size_t SpeedTest::writeFunc(void *buf, size_t size, size_t nmemb, void *userp) {
 	if (userp) {
 		std::stringstream &ss = *static_cast<std::stringstream *>(userp);
@@ -300,172 +1048,267 @@ std::vector<std::string> SpeedTest::splitString(const std::string &instr, const
 	return tokens;
 }
 
-ServerInfo SpeedTest::processServerXMLNode(xmlTextReaderPtr reader) {
-	auto name = xmlTextReaderConstName(reader);
-	auto nodeName = std::string((char*)name);
-	if (!name || nodeName != "server") {
+// Parser state shared by the libcurl write callback and the SAX handler
+typedef struct server_list_parser_t {
+	CURL *curl;
+	xmlParserCtxtPtr ctxt;
+	const IPInfo *ipInfo;
+	ServerCatalog *target;
+	std::function<void(const ServerInfo &)> cb;
+} ServerListParser;
+
+// SAX2 passes attributes as (localname, prefix, URI, value, end) tuples; values are not NUL terminated
+ServerInfo SpeedTest::processServerXMLNode(const xmlChar *name, const int nb_attributes, const xmlChar **attrs) {
+	if (!name || !attrs || xmlStrcmp(name, BAD_CAST "server") != 0) {
 		return ServerInfo();
 	}
 
-	if (xmlTextReaderAttributeCount(reader) > 0) {
-		auto info = ServerInfo();
-		auto server_url     = xmlTextReaderGetAttribute(reader, BAD_CAST "url");
-		auto server_lat     = xmlTextReaderGetAttribute(reader, BAD_CAST "lat");
-		auto server_lon     = xmlTextReaderGetAttribute(reader, BAD_CAST "lon");
-		auto server_name    = xmlTextReaderGetAttribute(reader, BAD_CAST "name");
-		auto server_county  = xmlTextReaderGetAttribute(reader, BAD_CAST "country");
-		auto server_cc      = xmlTextReaderGetAttribute(reader, BAD_CAST "cc");
-		auto server_host    = xmlTextReaderGetAttribute(reader, BAD_CAST "host");
-		auto server_id      = xmlTextReaderGetAttribute(reader, BAD_CAST "id");
-		auto server_sponsor = xmlTextReaderGetAttribute(reader, BAD_CAST "sponsor");
-
-		if (server_url)
-			info.url.append((char*)server_url);
-		if (server_lat)
-			info.lat = std::stof((char*)server_lat);
-		if (server_lon)
-			info.lon = std::stof((char*)server_lon);
-		if (server_name)
-			info.name.append((char*)server_name);
-		if (server_county)
-			info.country.append((char*)server_county);
-		if (server_cc)
-			info.country_code.append((char*)server_cc);
-		if (server_host)
-			info.host.append((char*)server_host);
-		if (server_id)
-			info.id = std::atoi((char*)server_id);
-		if (server_sponsor)
-			info.sponsor.append((char*)server_sponsor);
-
-		xmlFree(server_url);
-		xmlFree(server_lat);
-		xmlFree(server_lon);
-		xmlFree(server_name);
-		xmlFree(server_county);
-		xmlFree(server_cc);
-		xmlFree(server_host);
-		xmlFree(server_id);
-		xmlFree(server_sponsor);
-		return info;
-	}
-
-	return ServerInfo();
-}
-
-bool SpeedTest::fetchServers(const std::string &url, std::vector<ServerInfo> &target, int &http_code) {
+	auto info = ServerInfo();
+	for (int i = 0; i < nb_attributes; i++) {
+		const xmlChar **attr = attrs + i * 5;
+		auto key   = std::string((char*)attr[0]);
+		auto value = std::string((char*)attr[3], static_cast<size_t>(attr[4] - attr[3]));
+		// Without entity substitution libxml2 hands a decoded & over as &#38;
+		for (size_t pos = value.find("&#38;"); pos != std::string::npos; pos = value.find("&#38;", pos + 1))
+			value.replace(pos, 5, "&");
+		if (key == "url")
+			info.url = value;
+		else if (key == "lat")
+			info.lat = std::strtof(value.c_str(), nullptr);
+		else if (key == "lon")
+			info.lon = std::strtof(value.c_str(), nullptr);
+		else if (key == "name")
+			info.name = value;
+		else if (key == "country")
+			info.country = value;
+		else if (key == "cc")
+			info.country_code = value;
+		else if (key == "host")
+			info.host = value;
+		else if (key == "id")
+			info.id = std::atoi(value.c_str());
+		else if (key == "sponsor")
+			info.sponsor = value;
+	}
+	return info;
+}
+
+void SpeedTest::serverXMLStartElement(void *userp, const xmlChar *localname, const xmlChar *, const xmlChar *, int, const xmlChar **, int nb_attributes, int, const xmlChar **attributes) {
+	auto &parser = *static_cast<ServerListParser *>(userp);
+	ServerInfo info = processServerXMLNode(localname, nb_attributes, attributes);
+	if (info.url.empty())
+		return;
+	parser.target->add(info);
+	if (parser.cb) {
+		info.distance = harversine(std::make_pair(parser.ipInfo->lat, parser.ipInfo->lon), std::make_pair(info.lat, info.lon));
+		parser.cb(info);
+	}
+}
+
+// It feeds every chunk to the push parser as it arrives. Bodies of non 200 replies abort the transfer.
+size_t SpeedTest::serverXMLWriteFunc(void *buf, size_t size, size_t nmemb, void *userp) {
+	auto &parser = *static_cast<ServerListParser *>(userp);
+	long http_code = 0;
+	curl_easy_getinfo(parser.curl, CURLINFO_RESPONSE_CODE, &http_code);
+	if (http_code != 200)
+		return 0;
+	size_t len = size * nmemb;
+	if (xmlParseChunk(parser.ctxt, static_cast<const char *>(buf), static_cast<int>(len), 0) != 0)
+		return 0;
+	return len;
+}
+
+xmlParserCtxtPtr SpeedTest::createServerXMLParser(void *userp) {
+	xmlSAXHandler handler;
+	memset(&handler, 0, sizeof(handler));
+	handler.initialized = XML_SAX2_MAGIC;
+	handler.startElementNs = &serverXMLStartElement;
+	xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(&handler, userp, nullptr, 0, nullptr);
+	// No entity substitution (XXE) and no network access. The predefined entities and
+	// character references in attribute values are still decoded, see processServerXMLNode.
+	if (ctxt != nullptr)
+		xmlCtxtUseOptions(ctxt, XML_PARSE_NONET);
+	return ctxt;
+}
+
+// It parses a server list that is already in memory, e.g. a saved copy, through the same SAX handler
+bool SpeedTest::parseServers(const std::string &xml, const IPInfo &ipInfo, ServerCatalog &target) {
 	target.clear();
 
+	ServerListParser parser;
+	parser.curl = nullptr;
+	parser.ipInfo = &ipInfo;
+	parser.target = &target;
+	parser.ctxt = createServerXMLParser(&parser);
+	if (parser.ctxt == nullptr) {
+		std::cerr << "SpeedTest::parseServers: Unable to initialize XML parser." << std::endl;
+		return false;
+	}
+	bool parsed = xmlParseChunk(parser.ctxt, xml.data(), static_cast<int>(xml.length()), 1) == 0 && parser.ctxt->wellFormed;
+	xmlFreeParserCtxt(parser.ctxt);
+	if (!parsed) {
+		target.clear();
+		return false;
+	}
+	target.shrink();
+	return true;
+}
+
+bool SpeedTest::fetchServers(const std::string &url, const IPInfo &ipInfo, ServerCatalog &target, int &http_code, std::function<void(const ServerInfo &)> cb) {
+	target.clear();
+
+	ServerListParser parser;
+	parser.ipInfo = &ipInfo;
+	parser.target = &target;
+	parser.cb = cb;
+	parser.ctxt = createServerXMLParser(&parser);
+	if (parser.ctxt == nullptr) {
+		std::cerr << "SpeedTest::fetchServers: Unable to initialize XML parser." << std::endl;
+		return false;
+	}
+	parser.curl = curl_easy_init();
+
 	std::string postdata = "";
-	std::stringstream rs;
-	CURL *c = curl_easy_init();
-	auto code = httpRequest(url, postdata, rs, c);
-	if (code == CURLE_OK) {
-		int req_status = 0;
-		curl_easy_getinfo(c, CURLINFO_HTTP_CODE, &req_status);
-		http_code = req_status;
-		if (http_code == 200 && !rs.str().empty()) {
-			size_t len = rs.str().length();
-			auto *xmlbuff = (char*)calloc(len + 1, sizeof(char));
-			if (!xmlbuff) {
-				std::cerr << "SpeedTest::fetchServers: Allocation failure." << std::endl;
-				curl_easy_cleanup(c);
-				return false;
-			}
-			memcpy(xmlbuff, rs.str().c_str(), len);
-			rs.clear();
+	auto code = httpRequest(url, postdata, &serverXMLWriteFunc, &parser, parser.curl);
+	long req_status = 0;
+	curl_easy_getinfo(parser.curl, CURLINFO_HTTP_CODE, &req_status);
+	http_code = static_cast<int>(req_status);
+	curl_easy_cleanup(parser.curl);
 
-			xmlTextReaderPtr reader = xmlReaderForMemory(xmlbuff, static_cast<int>(len), nullptr, nullptr, 0);
-			if (reader == nullptr) {
-				std::cerr << "SpeedTest::fetchServers: Unable to initialize XML parser." << std::endl;
-				curl_easy_cleanup(c);
-				free(xmlbuff);
-				return false;
-			}
+	bool parsed = code == CURLE_OK && xmlParseChunk(parser.ctxt, nullptr, 0, 1) == 0 && parser.ctxt->wellFormed;
+	xmlFreeParserCtxt(parser.ctxt);
+	if (http_code == 200 && !parsed) {
+		std::cerr << "SpeedTest::fetchServers: Failed to XML parse." << std::endl;
+		target.clear();
+		return false;
+	}
+	target.shrink();
+	return true;
+}
 
-			IPInfo ipInfo;
-			if (!SpeedTest::ipInfo(ipInfo)) {
-				std::cerr << "SpeedTest::fetchServers: Unable to retrieve your IP info." << std::endl;
-				curl_easy_cleanup(c);
-				free(xmlbuff);
-				xmlFreeTextReader(reader);
-				return false;
-			}
+// It probes the nearest servers concurrently in rounds of SPEED_TEST_DISCOVERY_ROUND_SIZE pipelined pings.
+// After each round, candidates whose best latency is clearly worse than the leader are dropped.
+std::vector<ServerLatency> SpeedTest::findBestServerWithin(const std::vector<ServerInfo> &serverList, const int sample_size, std::function<void(bool)> cb) {
+	std::vector<std::unique_ptr<SpeedTestClient>> clients;
+	std::vector<ServerLatency> stats;
+	std::mutex mtx;
 
-			auto ret = xmlTextReaderRead(reader);
-			while (ret == 1) {
-				ServerInfo info = processServerXMLNode(reader);
-				if (!info.url.empty()) {
-					info.distance = harversine(std::make_pair(ipInfo.lat, ipInfo.lon), std::make_pair(info.lat, info.lon));
-					target.push_back(info);
+	// Connect and handshake candidates in parallel until enough of them answered
+	size_t next = 0;
+	while (clients.size() < static_cast<size_t>(sample_size) && next < serverList.size()) {
+		size_t batch = std::min(serverList.size() - next, static_cast<size_t>(sample_size) - clients.size());
+		std::vector<std::unique_ptr<SpeedTestClient>> batch_clients(batch);
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < batch; i++) {
+			workers.push_back(std::thread([this, &serverList, &batch_clients, &mtx, next, i, cb]() {
+				std::unique_ptr<SpeedTestClient> client(new SpeedTestClient(serverList[next + i], mSocketOptions));
+				bool success = client->connect() && client->version() >= mMinSupportedServer;
+				if (success)
+					batch_clients[i] = std::move(client);
+				if (cb) {
+					std::lock_guard<std::mutex> lock(mtx);
+					cb(success);
 				}
-				ret = xmlTextReaderRead(reader);
-			}
-			free(xmlbuff);
-			xmlFreeTextReader(reader);
-			xmlCleanupParser();
-			if (ret != 0) {
-				std::cerr << "SpeedTest::fetchServers: Failed to XML parse." << std::endl;
-				curl_easy_cleanup(c);
-				return false;
-			}
+			}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
+		for (size_t i = 0; i < batch; i++) {
+			if (!batch_clients[i])
+				continue;
+			ServerLatency info = ServerLatency();
+			info.server = serverList[next + i];
+			info.min = LLONG_MAX;
+			info.max = 0;
+			clients.push_back(std::move(batch_clients[i]));
+			stats.push_back(info);
 		}
+		next += batch;
 	}
-	curl_easy_cleanup(c);
-	auto DistanceComparer = [](const ServerInfo &a, const ServerInfo &b) -> bool {
-		const bool ret = (a.distance - b.distance) < 0;
-		return ret;
-	};
-	std::sort(target.begin(), target.end(), DistanceComparer);
-	return true;
-}
 
-const ServerInfo SpeedTest::findBestServerWithin(const std::vector<ServerInfo> &serverList, long &latency, const int sample_size, std::function<void(bool)> cb) {
-	ServerInfo bestServer = serverList[0];
-	latency = LONG_MAX;
-	int i = sample_size;
-	for (auto &server : serverList) {
-		auto client = SpeedTestClient(server);
-		if (!client.connect()) {
-			if (cb)
-				cb(false);
-			continue;
+	std::vector<char> alive(clients.size(), 1);
+	std::vector<LatencyHistogram> histograms(clients.size());
+	size_t alive_count = clients.size();
+	for (int sent = 0; sent < SPEED_TEST_LATENCY_SAMPLE_SIZE && alive_count > 0; sent += SPEED_TEST_DISCOVERY_ROUND_SIZE) {
+		const int round_size = std::min(SPEED_TEST_DISCOVERY_ROUND_SIZE, SPEED_TEST_LATENCY_SAMPLE_SIZE - sent);
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < clients.size(); i++) {
+			if (!alive[i])
+				continue;
+			workers.push_back(std::thread([&clients, &stats, &alive, &histograms, i, round_size]() {
+				ServerLatency &info = stats[i];
+				std::vector<PingSample> samples;
+				if (!clients[i]->pingTrain(round_size, SPEED_TEST_PING_DEPTH, SPEED_TEST_PING_SPACING_US * 1000LL, MonotonicClock::now(), SPEED_TEST_PING_TIMEOUT_MS, samples))
+					alive[i] = 0;
+				for (auto &sample : samples) {
+					long long ns = sample.rtt_ns;
+					histograms[i].record(ns);
+					info.avg = (info.avg * info.samples + ns) / (info.samples + 1);
+					info.samples++;
+					info.min = std::min(info.min, ns);
+					info.max = std::max(info.max, ns);
+				}
+			}));
 		}
-		if (client.version() < mMinSupportedServer) {
-			client.close();
-			if (cb)
-				cb(false);
-			continue;
+		for (auto &t : workers) {
+			t.join();
+		}
+
+		long long leader = LLONG_MAX;
+		for (size_t i = 0; i < clients.size(); i++) {
+			if (alive[i])
+				leader = std::min(leader, stats[i].min);
 		}
-		long current_latency = LONG_MAX;
-		if (testLatency(client, SPEED_TEST_LATENCY_SAMPLE_SIZE, current_latency)) {
-			if (current_latency < latency) {
-				latency = current_latency;
-				bestServer = server;
+		alive_count = 0;
+		for (size_t i = 0; i < clients.size(); i++) {
+			if (alive[i] && stats[i].min > leader * SPEED_TEST_DISCOVERY_CUTOFF_RATIO + SPEED_TEST_DISCOVERY_CUTOFF_SLACK_NS) {
+				alive[i] = 0;
+				clients[i]->close();
 			}
+			if (alive[i])
+				alive_count++;
 		}
-		client.close();
-		if (cb)
-			cb(true);
-		if (i-- < 0)
-			break;
 	}
-	return bestServer;
+
+	// The leader's connection is the first one of the pool for the selected server
+	size_t leader = clients.size();
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (alive[i] && stats[i].samples > 0 && (leader == clients.size() || stats[i].min < stats[leader].min))
+			leader = i;
+	}
+	mLatencyHistogram.reset();
+	if (leader < clients.size()) {
+		mPool.setServer(stats[leader].server);
+		mPool.release(std::move(clients[leader]));
+		mLatencyHistogram.merge(histograms[leader]);
+	}
+
+	std::vector<ServerLatency> ranked;
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (clients[i])
+			clients[i]->close();
+		if (stats[i].samples > 0)
+			ranked.push_back(stats[i]);
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), [](const ServerLatency &a, const ServerLatency &b) -> bool {
+		return a.min < b.min;
+	});
+	return ranked;
 }
 
-bool SpeedTest::testLatency(SpeedTestClient &client, const int sample_size, long &latency) {
-	if (!client.connect())
-		return false;
-	latency = LONG_MAX;
-	long temp_latency = 0;
-	for (int i = 0; i < sample_size; i++) {
-		if (client.ping(temp_latency)) {
-			if (temp_latency < latency) {
-				latency = temp_latency;
-			}
-		} else {
-			return false;
-		}
+// latency is the minimum, the idle baseline; the histogram keeps every sample
+bool SpeedTest::testLatency(std::vector<std::unique_ptr<SpeedTestClient>> &clients, const int sample_size, long long &latency, LatencyHistogram &histogram) {
+	std::vector<SpeedTestClient *> ptrs;
+	for (auto &c : clients)
+		ptrs.push_back(c.get());
+	PingEngine engine(SPEED_TEST_PING_DEPTH, SPEED_TEST_PING_SPACING_US * 1000LL, SPEED_TEST_PING_TIMEOUT_MS);
+	std::vector<PingSample> samples;
+	bool success = engine.run(ptrs, sample_size, samples);
+	latency = LLONG_MAX;
+	for (auto &sample : samples) {
+		histogram.record(sample.rtt_ns);
+		latency = std::min(latency, sample.rtt_ns);
 	}
-	return true;
+	return success;
 }
\ No newline at end of file
@@ -6,7 +6,7 @@
 #define SPEEDTEST_SPEEDTEST_H
 #include "SpeedTestConfig.h"
 #include "SpeedTestClient.h"
-#include <libxml/xmlreader.h>
+#include <libxml/parser.h>
 #include <functional>
 #include <cmath>
 #include <curl/curl.h>
@@ -18,11 +18,24 @@
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include "DataTypes.h"
+#include "EpollTransferEngine.h"
+#include "UdpProbeEngine.h"
+#include "ServerListCache.h"
+#include "ServerIndex.h"
+#include "ConnectionPool.h"
+#include "CpuAffinity.h"
+#include "LatencyHistogram.h"
+#include "LatencyProbe.h"
+#include "PingEngine.h"
 
 class SpeedTestClient;
-typedef bool (SpeedTestClient::*opFn)(const long size, const long chunk_size, long &millisec);
+typedef bool (SpeedTestClient::*opFn)(const long size, const long chunk_size, long long &nanosec);
+typedef bool (SpeedTestClient::*streamFn)(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop);
 typedef void (*progressFn)(bool success);
+typedef size_t (*writeFn)(void *buf, size_t size, size_t nmemb, void *userp);
 
 class SpeedTest {
 public:
@@ -31,31 +44,88 @@ public:
 	CURLcode httpRequest(const std::string &url, const std::string &postdata, std::stringstream &ss, CURL *handler = nullptr, long timeout = 30);
 	static std::map<std::string, std::string> parseQueryString(const std::string &query);
 	static std::vector<std::string> splitString(const std::string &instr, const char separator);
+	static bool parseServers(const std::string &xml, const IPInfo &ipInfo, ServerCatalog &target);
+	template <typename T>
+		static T deg2rad(T n);
+	template <typename T>
+		static T harversine(std::pair<T, T> n1, std::pair<T, T> n2);
 	bool ipInfo(IPInfo &info);
-	const std::vector<ServerInfo> &serverList();
+	const ServerCatalog &serverList(std::function<void(const ServerInfo &)> cb = nullptr);
+	std::vector<ServerInfo> nearestServers(const float lat, const float lon, const size_t k);
+	std::vector<ServerInfo> serversWithin(const float lat, const float lon, const float radius_km);
 	const ServerInfo bestServer(const int sample_size = 5, std::function<void(bool)> cb = nullptr);
+	const std::vector<ServerLatency> &rankedServers();
 	bool setServer(ServerInfo &server);
-	const long &latency();
+	const long long &latency();
+	const LatencyHistogram &latencyHistogram();
+	const ThroughputResult &downloadResult();
+	const ThroughputResult &uploadResult();
 	bool downloadSpeed(const ServerInfo &server, const TestConfig &config, double &result, std::function<void(bool)> cb = nullptr);
 	bool uploadSpeed(const ServerInfo &server, const TestConfig &config, double &result, std::function<void(bool)> cb = nullptr);
-	bool jitter(const ServerInfo &server, long &result, const int sample = 40);
+	bool downloadSpeed(const ServerInfo &server, const AdaptiveConfig &config, double &result, TestConfig &selected, std::function<void(bool)> cb = nullptr);
+	bool uploadSpeed(const ServerInfo &server, const AdaptiveConfig &config, double &result, TestConfig &selected, std::function<void(bool)> cb = nullptr);
+	bool downloadSpeed(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, double &result, TestConfig &selected, std::vector<ServerThroughput> &perServer, std::function<void(bool)> cb = nullptr);
+	bool uploadSpeed(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, double &result, TestConfig &selected, std::vector<ServerThroughput> &perServer, std::function<void(bool)> cb = nullptr);
+	bool jitter(const ServerInfo &server, long long &result, const int sample = 40);
+	bool packetLoss(const ServerInfo &server, const UdpProbeConfig &config, UdpProbeResult &result, std::function<void(bool)> cb = nullptr);
 	bool share(const ServerInfo &server, std::string &image_url);
+	void setTransferEngine(TransferEngine engine);
+	void setTransferMode(TransferMode mode);
+	void setConvergenceTolerance(double tolerance);
+	void setServerListCache(const std::string &path, long ttl_seconds);
+	void setSocketOptions(const SocketOptions &options);
+	void setCpuAffinity(bool enabled);
+	void setLoadedLatency(bool enabled);
+	void setCancelled(bool cancelled);
+	bool cancelled() const;
 private:
-	bool fetchServers(const std::string &url, std::vector<ServerInfo> &target, int &http_code);
-	bool testLatency(SpeedTestClient &client, int sample_size, long &latency);
-	const ServerInfo findBestServerWithin(const std::vector<ServerInfo> &serverList, long &latency, const int sample_size = 5, std::function<void(bool)> cb = nullptr);
+	bool requestIpInfo(IPInfo &info);
+	bool fetchServers(const std::string &url, const IPInfo &ipInfo, ServerCatalog &target, int &http_code, std::function<void(const ServerInfo &)> cb = nullptr);
+	void loadServerListCache();
+	void indexServerList();
+	void refreshServerListCache();
+	bool testLatency(std::vector<std::unique_ptr<SpeedTestClient>> &clients, int sample_size, long long &latency, LatencyHistogram &histogram);
+	std::vector<std::unique_ptr<SpeedTestClient>> pingClients(const ServerInfo &server, std::unique_ptr<SpeedTestClient> first);
+	std::vector<ServerLatency> findBestServerWithin(const std::vector<ServerInfo> &serverList, const int sample_size = 5, std::function<void(bool)> cb = nullptr);
+	CURLcode httpRequest(const std::string &url, const std::string &postdata, writeFn writer, void *userp, CURL *handler = nullptr, long timeout = 30);
 	static size_t writeFunc(void *buf, size_t size, size_t nmemb, void *userp);
-	static ServerInfo processServerXMLNode(xmlTextReaderPtr reader);
-	double execute(const ServerInfo &server, const TestConfig &config, const opFn &pfunc, std::function<void(bool)> cb = nullptr);
-	template <typename T>
-		static T deg2rad(T n);
-	template <typename T>
-		static T harversine(std::pair<T, T> n1, std::pair<T, T> n2);
+	static int curlProgress(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+	static int curlSocketOptions(void *clientp, curl_socket_t fd, curlsocktype purpose);
+	static xmlParserCtxtPtr createServerXMLParser(void *userp);
+	static size_t serverXMLWriteFunc(void *buf, size_t size, size_t nmemb, void *userp);
+	static void serverXMLStartElement(void *userp, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes);
+	static ServerInfo processServerXMLNode(const xmlChar *name, const int nb_attributes, const xmlChar **attrs);
+	ThroughputResult execute(const ServerInfo &server, const TestConfig &config, const opFn &pfunc, std::function<void(bool)> cb = nullptr);
+	ThroughputResult executeStreaming(const ServerInfo &server, const TestConfig &config, const streamFn &sfunc, std::function<void(bool)> cb = nullptr);
+	CpuMeter::Sample startWorker();
+	ThroughputResult monitor(std::atomic<long long> &bytes, const std::atomic<int> &alive, const long duration_ms, std::function<void()> tick);
+	ThroughputResult monitor(std::function<long long()> bytes, const std::atomic<int> &alive, const long duration_ms, std::function<void()> tick);
+	ThroughputResult executeAdaptive(const ServerInfo &server, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, TestConfig &selected, std::function<void(bool)> cb = nullptr);
+	ThroughputResult executeMulti(const std::vector<ServerInfo> &servers, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, std::vector<ServerThroughput> &perServer, TestConfig &selected, std::function<void(bool)> cb = nullptr);
+	std::unique_ptr<EpollTransferEngine> streamEngine(const ServerInfo &server, const AdaptiveConfig &config, const int max_streams, const opFn &pfunc, const std::atomic<long> &chunk, const std::atomic<bool> &stop, CpuMeter &meter, std::function<void()> failed);
+	void startStream(std::vector<std::thread> &workers, EpollTransferEngine *engine, const ServerInfo &server, const AdaptiveConfig &config, const opFn &pfunc, const streamFn &sfunc, const std::atomic<long> &chunk, std::atomic<long long> &bytes, std::shared_ptr<std::atomic<bool>> stop, std::atomic<int> &alive, CpuMeter &meter, std::function<void()> failed);
 	IPInfo mIpInfo;
-	std::vector<ServerInfo> mServerList;
+	ServerCatalog mServerList;
+	ServerIndex mServerIndex;
+	std::vector<ServerLatency> mRankedServers;
 	float  mMinSupportedServer;
-	long   mLatency;
+	long long mLatency;
+	LatencyHistogram mLatencyHistogram;
 	double mUploadSpeed;
 	double mDownloadSpeed;
+	TransferEngine mEngine;
+	TransferMode   mMode;
+	double mTolerance;
+	ThroughputResult mDownloadResult;
+	ThroughputResult mUploadResult;
+	std::atomic<bool> mCancelled;
+	SocketOptions mSocketOptions;
+	ServerListCache mCache;
+	bool mCacheLoaded;
+	std::unique_ptr<SpeedTest> mCacheRefresher;
+	std::thread mCacheRefresh;
+	ConnectionPool mPool;
+	CpuAffinity mAffinity;
+	bool mLoadedLatency;
 };
 #endif // SPEEDTEST_SPEEDTEST_H
\ No newline at end of file
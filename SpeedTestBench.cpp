@@ -0,0 +1,246 @@
+//
+// Created on 10/16/26.
+//
+
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "SpeedTest.h"
+#include "SpeedTestClient.h"
+#include "SpeedTestServer.h"
+#include "ProtocolFramer.h"
+#include "ServerIndex.h"
+#include "Benchmark.h"
+
+void usage(const char* name) {
+	std::cerr << "Usage: " << name << " ";
+	std::cerr << "  [--filter name] [--time ms] [--json path] [--baseline path]\n"
+	             "       [--threshold ratio] [--help]\n";
+	std::cerr << "optional arguments:" << std::endl;
+	std::cerr << "  --help                   Show this message and exit\n";
+	std::cerr << "  --filter name            Only run benchmarks whose name contains name\n";
+	std::cerr << "  --time ms                Minimum run time of every benchmark. Default: 1000\n";
+	std::cerr << "  --json path              Write machine readable results to path\n";
+	std::cerr << "  --baseline path          Compare against results previously written with --json\n";
+	std::cerr << "  --threshold ratio        ns/op increase over the baseline reported as a regression. Default: 0.1\n";
+}
+
+static struct option BenchLongOptions[] = {
+	{"help",      no_argument,       0, 'h' },
+	{"filter",    required_argument, 0, 'f' },
+	{"time",      required_argument, 0, 't' },
+	{"json",      required_argument, 0, 'j' },
+	{"baseline",  required_argument, 0, 'b' },
+	{"threshold", required_argument, 0, 'r' },
+	{0,           0,                 0,  0  }
+};
+
+static std::string serverListXML(const int servers) {
+	std::stringstream xml;
+	xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<settings>\n<servers>\n";
+	for (int i = 0; i < servers; i++) {
+		xml << "<server url=\"http://speedtest" << i << ".example.net:8080/speedtest/upload.php\""
+		    << " lat=\"" << (i % 150) - 60 + 0.25 << "\" lon=\"" << (i % 360) - 180 + 0.5 << "\""
+		    << " name=\"City " << i % 3000 << "\" country=\"Country " << i % 150 << "\" cc=\"C" << i % 150 << "\""
+		    << " sponsor=\"Sponsor &amp; Co " << i % 800 << "\" id=\"" << i << "\" host=\"speedtest" << i << ".example.net:8080\" />\n";
+	}
+	xml << "</servers>\n</settings>\n";
+	return xml.str();
+}
+
+int main(const int argc, const char **argv) {
+	std::string filter;
+	std::string json_path;
+	std::string baseline_path;
+	long time_ms = 1000;
+	double threshold = 0.1;
+
+	int long_index = 0;
+	int opt = 0;
+	while ( (opt = getopt_long(argc, (char **)argv, "hf:t:j:b:r:", BenchLongOptions, &long_index)) != -1 ) {
+		switch (opt) {
+			case 'h':
+				usage(argv[0]);
+				return EXIT_SUCCESS;
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				time_ms = std::atol(optarg);
+				break;
+			case 'j':
+				json_path = optarg;
+				break;
+			case 'b':
+				baseline_path = optarg;
+				break;
+			case 'r':
+				threshold = std::atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	ServerConfig config = ServerConfig();
+	config.bind_address = "127.0.0.1";
+	config.port = 0;
+	config.threads = 1;
+	config.version = "2.9 (2.9.0) 2026-10-16.0000.0000000";
+	SpeedTestServer server(config);
+	if (!server.start())
+		return EXIT_FAILURE;
+	ServerInfo loopback = ServerInfo();
+	loopback.host = "127.0.0.1:" + std::to_string(server.port());
+
+	SpeedTestClient client(loopback);
+	if (!client.connect()) {
+		std::cerr << "Unable to connect to the loopback server." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+		std::cerr << "Unable to create a socket pair." << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string lines;
+	for (int i = 0; i < 256; i++)
+		lines += "PONG 1476625440" + std::to_string(100 + i) + "\n";
+	ProtocolFramer framer;
+
+	const std::string query = "ip_address=203.0.113.7&isp=Example+Telecom&lat=45.4642&lon=9.1900&country=IT";
+	const std::string xml = serverListXML(5000);
+	IPInfo ipInfo = IPInfo();
+	ipInfo.lat = 45.4642;
+	ipInfo.lon = 9.19;
+	ServerCatalog catalog;
+	SpeedTest::parseServers(xml, ipInfo, catalog);
+	ServerIndex index;
+	index.build(catalog);
+	std::vector<float> km;
+
+	const long transfer_size = 16 * 1024 * 1024;
+	Benchmark bench(time_ms);
+	std::vector<std::pair<std::string, std::function<BenchmarkResult(const std::string &)>>> suite = {
+		{"client_download", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				long long ns = 0;
+				return client.download(transfer_size, 131072, ns) ? transfer_size : 0;
+			});
+		}},
+		{"client_upload", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				long long ns = 0;
+				return client.upload(transfer_size, 131072, ns) ? transfer_size : 0;
+			});
+		}},
+		{"client_ping", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				long long ns = 0;
+				client.ping(ns);
+				return 0;
+			});
+		}},
+		{"framer_readline", [&](const std::string &name) {
+			return bench.run(name, 256, [&]() -> long long {
+				if (write(pair[0], lines.data(), lines.length()) != static_cast<ssize_t>(lines.length()))
+					return 0;
+				std::string line;
+				for (int i = 0; i < 256; i++)
+					framer.readLine(pair[1], line);
+				return static_cast<long long>(lines.length());
+			});
+		}},
+		{"parse_query_string", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				return SpeedTest::parseQueryString(query).size() > 0 ? 0 : 0;
+			});
+		}},
+		{"split_string", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				return SpeedTest::splitString(query, '&').size() > 0 ? 0 : 0;
+			});
+		}},
+		{"xml_server_list", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				ServerCatalog servers;
+				return SpeedTest::parseServers(xml, ipInfo, servers) ? static_cast<long long>(xml.length()) : 0;
+			});
+		}},
+		{"harversine", [&](const std::string &name) {
+			return bench.run(name, static_cast<long>(catalog.size()), [&]() -> long long {
+				volatile float sum = 0;
+				for (size_t i = 0; i < catalog.size(); i++)
+					sum = sum + SpeedTest::harversine(std::make_pair(ipInfo.lat, ipInfo.lon), std::make_pair(catalog.lat(i), catalog.lon(i)));
+				return 0;
+			});
+		}},
+		{"server_index_distances", [&](const std::string &name) {
+			return bench.run(name, static_cast<long>(index.size()), [&]() -> long long {
+				index.distances(ipInfo.lat, ipInfo.lon, km);
+				return 0;
+			});
+		}},
+		{"server_index_knearest", [&](const std::string &name) {
+			return bench.run(name, 1, [&]() -> long long {
+				return index.kNearest(ipInfo.lat, ipInfo.lon, 10).empty() ? 0 : 0;
+			});
+		}},
+	};
+
+	std::map<std::string, BenchmarkResult> baseline;
+	if (!baseline_path.empty() && !Benchmark::loadBaseline(baseline_path, baseline)) {
+		std::cerr << "Unable to read baseline " << baseline_path << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::vector<BenchmarkResult> results;
+	int regressions = 0;
+	std::cout << std::left << std::setw(24) << "benchmark" << std::right
+	          << std::setw(14) << "ns/op" << std::setw(14) << "MB/s" << std::setw(12) << "syscalls/op"
+	          << std::setw(14) << "cpu s/Gbit" << std::setw(12) << "vs base" << std::endl;
+	for (auto &entry : suite) {
+		if (!filter.empty() && entry.first.find(filter) == std::string::npos)
+			continue;
+		BenchmarkResult r = entry.second(entry.first);
+		results.push_back(r);
+		std::cout << std::left << std::setw(24) << r.name << std::right << std::fixed
+		          << std::setw(14) << std::setprecision(1) << r.ns_per_op
+		          << std::setw(14) << std::setprecision(1) << r.bytes_per_s / 1024 / 1024
+		          << std::setw(12) << std::setprecision(2) << r.syscalls_per_op
+		          << std::setw(14) << std::setprecision(4) << r.cpu_s_per_gbit;
+		auto base = baseline.find(r.name);
+		if (base != baseline.end() && base->second.ns_per_op > 0) {
+			double delta = r.ns_per_op / base->second.ns_per_op - 1;
+			std::cout << std::setw(11) << std::showpos << std::setprecision(1) << delta * 100 << "%" << std::noshowpos;
+			if (delta > threshold) {
+				std::cout << "  REGRESSION";
+				regressions++;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	client.close();
+	::close(pair[0]);
+	::close(pair[1]);
+	server.stop();
+	server.wait();
+
+	if (!json_path.empty()) {
+		std::ofstream out(json_path);
+		Benchmark::writeJson(results, out);
+		if (!out) {
+			std::cerr << "Unable to write " << json_path << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
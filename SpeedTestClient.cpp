@@ -4,12 +4,31 @@
 
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <algorithm>
+#include <deque>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#if defined(__linux__)
+#	include <linux/sockios.h>
+#endif
 #include "SpeedTestClient.h"
+#include "MonotonicClock.h"
 
-SpeedTestClient::SpeedTestClient(const ServerInfo &serverInfo): 
-	mServerInfo(serverInfo), 
-	mSocketFd(0), 
-	mServerVersion(-1.0) {
+SpeedTestClient::SpeedTestClient(const ServerInfo &serverInfo, const SocketOptions &options):
+	mHost(serverInfo.host),
+	mSocketOptions(options),
+	mSocketFd(0),
+	mServerVersion(-1.0),
+	mRingChunkSize(0),
+	mRingUpload(false),
+	mBytes(nullptr),
+	mStop(nullptr),
+	mChunk(nullptr) {
 }
 
 SpeedTestClient::~SpeedTestClient() {
@@ -31,7 +50,7 @@ bool SpeedTestClient::connect() {
 	}
 
 	std::string reply;
-	if (SpeedTestClient::readLine(mSocketFd, reply)) {
+	if (readLine(reply)) {
 		std::stringstream reply_stream(reply);
 		std::string hello;
 		reply_stream >> hello >> mServerVersion;
@@ -48,24 +67,46 @@ void SpeedTestClient::close() {
 	if (mSocketFd) {
 		SpeedTestClient::writeLine(mSocketFd, "QUIT");
 		::close(mSocketFd);
+		mSocketFd = 0;
+		mFramer.reset();
+	}
+}
+
+// It drops the connection without the QUIT handshake, e.g. in the middle of a stream
+void SpeedTestClient::abort() {
+	if (mSocketFd) {
+		::close(mSocketFd);
+		mSocketFd = 0;
+		mFramer.reset();
 	}
 }
 
+// True when the connection is open with nothing buffered or in flight and was not closed
+// by the server, so that another command can be sent on it
+bool SpeedTestClient::idle() {
+	if (!mSocketFd || mFramer.buffered() > 0)
+		return false;
+	struct pollfd pfd;
+	pfd.fd = mSocketFd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
 // It executes PING command
-bool SpeedTestClient::ping(long &millisec) {
-	millisec = LONG_MAX;
-	auto start = std::chrono::high_resolution_clock::now();
+bool SpeedTestClient::ping(long long &nanosec) {
+	nanosec = LLONG_MAX;
 	std::stringstream cmd;
-	cmd << "PING " << start.time_since_epoch().count() << "\n";
+	cmd << "PING " << MonotonicClock::now() << "\n";
+	auto start = MonotonicClock::now();
 	if (!SpeedTestClient::writeLine(mSocketFd, cmd.str()))
 		return false;
 
 	std::string reply;
-	//start = std::chrono::high_resolution_clock::now();
-	if (SpeedTestClient::readLine(mSocketFd, reply)) {
+	if (readLine(reply)) {
 		if (reply.substr(0, 5) == "PONG ") {
-			auto stop = std::chrono::high_resolution_clock::now();
-			millisec = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+			auto stop = MonotonicClock::now();
+			nanosec = stop - start;
 			return true;
 		}
 	}
@@ -73,109 +114,587 @@ bool SpeedTestClient::ping(long &millisec) {
 	return false;
 }
 
+// Pipelined PING: count requests with up to depth of them in flight, at least spacing_ns
+// apart, the first one not before start_ns. A server answers the commands of a connection
+// in order and its PONG carries its own clock, so every reply belongs to the oldest PING
+// in flight, whose token is its send time. samples are in send order. On failure the
+// connection is closed, as replies may still be on their way.
+bool SpeedTestClient::pingTrain(const int count, const int depth, const long long spacing_ns, const long long start_ns, const long timeout_ms, std::vector<PingSample> &samples) {
+	if (!mSocketFd)
+		return false;
+	// Nagle would hold every PING back until the previous one is acknowledged
+	int nodelay = 0;
+	socklen_t len = sizeof(nodelay);
+	getsockopt(mSocketFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+	int on = 1;
+	setsockopt(mSocketFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	const long long timeout_ns = timeout_ms * 1000000LL;
+	std::deque<long long> inflight;
+	long long next = start_ns;
+	int sent = 0;
+	bool success = true;
+	while (success && (sent < count || !inflight.empty())) {
+		long long now = MonotonicClock::now();
+		if (sent < count && static_cast<int>(inflight.size()) < depth && now >= next) {
+			std::stringstream cmd;
+			cmd << "PING " << now << "\n";
+			success = SpeedTestClient::writeLine(mSocketFd, cmd.str());
+			inflight.push_back(now);
+			next = now + spacing_ns;
+			sent++;
+			continue;
+		}
+		if (!inflight.empty() && now - inflight.front() > timeout_ns) {
+			success = false;
+			break;
+		}
+		// A line already buffered needs no poll; a partial one completes shortly
+		if (mFramer.buffered() == 0) {
+			long long wait = inflight.empty() ? next - now : inflight.front() + timeout_ns - now;
+			if (sent < count && static_cast<int>(inflight.size()) < depth)
+				wait = std::min(wait, next - now);
+			struct pollfd pfd;
+			pfd.fd = mSocketFd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			int ret = poll(&pfd, 1, static_cast<int>(std::max(0LL, (wait + 999999) / 1000000)));
+			if (ret < 0 && errno != EINTR)
+				success = false;
+			if (ret <= 0)
+				continue;
+		}
+		std::string reply;
+		if (!readLine(reply) || reply.substr(0, 5) != "PONG " || inflight.empty()) {
+			success = false;
+			break;
+		}
+		PingSample sample;
+		sample.sent_ns = inflight.front();
+		sample.rtt_ns = MonotonicClock::now() - sample.sent_ns;
+		samples.push_back(sample);
+		inflight.pop_front();
+	}
+
+	if (!success) {
+		abort();
+		return false;
+	}
+	setsockopt(mSocketFd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	return true;
+}
+
 // It executes DOWNLOAD command
-bool SpeedTestClient::download(const long size, const long chunk_size, long &millisec) {
-	millisec = LONG_MAX;
+bool SpeedTestClient::download(const long size, const long chunk_size, long long &nanosec) {
+	nanosec = LLONG_MAX;
 	std::stringstream cmd;
 	cmd << "DOWNLOAD " << size << "\n";
 	if (!SpeedTestClient::writeLine(mSocketFd, cmd.str()))
 		return false;
 
+	if (mRing && prepareRingBuffers(chunk_size, false))
+		return ringDownload(size, chunk_size, nanosec);
+
 	char *buff = new char[chunk_size];
 	for (size_t i = 0; i < static_cast<size_t>(chunk_size); i++)
 		buff[i] = '\0';
 
-	long missing = 0;
-	auto start = std::chrono::high_resolution_clock::now();
+	auto start = MonotonicClock::now();
+	long missing = static_cast<long>(mFramer.drain(static_cast<size_t>(size)));
 	while (missing < size) {
-		auto current = read(mSocketFd, buff, static_cast<ssize_t>(chunk_size));
-		if (current < 1) {
+		auto current = read(mSocketFd, buff, static_cast<size_t>(chunk(chunk_size)));
+		if (current < 1 || !account(current)) {
 			delete[] buff;
 			return false;
 		}
 		missing += current;
 	}
-	auto stop = std::chrono::high_resolution_clock::now();
-	millisec = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+	auto stop = MonotonicClock::now();
+	nanosec = stop - start;
 	delete[] buff;
 
 	return missing == size;
 }
 
 // It executes UPLOAD command
-bool SpeedTestClient::upload(const long size, const long chunk_size, long &millisec) {
-	millisec = LONG_MAX;
+bool SpeedTestClient::upload(const long size, const long chunk_size, long long &nanosec) {
+	nanosec = LLONG_MAX;
 	std::stringstream cmd;
 	cmd << "UPLOAD " << size << "\n";
 	if (!SpeedTestClient::writeLine(mSocketFd, cmd.str()))
 		return false;
 
+	if (mRing && prepareRingBuffers(chunk_size, true)) {
+		if (!ringUpload(size - cmd.str().length(), chunk_size, nanosec))
+			return false;
+		std::stringstream ss;
+		ss << "OK " << size << " ";
+		std::string reply;
+		if (!readLine(reply))
+			return false;
+		return reply.substr(0, ss.str().length()) == ss.str();
+	}
+
 	char *buff = new char[chunk_size];
 	for (size_t i = 0; i < static_cast<size_t>(chunk_size); i++)
 		buff[i] = static_cast<char>(rand() % 256);
 
 	long missing = size - cmd.str().length();
 	ssize_t len;
-	auto start = std::chrono::high_resolution_clock::now();
+	auto start = MonotonicClock::now();
 	while (missing > 0) {
-		if (missing - chunk_size > 0) {
-			len = static_cast<ssize_t>(chunk_size);
+		const long current = chunk(chunk_size);
+		if (missing - current > 0) {
+			len = static_cast<ssize_t>(current);
 		} else {
 			len = static_cast<ssize_t>(missing);
 			buff[missing - 1] = '\n';
 		}
 		auto n = write(mSocketFd, buff, len);
-		if (n != len) {
+		if (n != len || !account(n)) {
 			delete[] buff;
 			return false;
 		}
 		missing -= n;
 	}
-	auto stop = std::chrono::high_resolution_clock::now();
-	millisec = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count();
+	auto stop = MonotonicClock::now();
+	nanosec = stop - start;
 	delete[] buff;
 
 	std::stringstream ss;
 	ss << "OK " << size << " ";
 	std::string reply;
-	if (!SpeedTestClient::readLine(mSocketFd, reply))
+	if (!readLine(reply))
 		return false;
 
 	return reply.substr(0, ss.str().length()) == ss.str();
 }
 
+// Happy Eyeballs (RFC 8305): the addresses are tried in turn, a new attempt every
+// SPEED_TEST_HAPPY_EYEBALLS_DELAY_MS without waiting for the previous one to fail, and the
+// first connection to complete wins. The winner is remembered for the host, so the next
+// connections start with it and normally need a single attempt.
 bool SpeedTestClient::mkSocket() {
-	mSocketFd = socket(AF_INET, SOCK_STREAM, 0);
-	if (!mSocketFd)
+	std::vector<ResolverCache::Address> addresses;
+	if (!resolve(addresses))
+		return false;
+
+	std::vector<struct pollfd> attempts;
+	std::vector<size_t> tried;
+	size_t next = 0;
+	long long next_ns = 0;
+	size_t winner = addresses.size();
+	while (winner == addresses.size() && (next < addresses.size() || !attempts.empty())) {
+		long long now = MonotonicClock::now();
+		if (next < addresses.size() && (now >= next_ns || attempts.empty())) {
+			const ResolverCache::Address &address = addresses[next];
+			int fd = socket(address.addr.ss_family, SOCK_STREAM, 0);
+			if (fd >= 0 && applySocketOptions(fd, mSocketOptions) && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0 &&
+				(::connect(fd, (const struct sockaddr *)&address.addr, address.len) == 0 || errno == EINPROGRESS)) {
+				struct pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				attempts.push_back(pfd);
+				tried.push_back(next);
+			} else if (fd >= 0) {
+				::close(fd);
+			}
+			next++;
+			next_ns = now + SPEED_TEST_HAPPY_EYEBALLS_DELAY_MS * 1000000LL;
+			continue;
+		}
+		int timeout = next < addresses.size() ? static_cast<int>((next_ns - now + 999999) / 1000000) : -1;
+		if (poll(attempts.data(), attempts.size(), timeout) < 0 && errno != EINTR)
+			break;
+		for (size_t i = 0; i < attempts.size(); ) {
+			if (attempts[i].revents == 0) {
+				i++;
+				continue;
+			}
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+				winner = tried[i];
+				mSocketFd = attempts[i].fd;
+				attempts.erase(attempts.begin() + static_cast<long>(i));
+				tried.erase(tried.begin() + static_cast<long>(i));
+				break;
+			}
+			::close(attempts[i].fd);
+			attempts.erase(attempts.begin() + static_cast<long>(i));
+			tried.erase(tried.begin() + static_cast<long>(i));
+		}
+	}
+	for (auto &attempt : attempts)
+		::close(attempt.fd);
+	if (winner == addresses.size())
+		return false;
+
+	fcntl(mSocketFd, F_SETFL, fcntl(mSocketFd, F_GETFL, 0) & ~O_NONBLOCK);
+	auto hostp = hostport();
+	ResolverCache::instance().prefer(hostp.first, hostp.second, mSocketOptions, addresses[winner]);
+	return true;
+}
+
+// It pins an unconnected socket to a source address, a network device and/or a routing
+// mark, so that it leaves through a given uplink rather than the default route.
+// SO_BINDTODEVICE and SO_MARK need CAP_NET_RAW and CAP_NET_ADMIN respectively.
+bool SpeedTestClient::applySocketOptions(int fd, const SocketOptions &options) {
+	// Warm-up threads fail together, keep their messages on separate lines
+	auto fail = [](const std::string &what) {
+		std::cerr << ("SpeedTestClient::applySocketOptions: " + what + ": " + strerror(errno) + "\n") << std::flush;
 		return false;
+	};
+	if (!options.source_address.empty()) {
+		struct sockaddr_storage addr;
+		socklen_t len = 0;
+		if (!sourceAddress(options, addr, len)) {
+			errno = EINVAL;
+			return fail("Unable to bind to " + options.source_address);
+		}
+		if (bind(fd, (struct sockaddr *)&addr, len) < 0)
+			return fail("Unable to bind to " + options.source_address);
+	}
+#if defined(SO_BINDTODEVICE)
+	if (!options.device.empty() && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, options.device.c_str(), static_cast<socklen_t>(options.device.size())) < 0)
+		return fail("Unable to bind to device " + options.device);
+#endif
+#if defined(SO_MARK)
+	if (options.mark != 0 && setsockopt(fd, SOL_SOCKET, SO_MARK, &options.mark, sizeof(options.mark)) < 0)
+		return fail("Unable to set mark " + std::to_string(options.mark));
+#endif
+	return true;
+}
+
+// The source address as an IPv4 or IPv6 socket address with any port
+bool SpeedTestClient::sourceAddress(const SocketOptions &options, struct sockaddr_storage &addr, socklen_t &len) {
+	memset(&addr, 0, sizeof(addr));
+	auto in = reinterpret_cast<struct sockaddr_in *>(&addr);
+	auto in6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+	if (inet_pton(AF_INET, options.source_address.c_str(), &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+		len = sizeof(struct sockaddr_in);
+		return true;
+	}
+	if (inet_pton(AF_INET6, options.source_address.c_str(), &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		len = sizeof(struct sockaddr_in6);
+		return true;
+	}
+	return false;
+}
 
+// It resolves the server host:port through the shared cache, the preferred address first.
+// With a source address only the addresses of its family are kept.
+bool SpeedTestClient::resolve(std::vector<ResolverCache::Address> &addresses) {
 	auto hostp = hostport();
-#if __APPLE__
-	struct hostent *server = gethostbyname(hostp.first.c_str());
-	if (server == nullptr)
+	if (!ResolverCache::instance().resolve(hostp.first, hostp.second, mSocketOptions, addresses))
+		return false;
+	struct sockaddr_storage source;
+	socklen_t len = 0;
+	if (!mSocketOptions.source_address.empty() && sourceAddress(mSocketOptions, source, len)) {
+		addresses.erase(std::remove_if(addresses.begin(), addresses.end(), [&source](const ResolverCache::Address &address) {
+			return address.addr.ss_family != source.ss_family;
+		}), addresses.end());
+	}
+	return !addresses.empty();
+}
+
+// The address new connections should go to: the one that won the last race for the host
+bool SpeedTestClient::resolve(ResolverCache::Address &address) {
+	std::vector<ResolverCache::Address> addresses;
+	if (!resolve(addresses))
+		return false;
+	address = addresses[0];
+	return true;
+}
+
+// Bytes moved by download/upload are added to *bytes as they go, and a transfer in
+// progress fails as soon as *stop is raised. Either pointer may be null.
+void SpeedTestClient::setTransferControl(std::atomic<long long> *bytes, const std::atomic<bool> *stop) {
+	mBytes = bytes;
+	mStop = stop;
+}
+
+bool SpeedTestClient::account(const long n) {
+	if (mBytes)
+		mBytes->fetch_add(n, std::memory_order_relaxed);
+	return !(mStop && mStop->load(std::memory_order_relaxed));
+}
+
+// Every read and write of download/upload and of the streams moves at most *chunk bytes,
+// read again each time, so that a running transfer picks up a new size at once. The
+// chunk_size they are given is then the size of their buffers and caps it. Null lifts it.
+void SpeedTestClient::setChunkControl(const std::atomic<long> *chunk) {
+	mChunk = chunk;
+}
+
+long SpeedTestClient::chunk(const long chunk_size) const {
+	if (!mChunk)
+		return chunk_size;
+	return std::max(1L, std::min(chunk_size, mChunk->load(std::memory_order_relaxed)));
+}
+
+// It switches download/upload to an io_uring backend. It returns false, and
+// the blocking read()/write() path stays in use, when io_uring is unavailable.
+bool SpeedTestClient::enableIoUring(unsigned depth) {
+	if (mRing)
+		return true;
+	std::unique_ptr<IoUring> ring(new IoUring(depth));
+	if (!ring->init())
+		return false;
+	mRing = std::move(ring);
+	return true;
+}
+
+bool SpeedTestClient::prepareRingBuffers(const long chunk_size, bool upload) {
+	if (mRingChunkSize == chunk_size) {
+		if (upload && !mRingUpload) {
+			for (auto &c : mRingBuffer)
+				c = static_cast<char>('a' + rand() % 26);
+			mRingUpload = true;
+		}
+		return true;
+	}
+	const unsigned slots = mRing->entries();
+	mRingChunkSize = 0;
+	mRingBuffer.assign(slots * static_cast<size_t>(chunk_size), '\0');
+	std::vector<struct iovec> iov(slots);
+	for (unsigned i = 0; i < slots; i++) {
+		iov[i].iov_base = &mRingBuffer[i * chunk_size];
+		iov[i].iov_len = static_cast<size_t>(chunk_size);
+	}
+	if (!mRing->registerBuffers(iov))
+		return false;
+	mRingChunkSize = chunk_size;
+	mRingUpload = false;
+	return prepareRingBuffers(chunk_size, upload);
+}
+
+// It keeps up to one read per registered buffer queued, never asking for more than the bytes still due
+bool SpeedTestClient::ringDownload(const long size, const long chunk_size, long long &nanosec) {
+	const unsigned slots = mRing->entries();
+	std::vector<long> requested(slots, 0);
+	std::vector<unsigned> free_slots;
+	for (unsigned i = 0; i < slots; i++)
+		free_slots.push_back(i);
+
+	auto start = MonotonicClock::now();
+	long missing = size - static_cast<long>(mFramer.drain(static_cast<size_t>(size)));
+	long queued = 0;
+	unsigned inflight = 0;
+	bool ok = true;
+	while (ok && missing > 0) {
+		while (!free_slots.empty() && queued < missing) {
+			unsigned slot = free_slots.back();
+			long len = std::min(chunk(chunk_size), missing - queued);
+			if (!mRing->prepRead(mSocketFd, slot, &mRingBuffer[slot * chunk_size], static_cast<unsigned>(len), slot))
+				break;
+			free_slots.pop_back();
+			requested[slot] = len;
+			queued += len;
+			inflight++;
+		}
+		if (mRing->submitAndWait(1) < 0) {
+			ok = false;
+			break;
+		}
+		uint64_t slot;
+		int res;
+		while (mRing->popCompletion(slot, res)) {
+			inflight--;
+			queued -= requested[slot];
+			free_slots.push_back(static_cast<unsigned>(slot));
+			if (res <= 0 || !account(res))
+				ok = false;
+			else
+				missing -= res;
+		}
+	}
+	auto stop = MonotonicClock::now();
+	if (!ok) {
+		ringDrain(inflight);
 		return false;
-#else
-	struct hostent server;
-	char tmpbuf[BUFSIZ];
-	struct hostent *result;
-	int errnop;
-	if (gethostbyname_r(hostp.first.c_str(), &server, (char *)&tmpbuf, BUFSIZ, &result, &errnop))
+	}
+	nanosec = stop - start;
+	return missing == 0;
+}
+
+// It streams the payload through the registered buffers; the trailing newline goes out last, on its own
+bool SpeedTestClient::ringUpload(const long size, const long chunk_size, long long &nanosec) {
+	const unsigned slots = mRing->entries();
+	std::vector<long> requested(slots, 0);
+	std::vector<unsigned> free_slots;
+	for (unsigned i = 0; i < slots; i++)
+		free_slots.push_back(i);
+
+	long missing = size;
+	long queued = 0;
+	unsigned inflight = 0;
+	bool ok = true;
+	bool newline = false;
+	auto start = MonotonicClock::now();
+	while (ok && missing > 0) {
+		while (!free_slots.empty() && queued < missing - 1) {
+			unsigned slot = free_slots.back();
+			long len = std::min(chunk(chunk_size), missing - 1 - queued);
+			if (!mRing->prepWrite(mSocketFd, slot, &mRingBuffer[slot * chunk_size], static_cast<unsigned>(len), slot))
+				break;
+			free_slots.pop_back();
+			requested[slot] = len;
+			queued += len;
+			inflight++;
+		}
+		if (missing == 1 && inflight == 0) {
+			mRingBuffer[0] = '\n';
+			newline = true;
+			if (!mRing->prepWrite(mSocketFd, 0, &mRingBuffer[0], 1, 0))
+				ok = false;
+			free_slots.erase(std::find(free_slots.begin(), free_slots.end(), 0u));
+			requested[0] = 1;
+			queued += 1;
+			inflight++;
+		}
+		if (mRing->submitAndWait(1) < 0) {
+			ok = false;
+			break;
+		}
+		uint64_t slot;
+		int res;
+		while (mRing->popCompletion(slot, res)) {
+			inflight--;
+			queued -= requested[slot];
+			free_slots.push_back(static_cast<unsigned>(slot));
+			if (res <= 0 || !account(res))
+				ok = false;
+			else
+				missing -= res;
+		}
+	}
+	auto stop = MonotonicClock::now();
+	if (newline)
+		mRingBuffer[0] = 'a';
+	if (!ok) {
+		ringDrain(inflight);
 		return false;
+	}
+	nanosec = stop - start;
+	return missing == 0;
+}
+
+// It aborts the connection and waits for the queued operations that still reference the buffers
+void SpeedTestClient::ringDrain(unsigned inflight) {
+	shutdown(mSocketFd, SHUT_RDWR);
+	while (inflight > 0 && mRing->submitAndWait(1) >= 0) {
+		uint64_t slot;
+		int res;
+		while (mRing->popCompletion(slot, res))
+			inflight--;
+	}
+}
+
+// It keeps two DOWNLOAD requests queued back to back, so the server never idles
+// waiting for the next command, and accounts received bytes until stop is raised.
+bool SpeedTestClient::downloadStream(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop) {
+	std::stringstream cmd;
+	cmd << "DOWNLOAD " << request_size << "\n";
+	const std::string command = cmd.str();
+	setStreamTimeout(SPEED_TEST_STREAM_SAMPLE_MS);
+
+	long pending = 0;
+	std::vector<char> buff(static_cast<size_t>(chunk_size));
+	auto drained = static_cast<long>(mFramer.drain(static_cast<size_t>(request_size)));
+	bytes.fetch_add(drained, std::memory_order_relaxed);
+	pending -= drained;
+	while (!stop.load(std::memory_order_relaxed)) {
+		while (pending <= request_size) {
+			if (!SpeedTestClient::writeLine(mSocketFd, command))
+				return false;
+			pending += request_size;
+		}
+		auto n = read(mSocketFd, buff.data(), static_cast<size_t>(std::min(chunk(chunk_size), pending)));
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			continue;
+		if (n < 1)
+			return false;
+		pending -= n;
+		bytes.fetch_add(n, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+// It sends UPLOAD requests back to back without waiting for each OK reply and
+// accounts the bytes handed to the kernel until stop is raised.
+bool SpeedTestClient::uploadStream(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop) {
+	std::stringstream cmd;
+	cmd << "UPLOAD " << request_size << "\n";
+	const std::string command = cmd.str();
+	setStreamTimeout(SPEED_TEST_STREAM_SAMPLE_MS);
+
+	std::vector<char> buff(static_cast<size_t>(chunk_size));
+	for (auto &c : buff)
+		c = static_cast<char>('a' + rand() % 26);
+	char discard[4096];
+	while (!stop.load(std::memory_order_relaxed)) {
+		if (!SpeedTestClient::writeLine(mSocketFd, command))
+			return false;
+		long missing = request_size - static_cast<long>(command.length());
+		while (missing > 0 && !stop.load(std::memory_order_relaxed)) {
+			const char *data = missing > 1 ? buff.data() : "\n";
+			auto len = static_cast<size_t>(missing > 1 ? std::min(chunk(chunk_size), missing - 1) : 1);
+			auto n = write(mSocketFd, data, len);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				continue;
+			if (n < 1)
+				return false;
+			missing -= n;
+			bytes.fetch_add(n, std::memory_order_relaxed);
+		}
+		// OK replies are not needed to keep the pipe busy, discard them as they come
+		while (recv(mSocketFd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+	}
+#if defined(SIOCOUTQ)
+	int unsent = 0;
+	if (ioctl(mSocketFd, SIOCOUTQ, &unsent) == 0 && unsent > 0)
+		bytes.fetch_sub(unsent, std::memory_order_relaxed);
 #endif
+	return true;
+}
 
-	int portno = hostp.second;
-	struct sockaddr_in serv_addr{};
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-#if __APPLE__
-	memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, (size_t)server->h_length);
-#else
-	memcpy(&serv_addr.sin_addr.s_addr, server.h_addr, (size_t)server.h_length);
+// For a connection that only carries PINGs next to bulk ones: no Nagle delay, interactive
+// socket priority and low-delay TOS so that local queueing disciplines serve it first, and
+// a receive timeout so that a lost PONG does not block forever
+void SpeedTestClient::setInteractive(const long timeout_ms) {
+	int on = 1;
+	setsockopt(mSocketFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(SO_PRIORITY)
+	int priority = 6;
+	setsockopt(mSocketFd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
 #endif
-	serv_addr.sin_port = htons(static_cast<uint16_t>(portno));
+	int tos = IPTOS_LOWDELAY;
+	struct sockaddr_storage local;
+	socklen_t len = sizeof(local);
+	if (getsockname(mSocketFd, reinterpret_cast<struct sockaddr *>(&local), &len) == 0 && local.ss_family == AF_INET6)
+		setsockopt(mSocketFd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+	else
+		setsockopt(mSocketFd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	setStreamTimeout(timeout_ms);
+}
 
-	/* Dial */
-	return ::connect(mSocketFd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) >= 0;
+// It wakes up a call blocked on the connection from another thread; the connection is
+// unusable afterwards
+void SpeedTestClient::interrupt() {
+	if (mSocketFd)
+		::shutdown(mSocketFd, SHUT_RDWR);
+}
+
+void SpeedTestClient::setStreamTimeout(const long millisec) {
+	struct timeval tv;
+	tv.tv_sec = millisec / 1000;
+	tv.tv_usec = (millisec % 1000) * 1000;
+	setsockopt(mSocketFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(mSocketFd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 }
 
 float SpeedTestClient::version() {
@@ -183,28 +702,23 @@ float SpeedTestClient::version() {
 }
 
 const std::pair<std::string, int> SpeedTestClient::hostport() {
-	std::string targetHost = mServerInfo.host;
+	std::string targetHost = mHost;
+	// An IPv6 literal comes in brackets: [2001:db8::1]:8080
+	if (!targetHost.empty() && targetHost[0] == '[') {
+		std::size_t close = targetHost.find(']');
+		if (close != std::string::npos) {
+			std::string port = close + 1 < targetHost.length() ? targetHost.substr(close + 2) : "";
+			return std::pair<std::string, int>(targetHost.substr(1, close - 1), std::atoi(port.c_str()));
+		}
+	}
 	std::size_t found = targetHost.find(':');
 	std::string host = targetHost.substr(0, found);
 	std::string port = targetHost.substr(found + 1, targetHost.length() - found);
 	return std::pair<std::string, int>(host, std::atoi(port.c_str()));
 }
 
-bool SpeedTestClient::readLine(int &fd, std::string &buffer) {
-	if (!fd)
-		return false;
-
-	buffer.clear();
-	char c;
-	while (true) {
-		auto n = read(fd, &c, 1);
-		if (n < 1)
-			return false;
-		if (c == '\n' || c == '\r')
-			break;
-		buffer += c;
-	}
-	return buffer.length() > 0;
+bool SpeedTestClient::readLine(std::string &buffer) {
+	return mFramer.readLine(mSocketFd, buffer);
 }
 
 bool SpeedTestClient::writeLine(int &fd, const std::string &buffer) {
@@ -214,11 +728,16 @@ bool SpeedTestClient::writeLine(int &fd, const std::string &buffer) {
 	auto len = static_cast<ssize_t>(buffer.length());
 	if (len == 0)
 		return false;
-	std::string buff_copy = buffer;
-	if (buff_copy.find_first_of('\n') == std::string::npos) {
-		buff_copy += '\n';
+	struct iovec iov[2];
+	iov[0].iov_base = const_cast<char *>(buffer.c_str());
+	iov[0].iov_len = buffer.length();
+	iov[1].iov_base = const_cast<char *>("\n");
+	iov[1].iov_len = 1;
+	int iovcnt = 1;
+	if (buffer.find_first_of('\n') == std::string::npos) {
+		iovcnt = 2;
 		len += 1;
 	}
-	auto n = write(fd, buff_copy.c_str(), len);
+	auto n = writev(fd, iov, iovcnt);
 	return n == len;
 }
\ No newline at end of file
@@ -11,30 +11,66 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <chrono>
-#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "SpeedTest.h"
 #include "DataTypes.h"
+#include "IoUring.h"
+#include "ProtocolFramer.h"
+#include "ResolverCache.h"
 
 class SpeedTestClient {
 public:
-	explicit SpeedTestClient(const ServerInfo &serverInfo);
+	explicit SpeedTestClient(const ServerInfo &serverInfo, const SocketOptions &options = SocketOptions());
 	~SpeedTestClient();
 
 	bool connect();
 	void close();
-	bool ping(long &millisec);
-	bool download(const long size, const long chunk_size, long &millisec);
-	bool upload(const long size, const long chunk_size, long &millisec);
+	void abort();
+	bool idle();
+	bool ping(long long &nanosec);
+	bool pingTrain(const int count, const int depth, const long long spacing_ns, const long long start_ns, const long timeout_ms, std::vector<PingSample> &samples);
+	bool download(const long size, const long chunk_size, long long &nanosec);
+	bool upload(const long size, const long chunk_size, long long &nanosec);
+	bool downloadStream(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop);
+	bool uploadStream(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop);
 	float version();
 	const std::pair<std::string, int> hostport();
+	bool resolve(std::vector<ResolverCache::Address> &addresses);
+	bool resolve(ResolverCache::Address &address);
+	bool enableIoUring(unsigned depth);
+	void setTransferControl(std::atomic<long long> *bytes, const std::atomic<bool> *stop);
+	void setChunkControl(const std::atomic<long> *chunk);
+	void setInteractive(const long timeout_ms);
+	void interrupt();
+	static bool applySocketOptions(int fd, const SocketOptions &options);
+	static bool sourceAddress(const SocketOptions &options, struct sockaddr_storage &addr, socklen_t &len);
 private:
+	bool account(const long n);
+	long chunk(const long chunk_size) const;
 	bool mkSocket();
-	ServerInfo mServerInfo;
+	bool prepareRingBuffers(const long chunk_size, bool upload);
+	bool ringDownload(const long size, const long chunk_size, long long &nanosec);
+	bool ringUpload(const long size, const long chunk_size, long long &nanosec);
+	void ringDrain(unsigned inflight);
+	void setStreamTimeout(const long millisec);
+	std::string mHost;
+	SocketOptions mSocketOptions;
 	int mSocketFd;
 	float mServerVersion;
-	static bool readLine(int &fd, std::string &buffer);
+	std::unique_ptr<IoUring> mRing;
+	std::vector<char> mRingBuffer;
+	long mRingChunkSize;
+	bool mRingUpload;
+	ProtocolFramer mFramer;
+	std::atomic<long long> *mBytes;
+	const std::atomic<bool> *mStop;
+	const std::atomic<long> *mChunk;
+	bool readLine(std::string &buffer);
 	static bool writeLine(int &fd, const std::string &buffer);
 };
 
-typedef bool (SpeedTestClient::*opFn)(const long size, const long chunk_size, long &millisec);
+typedef bool (SpeedTestClient::*opFn)(const long size, const long chunk_size, long long &nanosec);
+typedef bool (SpeedTestClient::*streamFn)(const long request_size, const long chunk_size, std::atomic<long long> &bytes, const std::atomic<bool> &stop);
 #endif // SPEEDTEST_SPEEDTESTCLIENT_H
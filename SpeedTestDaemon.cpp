@@ -0,0 +1,198 @@
+//
+// Created on 10/16/26.
+//
+
+#include <chrono>
+#include <ctime>
+#include "SpeedTestDaemon.h"
+#include "MonotonicClock.h"
+
+static const std::vector<double> SPEED_BUCKETS_MBPS = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+static const std::vector<double> LATENCY_BUCKETS_S = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1};
+
+SpeedTestDaemon::SpeedTestDaemon(const DaemonConfig &config):
+	mConfig(config),
+	mRunner(config.runner),
+	mExporter(config.metrics_address, config.metrics_port, [this]() { return mMetrics.render(); }),
+	mStop(false),
+	mRng(std::random_device()()) {
+	mMetrics.counter("speedtest_runs_total", "Test runs by outcome");
+	mMetrics.gauge("speedtest_run_duration_seconds", "Wall time of the last run");
+	mMetrics.gauge("speedtest_last_run_timestamp_seconds", "Unix time the last run ended");
+	mMetrics.gauge("speedtest_last_success_timestamp_seconds", "Unix time the last successful run ended");
+	mMetrics.gauge("speedtest_server_info", "Server used by the last successful run");
+	mMetrics.gauge("speedtest_last_latency_seconds", "Latency to the server in the last run");
+	mMetrics.gauge("speedtest_last_jitter_seconds", "Jitter to the server in the last run");
+	mMetrics.gauge("speedtest_last_download_mbps", "Download speed of the last run in Mbit/s");
+	mMetrics.gauge("speedtest_last_upload_mbps", "Upload speed of the last run in Mbit/s");
+	mMetrics.gauge("speedtest_last_packet_loss_ratio", "Share of UDP probes lost in the last run");
+	mMetrics.gauge("speedtest_last_udp_jitter_seconds", "RFC 3550 jitter of the UDP probes in the last run");
+	mMetrics.summary("speedtest_ping_latency_seconds", "Latency over every ping of every successful run");
+	mMetrics.gauge("speedtest_last_loaded_latency_seconds", "Latency during the transfer tests of the last run");
+	mMetrics.gauge("speedtest_last_cpu_seconds", "CPU time of the transfer workers in the last run");
+	mMetrics.gauge("speedtest_last_cpu_bound", "Whether the client CPU saturated in the last run");
+	mMetrics.histogram("speedtest_latency_seconds", "Latency to the server", LATENCY_BUCKETS_S);
+	mMetrics.histogram("speedtest_jitter_seconds", "Jitter to the server", LATENCY_BUCKETS_S);
+	mMetrics.histogram("speedtest_download_mbps", "Download speed in Mbit/s", SPEED_BUCKETS_MBPS);
+	mMetrics.histogram("speedtest_upload_mbps", "Upload speed in Mbit/s", SPEED_BUCKETS_MBPS);
+	for (auto result : {"done", "failed", "cancelled"})
+		mMetrics.set("speedtest_runs_total", 0, MetricsRegistry::label("result", result));
+}
+
+SpeedTestDaemon::~SpeedTestDaemon() {
+	stop();
+	wait();
+}
+
+bool SpeedTestDaemon::start() {
+	if (!mExporter.start())
+		return false;
+	mScheduler = std::thread(&SpeedTestDaemon::loop, this);
+	return true;
+}
+
+// A run in progress is cancelled; it is not safe to call from a signal handler
+void SpeedTestDaemon::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+	mRunner.cancel();
+	mExporter.stop();
+}
+
+void SpeedTestDaemon::wait() {
+	if (mScheduler.joinable())
+		mScheduler.join();
+	mExporter.wait();
+}
+
+int SpeedTestDaemon::metricsPort() const {
+	return mExporter.port();
+}
+
+const MetricsRegistry &SpeedTestDaemon::metrics() const {
+	return mMetrics;
+}
+
+// Runs are scheduled start to start: a run longer than the interval is followed by the
+// next one right away, never by several at once.
+void SpeedTestDaemon::loop() {
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (!mStop) {
+		auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(nextDelayMillis());
+		lock.unlock();
+		measure();
+		lock.lock();
+		mWake.wait_until(lock, due, [this]() { return mStop; });
+	}
+}
+
+void SpeedTestDaemon::measure() {
+	// The server found by the first discovery is kept until a run against it fails. A
+	// multi-server test needs the ranked servers of a discovery, so it runs one every time.
+	RunnerOptions options = mConfig.runner;
+	if (options.selected_server.empty() && options.selected_serverid == -1 && options.multi_server == 1)
+		options.selected_server = mServer;
+	mRunner.setOptions(options);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mStop)
+			return;
+	}
+
+	auto start = MonotonicClock::now();
+	mRunner.start();
+	mRunner.wait();
+	auto phase = mRunner.poll();
+	auto report = mRunner.result();
+	record(phase, report, MonotonicClock::toMillis(MonotonicClock::now() - start) / 1000);
+
+	if (phase == SpeedTestRunner::done)
+		mServer = report.server.host;
+	else if (phase == SpeedTestRunner::failed)
+		mServer.clear();
+}
+
+void SpeedTestDaemon::record(SpeedTestRunner::Phase phase, const SpeedTestReport &report, double duration_s) {
+	auto now = static_cast<double>(std::time(nullptr));
+	mMetrics.add("speedtest_runs_total", 1, MetricsRegistry::label("result", SpeedTestRunner::phaseName(phase)));
+	mMetrics.set("speedtest_run_duration_seconds", duration_s);
+	mMetrics.set("speedtest_last_run_timestamp_seconds", now);
+	if (phase != SpeedTestRunner::done)
+		return;
+
+	mMetrics.set("speedtest_last_success_timestamp_seconds", now);
+	mMetrics.clear("speedtest_server_info");
+	mMetrics.set("speedtest_server_info", 1,
+		MetricsRegistry::label("id", std::to_string(report.server.id)) + "," +
+		MetricsRegistry::label("host", report.server.host) + "," +
+		MetricsRegistry::label("name", report.server.name) + "," +
+		MetricsRegistry::label("sponsor", report.server.sponsor));
+
+	double latency = MonotonicClock::toMillis(report.latency) / 1000;
+	double jitter = MonotonicClock::toMillis(report.jitter) / 1000;
+	mMetrics.set("speedtest_last_latency_seconds", latency);
+	mMetrics.set("speedtest_last_jitter_seconds", jitter);
+	mMetrics.observe("speedtest_latency_seconds", latency);
+	mMetrics.observe("speedtest_jitter_seconds", jitter);
+	recordLatencyHistogram(mRunner.latencyHistogram());
+	if (mConfig.runner.packet_loss && report.packet_loss.sent > 0) {
+		mMetrics.set("speedtest_last_packet_loss_ratio", report.packet_loss.loss);
+		mMetrics.set("speedtest_last_udp_jitter_seconds", MonotonicClock::toMillis(report.packet_loss.jitter) / 1000);
+	}
+	if (mConfig.runner.latency)
+		return;
+	if (!mConfig.runner.upload) {
+		mMetrics.set("speedtest_last_download_mbps", report.download.speed);
+		mMetrics.observe("speedtest_download_mbps", report.download.speed);
+		mMetrics.set("speedtest_last_cpu_seconds", report.download.cpu_user_s, MetricsRegistry::label("direction", "download") + "," + MetricsRegistry::label("mode", "user"));
+		mMetrics.set("speedtest_last_cpu_seconds", report.download.cpu_system_s, MetricsRegistry::label("direction", "download") + "," + MetricsRegistry::label("mode", "system"));
+		mMetrics.set("speedtest_last_cpu_bound", report.download.cpu_bound ? 1 : 0, MetricsRegistry::label("direction", "download"));
+		recordLoadedLatency("download", report.download.loaded);
+	}
+	if (!mConfig.runner.download) {
+		mMetrics.set("speedtest_last_upload_mbps", report.upload.speed);
+		mMetrics.observe("speedtest_upload_mbps", report.upload.speed);
+		mMetrics.set("speedtest_last_cpu_seconds", report.upload.cpu_user_s, MetricsRegistry::label("direction", "upload") + "," + MetricsRegistry::label("mode", "user"));
+		mMetrics.set("speedtest_last_cpu_seconds", report.upload.cpu_system_s, MetricsRegistry::label("direction", "upload") + "," + MetricsRegistry::label("mode", "system"));
+		mMetrics.set("speedtest_last_cpu_bound", report.upload.cpu_bound ? 1 : 0, MetricsRegistry::label("direction", "upload"));
+		recordLoadedLatency("upload", report.upload.loaded);
+	}
+}
+
+void SpeedTestDaemon::recordLoadedLatency(const std::string &direction, const LoadedLatency &loaded) {
+	if (!mConfig.runner.loaded_latency || loaded.samples == 0)
+		return;
+	auto quantile = [&](const char *q, long long value) {
+		mMetrics.set("speedtest_last_loaded_latency_seconds", MonotonicClock::toMillis(value) / 1000,
+			MetricsRegistry::label("direction", direction) + "," + MetricsRegistry::label("quantile", q));
+	};
+	quantile("0.5", loaded.p50);
+	quantile("0.9", loaded.p90);
+	quantile("0.99", loaded.p99);
+}
+
+// Runs are merged bucket by bucket, so the quantiles cover every sample since the start
+// at a fixed memory cost
+void SpeedTestDaemon::recordLatencyHistogram(const LatencyHistogram &histogram) {
+	mLatencyHistogram.merge(histogram);
+	LatencyStats stats = mLatencyHistogram.stats();
+	if (stats.count == 0)
+		return;
+	auto quantile = [&](const char *q, long long value) {
+		mMetrics.set("speedtest_ping_latency_seconds", MonotonicClock::toMillis(value) / 1000, MetricsRegistry::label("quantile", q));
+	};
+	quantile("0.5", stats.p50);
+	quantile("0.9", stats.p90);
+	quantile("0.99", stats.p99);
+	quantile("0.999", stats.p999);
+	mMetrics.summarize("speedtest_ping_latency_seconds", stats.mean * stats.count / 1000000000, stats.count);
+}
+
+long long SpeedTestDaemon::nextDelayMillis() {
+	double interval_ms = mConfig.interval_s * 1000.0;
+	std::uniform_real_distribution<double> spread(-mConfig.interval_jitter, mConfig.interval_jitter);
+	return static_cast<long long>(interval_ms * (1 + spread(mRng)));
+}
@@ -0,0 +1,49 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SPEEDTESTDAEMON_H
+#define SPEEDTEST_SPEEDTESTDAEMON_H
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include "DataTypes.h"
+#include "LatencyHistogram.h"
+#include "Metrics.h"
+#include "SpeedTestRunner.h"
+
+// Long running monitor: it repeats the configured test every interval (randomly spread
+// by interval_jitter, so that many probes do not hit a server in lockstep) with a single
+// SpeedTestRunner, so IP info, the server list and the selected server stay warm between
+// runs. Results are exported on an HTTP endpoint in Prometheus text format.
+class SpeedTestDaemon {
+public:
+	explicit SpeedTestDaemon(const DaemonConfig &config);
+	~SpeedTestDaemon();
+	bool start();
+	void stop();
+	void wait();
+	int  metricsPort() const;
+	const MetricsRegistry &metrics() const;
+private:
+	void loop();
+	void measure();
+	void record(SpeedTestRunner::Phase phase, const SpeedTestReport &report, double duration_s);
+	void recordLoadedLatency(const std::string &direction, const LoadedLatency &loaded);
+	void recordLatencyHistogram(const LatencyHistogram &histogram);
+	long long nextDelayMillis();
+
+	DaemonConfig mConfig;
+	SpeedTestRunner mRunner;
+	MetricsRegistry mMetrics;
+	MetricsExporter mExporter;
+	std::string mServer;
+	LatencyHistogram mLatencyHistogram;
+	std::thread mScheduler;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	bool mStop;
+	std::mt19937 mRng;
+};
+#endif // SPEEDTEST_SPEEDTESTDAEMON_H
@@ -0,0 +1,333 @@
+//
+// Created on 10/16/26.
+//
+
+#include "SpeedTestRunner.h"
+#include "ResolverCache.h"
+#include "TestConfigTemplate.h"
+
+SpeedTestRunner::SpeedTestRunner(const RunnerOptions &options):
+	mOptions(options),
+	mSpeedTest(SPEED_TEST_MIN_SERVER_VERSION),
+	mPhase(idle),
+	mRunning(false),
+	mCancel(false) {
+	mReport = SpeedTestReport();
+	mSpeedTest.setServerListCache(ServerListCache::defaultPath(), options.cache_ttl);
+}
+
+SpeedTestRunner::~SpeedTestRunner() {
+	cancel();
+	wait();
+}
+
+RunnerOptions SpeedTestRunner::defaultOptions() {
+	RunnerOptions options = RunnerOptions();
+	options.selected_serverid = -1;
+	options.sample_size = 10;
+	options.multi_server = 1;
+	options.udp_rate = udpProbeConfig.rate_pps;
+	options.engine = TransferEngine::threads;
+	options.mode = TransferMode::chunked;
+	options.tolerance = SPEED_TEST_CONVERGENCE_TOLERANCE;
+	options.cache_ttl = SPEED_TEST_SERVER_CACHE_TTL;
+	return options;
+}
+
+const char *SpeedTestRunner::phaseName(Phase phase) {
+	switch (phase) {
+		case idle:             return "idle";
+		case ip_info:          return "ip_info";
+		case server_list:      return "server_list";
+		case server_selection: return "server_selection";
+		case jitter:           return "jitter";
+		case packet_loss:      return "packet_loss";
+		case preflight:        return "preflight";
+		case download:         return "download";
+		case upload:           return "upload";
+		case share:            return "share";
+		case done:             return "done";
+		case failed:           return "failed";
+		case cancelled:        return "cancelled";
+	}
+	return "unknown";
+}
+
+// The options of the next run; refused while a test is running. The cache TTL only
+// applies to the first run.
+bool SpeedTestRunner::setOptions(const RunnerOptions &options) {
+	if (mRunning)
+		return false;
+	mOptions = options;
+	return true;
+}
+
+// cb is invoked on the worker thread: begin and end of every phase, and one step per
+// probed server or transfer sample while a phase runs. It must not call wait().
+void SpeedTestRunner::subscribe(ProgressCallback cb) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	mCb = cb;
+}
+
+bool SpeedTestRunner::start() {
+	if (mRunning)
+		return false;
+	if (mWorker.joinable())
+		mWorker.join();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport = SpeedTestReport();
+		mLatencyHistogram.reset();
+	}
+	// Server addresses are resolved once per run
+	ResolverCache::instance().clear(mOptions.socket);
+	mCancel = false;
+	mSpeedTest.setCancelled(false);
+	mPhase = idle;
+	mRunning = true;
+	mWorker = std::thread(&SpeedTestRunner::run, this);
+	return true;
+}
+
+SpeedTestRunner::Phase SpeedTestRunner::poll() const {
+	return static_cast<Phase>(mPhase.load());
+}
+
+bool SpeedTestRunner::running() const {
+	return mRunning;
+}
+
+// Transfer tests stop at their next sample; other phases are left at their next boundary
+void SpeedTestRunner::cancel() {
+	mCancel = true;
+	mSpeedTest.setCancelled(true);
+}
+
+void SpeedTestRunner::wait() {
+	if (mWorker.joinable() && mWorker.get_id() != std::this_thread::get_id())
+		mWorker.join();
+}
+
+SpeedTestReport SpeedTestRunner::result() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mReport;
+}
+
+// Latency samples of the last run, for merging across runs
+LatencyHistogram SpeedTestRunner::latencyHistogram() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mLatencyHistogram;
+}
+
+void SpeedTestRunner::run() {
+	mSpeedTest.setSocketOptions(mOptions.socket);
+	mSpeedTest.setCpuAffinity(mOptions.pin_cpus);
+	mSpeedTest.setLoadedLatency(mOptions.loaded_latency);
+	mSpeedTest.setTransferEngine(mOptions.engine);
+	mSpeedTest.setTransferMode(mOptions.mode);
+	mSpeedTest.setConvergenceTolerance(mOptions.tolerance);
+	auto progress = [this](bool success) {
+		notify(poll(), step, success);
+	};
+
+	if (!enter(ip_info))
+		return;
+	IPInfo info;
+	if (!mSpeedTest.ipInfo(info))
+		return fail("Unable to retrieve your IP info. Try again later");
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.ip_info = info;
+	}
+	leave(ip_info, true);
+
+	if (!enter(server_list))
+		return;
+	auto &serverList = mSpeedTest.serverList();
+	if (serverList.empty())
+		return fail("Unable to download server list. Try again later");
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.server_count = serverList.size();
+	}
+	leave(server_list, true);
+
+	if (!enter(server_selection))
+		return;
+	ServerInfo serverInfo;
+	if (mOptions.selected_server.empty() && mOptions.selected_serverid == -1) {
+		serverInfo = mSpeedTest.bestServer(std::max(mOptions.sample_size, mOptions.multi_server), progress);
+	} else {
+		serverInfo.host.append(mOptions.selected_server);
+		size_t index = 0;
+		if ( (mOptions.selected_serverid != -1 && serverList.find(mOptions.selected_serverid, index)) || serverList.findHost(serverInfo.host, index) )
+			serverInfo = serverList.info(index);
+		mSpeedTest.setServer(serverInfo);
+	}
+	if (serverInfo.host.empty())
+		return fail("Host name is empty.");
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.server = serverInfo;
+		mReport.latency = mSpeedTest.latency();
+	}
+	leave(server_selection, true);
+
+	if (!enter(jitter))
+		return;
+	long long jitter_ns = 0;
+	if (!mSpeedTest.jitter(serverInfo, jitter_ns))
+		return fail("Jitter measurement is unavailable at this time.");
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.jitter = jitter_ns;
+		mLatencyHistogram = mSpeedTest.latencyHistogram();
+		mReport.latency_stats = mLatencyHistogram.stats();
+	}
+	leave(jitter, true);
+
+	// Most servers run no UDP reflector, the test goes on without the loss figures
+	if (mOptions.packet_loss) {
+		if (!enter(packet_loss))
+			return;
+		UdpProbeConfig config = udpProbeConfig;
+		config.rate_pps = mOptions.udp_rate > 0 ? mOptions.udp_rate : config.rate_pps;
+		UdpProbeResult loss;
+		bool success = mSpeedTest.packetLoss(serverInfo, config, loss, progress);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mReport.packet_loss = loss;
+		}
+		leave(packet_loss, success);
+	}
+	if (mOptions.latency)
+		return finish();
+
+	// The multi-server test takes the best servers of the discovery, so it needs one
+	std::vector<ServerInfo> servers;
+	if (mOptions.multi_server > 1 && mOptions.selected_server.empty() && mOptions.selected_serverid == -1) {
+		for (auto &ranked : mSpeedTest.rankedServers()) {
+			if (servers.size() < static_cast<size_t>(mOptions.multi_server))
+				servers.push_back(ranked.server);
+		}
+	}
+	const bool multi = servers.size() > 1;
+
+	TestConfig uploadConfig;
+	TestConfig downloadConfig;
+	if (mOptions.preflight && !multi) {
+		if (!enter(preflight))
+			return;
+		double preSpeed = 0;
+		if (!mSpeedTest.downloadSpeed(serverInfo, preflightConfigDownload, preSpeed, progress))
+			return fail("Pre-flight check failed.");
+		testConfigSelector(preSpeed, uploadConfig, downloadConfig);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mReport.preflight_config = preflightConfigDownload;
+			mReport.preflight_speed = preSpeed;
+			mReport.download_config = downloadConfig;
+			mReport.upload_config = uploadConfig;
+		}
+		leave(preflight, true);
+	}
+
+	if (!mOptions.upload) {
+		if (!enter(download))
+			return;
+		double speed = 0;
+		std::vector<ServerThroughput> perServer;
+		bool success = multi
+			? mSpeedTest.downloadSpeed(servers, adaptiveConfigDownload, speed, downloadConfig, perServer, progress)
+			: mOptions.preflight
+			? mSpeedTest.downloadSpeed(serverInfo, downloadConfig, speed, progress)
+			: mSpeedTest.downloadSpeed(serverInfo, adaptiveConfigDownload, speed, downloadConfig, progress);
+		if (!success && !mCancel)
+			return fail("Download test failed.");
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mReport.download = mSpeedTest.downloadResult();
+			mReport.download_config = downloadConfig;
+			mReport.download_servers = perServer;
+		}
+		leave(download, success);
+	}
+	if (mOptions.download)
+		return finish();
+
+	if (!enter(upload))
+		return;
+	double speed = 0;
+	std::vector<ServerThroughput> perServer;
+	bool success = multi
+		? mSpeedTest.uploadSpeed(servers, adaptiveConfigUpload, speed, uploadConfig, perServer, progress)
+		: mOptions.preflight
+		? mSpeedTest.uploadSpeed(serverInfo, uploadConfig, speed, progress)
+		: mSpeedTest.uploadSpeed(serverInfo, adaptiveConfigUpload, speed, uploadConfig, progress);
+	if (!success && !mCancel)
+		return fail("Upload test failed.");
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.upload = mSpeedTest.uploadResult();
+		mReport.upload_config = uploadConfig;
+		mReport.upload_servers = perServer;
+	}
+	leave(upload, success);
+
+	if (mOptions.share) {
+		if (!enter(share))
+			return;
+		std::string share_url;
+		success = mSpeedTest.share(serverInfo, share_url);
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mReport.share_url = share_url;
+		}
+		leave(share, success);
+	}
+	finish();
+}
+
+// It moves to the next phase, unless the run was cancelled in the meantime
+bool SpeedTestRunner::enter(Phase phase) {
+	if (mCancel) {
+		mPhase = cancelled;
+		mRunning = false;
+		notify(cancelled, end, false);
+		return false;
+	}
+	mPhase = phase;
+	notify(phase, begin, true);
+	return true;
+}
+
+void SpeedTestRunner::leave(Phase phase, bool success) {
+	notify(phase, end, success);
+}
+
+void SpeedTestRunner::fail(const std::string &error) {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mReport.error = error;
+	}
+	mPhase = failed;
+	mRunning = false;
+	notify(failed, end, false);
+}
+
+void SpeedTestRunner::finish() {
+	bool success = !mCancel;
+	mPhase = success ? done : cancelled;
+	mRunning = false;
+	notify(success ? done : cancelled, end, success);
+}
+
+void SpeedTestRunner::notify(Phase phase, Event event, bool success) {
+	ProgressCallback cb;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		cb = mCb;
+	}
+	if (cb)
+		cb(phase, event, success);
+}
@@ -0,0 +1,58 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SPEEDTESTRUNNER_H
+#define SPEEDTEST_SPEEDTESTRUNNER_H
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "DataTypes.h"
+#include "SpeedTest.h"
+
+// Non-blocking front end of the library. start() runs a full test (IP info, server list,
+// server selection, jitter, packet loss, download, upload, share) on a worker thread; the caller polls
+// the current phase or subscribes to progress, may cancel at any time and reads a
+// structured report. A runner can be started again once finished: IP info, the server
+// list and the curl state of the previous run are reused.
+// The host process is expected to ignore SIGPIPE.
+class SpeedTestRunner {
+public:
+	enum Phase { idle, ip_info, server_list, server_selection, jitter, packet_loss, preflight, download, upload, share, done, failed, cancelled };
+	enum Event { begin, step, end };
+	typedef std::function<void(Phase phase, Event event, bool success)> ProgressCallback;
+
+	explicit SpeedTestRunner(const RunnerOptions &options);
+	~SpeedTestRunner();
+	static RunnerOptions defaultOptions();
+	static const char *phaseName(Phase phase);
+	bool setOptions(const RunnerOptions &options);
+	void subscribe(ProgressCallback cb);
+	bool start();
+	Phase poll() const;
+	bool running() const;
+	void cancel();
+	void wait();
+	SpeedTestReport result() const;
+	LatencyHistogram latencyHistogram() const;
+private:
+	void run();
+	bool enter(Phase phase);
+	void leave(Phase phase, bool success);
+	void fail(const std::string &error);
+	void finish();
+	void notify(Phase phase, Event event, bool success);
+
+	RunnerOptions mOptions;
+	SpeedTest mSpeedTest;
+	std::thread mWorker;
+	std::atomic<int> mPhase;
+	std::atomic<bool> mRunning;
+	std::atomic<bool> mCancel;
+	mutable std::mutex mMutex;
+	SpeedTestReport mReport;
+	LatencyHistogram mLatencyHistogram;
+	ProgressCallback mCb;
+};
+#endif // SPEEDTEST_SPEEDTESTRUNNER_H
@@ -0,0 +1,540 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "SpeedTestServer.h"
+#include "MonotonicClock.h"
+#include "UdpProbeEngine.h"
+
+static const size_t PAYLOAD_SIZE = 1024 * 1024;
+static const size_t UDP_BATCH = 64;
+static const size_t UDP_PACKET_SIZE = 65536;
+static char UDP_TAG;
+
+SpeedTestServer::SpeedTestServer(const ServerConfig &config):
+	mConfig(config),
+	mPort(config.port),
+	mPayload(PAYLOAD_SIZE),
+	mStop(false),
+	mSent(0),
+	mReceived(0) {
+	if (mConfig.threads < 1)
+		mConfig.threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+	// DOWNLOAD replies are random printable bytes; the client only counts them
+	std::mt19937 rng(20161016);
+	for (auto &c : mPayload)
+		c = static_cast<char>('A' + rng() % 26);
+}
+
+SpeedTestServer::~SpeedTestServer() {
+	stop();
+	wait();
+}
+
+// It binds one listening socket per worker and starts the workers. With port 0 the
+// kernel picks a free port, which port() reports afterwards.
+bool SpeedTestServer::start() {
+	for (int i = 0; i < mConfig.threads; i++) {
+		int fd = listen(mPort);
+		if (fd < 0) {
+			std::cerr << "SpeedTestServer::start: Unable to listen on " << mConfig.bind_address << ":" << mPort << ": " << strerror(errno) << std::endl;
+			for (auto lfd : mListenFds)
+				::close(lfd);
+			mListenFds.clear();
+			return false;
+		}
+		if (mPort == 0) {
+			struct sockaddr_storage addr;
+			socklen_t len = sizeof(addr);
+			getsockname(fd, (struct sockaddr *)&addr, &len);
+			if (addr.ss_family == AF_INET6)
+				mPort = ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
+			else
+				mPort = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+		}
+		mListenFds.push_back(fd);
+	}
+	for (int i = 0; i < mConfig.threads; i++) {
+		int fd = bindUdp(mPort);
+		if (fd < 0) {
+			std::cerr << "SpeedTestServer::start: Unable to bind UDP " << mConfig.bind_address << ":" << mPort << ": " << strerror(errno) << std::endl;
+			for (auto lfd : mListenFds)
+				::close(lfd);
+			for (auto ufd : mUdpFds)
+				::close(ufd);
+			mListenFds.clear();
+			mUdpFds.clear();
+			return false;
+		}
+		mUdpFds.push_back(fd);
+	}
+	for (size_t i = 0; i < mListenFds.size(); i++) {
+		int fd = mListenFds[i];
+		int udp_fd = mUdpFds[i];
+		mWorkers.push_back(std::thread([this, fd, udp_fd]() {
+			loop(fd, udp_fd);
+		}));
+	}
+	return true;
+}
+
+// Safe to call from a signal handler
+void SpeedTestServer::stop() {
+	mStop = true;
+}
+
+void SpeedTestServer::wait() {
+	for (auto &t : mWorkers) {
+		if (t.joinable())
+			t.join();
+	}
+	mWorkers.clear();
+}
+
+int SpeedTestServer::port() const {
+	return mPort;
+}
+
+long long SpeedTestServer::bytesSent() const {
+	return mSent;
+}
+
+long long SpeedTestServer::bytesReceived() const {
+	return mReceived;
+}
+
+int SpeedTestServer::listen(int port) {
+	struct sockaddr_storage addr;
+	socklen_t len = 0;
+	if (!address(port, addr, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	dualStack(fd, addr);
+
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0 || ::listen(fd, 1024) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// The UDP reflector shares the TCP port number, one SO_REUSEPORT socket per worker
+int SpeedTestServer::bindUdp(int port) {
+	struct sockaddr_storage addr;
+	socklen_t len = 0;
+	if (!address(port, addr, len)) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	int size = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	dualStack(fd, addr);
+
+	if (bind(fd, (struct sockaddr *)&addr, len) < 0) {
+		int err = errno;
+		::close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// The bind address, IPv4 or IPv6; all IPv4 addresses when none is set
+bool SpeedTestServer::address(int port, struct sockaddr_storage &addr, socklen_t &len) {
+	memset(&addr, 0, sizeof(addr));
+	auto in = reinterpret_cast<struct sockaddr_in *>(&addr);
+	auto in6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+	if (mConfig.bind_address.empty()) {
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_ANY);
+	} else if (inet_pton(AF_INET, mConfig.bind_address.c_str(), &in->sin_addr) == 1) {
+		in->sin_family = AF_INET;
+	} else if (inet_pton(AF_INET6, mConfig.bind_address.c_str(), &in6->sin6_addr) == 1) {
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(static_cast<uint16_t>(port));
+		len = sizeof(struct sockaddr_in6);
+		return true;
+	} else {
+		return false;
+	}
+	in->sin_port = htons(static_cast<uint16_t>(port));
+	len = sizeof(struct sockaddr_in);
+	return true;
+}
+
+// Bound to ::, a socket takes IPv4 clients as well
+void SpeedTestServer::dualStack(int fd, const struct sockaddr_storage &addr) {
+	if (addr.ss_family != AF_INET6)
+		return;
+	int off = 0;
+	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+}
+
+void SpeedTestServer::loop(int listen_fd, int udp_fd) {
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		::close(listen_fd);
+		::close(udp_fd);
+		return;
+	}
+	struct epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+	ev.data.ptr = &UDP_TAG;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, udp_fd, &ev);
+
+	std::vector<Connection *> connections;
+	struct epoll_event events[256];
+	while (!mStop) {
+		// Sleep until the next delayed reply or token refill is due, at most 100 ms
+		auto now = MonotonicClock::now();
+		long long wake_ns = now + 100000000LL;
+		for (auto conn : connections) {
+			if (conn->throttled)
+				wake_ns = std::min(wake_ns, now + 1000000LL);
+			else if (!conn->pending.empty() && conn->pending.front().due_ns > now)
+				wake_ns = std::min(wake_ns, conn->pending.front().due_ns);
+		}
+		int timeout = static_cast<int>((wake_ns - now + 999999) / 1000000);
+		int n = epoll_wait(epfd, events, 256, timeout);
+		if (n < 0 && errno != EINTR)
+			break;
+		now = MonotonicClock::now();
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == nullptr) {
+				accept(listen_fd, epfd, connections);
+				continue;
+			}
+			if (events[i].data.ptr == &UDP_TAG) {
+				reflect(udp_fd);
+				continue;
+			}
+			auto &conn = *static_cast<Connection *>(events[i].data.ptr);
+			if (conn.fd < 0)
+				continue;
+			bool ok = !(events[i].events & EPOLLERR);
+			if (ok && (events[i].events & (EPOLLIN | EPOLLHUP)))
+				ok = readable(conn, now);
+			if (ok && conn.fd >= 0)
+				ok = writable(conn, now) && update(conn, epfd, now);
+			if (!ok)
+				close(conn, epfd, false);
+		}
+		// Delayed and throttled connections make progress without socket events
+		for (auto conn : connections) {
+			if (conn->fd < 0 || (conn->pending.empty() && !conn->throttled))
+				continue;
+			bool ok = true;
+			if (conn->throttled && conn->events == 0)
+				ok = readable(*conn, now);
+			ok = ok && conn->fd >= 0 && writable(*conn, now) && update(*conn, epfd, now);
+			if (!ok)
+				close(*conn, epfd, false);
+		}
+		auto closed = std::remove_if(connections.begin(), connections.end(), [](Connection *conn) -> bool {
+			if (conn->fd >= 0)
+				return false;
+			delete conn;
+			return true;
+		});
+		connections.erase(closed, connections.end());
+	}
+	for (auto conn : connections) {
+		close(*conn, epfd, false);
+		delete conn;
+	}
+	::close(epfd);
+	::close(listen_fd);
+	::close(udp_fd);
+}
+
+void SpeedTestServer::accept(int listen_fd, int epfd, std::vector<Connection *> &connections) {
+	while (true) {
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+		if (fd < 0)
+			return;
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		auto conn = new Connection();
+		conn->fd = fd;
+		conn->refill_ns = MonotonicClock::now();
+		conn->events = EPOLLIN;
+		struct epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			::close(fd);
+			delete conn;
+			continue;
+		}
+		connections.push_back(conn);
+	}
+}
+
+// It consumes whatever the socket has: command lines, and the payload of an UPLOAD in progress
+bool SpeedTestServer::readable(Connection &conn, long long now) {
+	char buff[65536];
+	for (int i = 0; i < 16; i++) {
+		if (conn.upload_missing > 0) {
+			long drained = static_cast<long>(conn.framer.drain(static_cast<size_t>(conn.upload_missing)));
+			conn.upload_missing -= drained;
+			if (drained > 0)
+				mReceived.fetch_add(drained, std::memory_order_relaxed);
+			if (conn.upload_missing > 0) {
+				long limit = std::min(allowance(conn, now), std::min(conn.upload_missing, static_cast<long>(sizeof(buff))));
+				if (limit == 0)
+					return true;
+				auto n = read(conn.fd, buff, static_cast<size_t>(limit));
+				if (n == 0)
+					return false;
+				if (n < 0)
+					return errno == EAGAIN || errno == EWOULDBLOCK;
+				consume(conn, n);
+				conn.upload_missing -= n;
+				mReceived.fetch_add(n, std::memory_order_relaxed);
+			}
+			if (conn.upload_missing == 0) {
+				std::stringstream ss;
+				if (conn.upload_garbage)
+					ss << "OK garbage\n";
+				else
+					ss << "OK " << conn.upload_size << " " << epochMillis() << "\n";
+				reply(conn, ss.str(), 0, now);
+			}
+			continue;
+		}
+
+		std::string line;
+		int framed = conn.framer.tryReadLine(conn.fd, line);
+		if (framed < 0)
+			return false;
+		if (framed == 0)
+			return true;
+		mReceived.fetch_add(static_cast<long long>(line.length()) + 1, std::memory_order_relaxed);
+		if (!command(conn, line, now))
+			return false;
+		if (conn.fd < 0)
+			return true;
+	}
+	return true;
+}
+
+bool SpeedTestServer::command(Connection &conn, const std::string &line, long long now) {
+	if (conn.stalled)
+		return true;
+	if (fault(mConfig.reset_rate)) {
+		close(conn, -1, true);
+		return true;
+	}
+	if (fault(mConfig.stall_rate)) {
+		conn.stalled = true;
+		return true;
+	}
+	const bool garbage = fault(mConfig.garbage_rate);
+
+	std::stringstream cmd(line);
+	std::string verb;
+	long size = 0;
+	cmd >> verb;
+	if (verb == "HI") {
+		reply(conn, garbage ? "HELO\n" : "HELLO " + mConfig.version + "\n", 0, now);
+	} else if (verb == "PING") {
+		std::stringstream ss;
+		ss << (garbage ? "PNG " : "PONG ") << epochMillis() << "\n";
+		reply(conn, ss.str(), 0, now);
+	} else if (verb == "DOWNLOAD" && (cmd >> size) && size > 0) {
+		// A garbage reply is one byte short, so the client waits for data that never comes
+		reply(conn, "", garbage ? size - 1 : size, now);
+	} else if (verb == "UPLOAD" && (cmd >> size) && size > 0) {
+		conn.upload_size = size;
+		conn.upload_garbage = garbage;
+		conn.upload_missing = std::max(0L, size - static_cast<long>(line.length()) - 1);
+		if (conn.upload_missing == 0) {
+			std::stringstream ss;
+			ss << "OK " << size << " " << epochMillis() << "\n";
+			reply(conn, ss.str(), 0, now);
+		}
+	} else if (verb == "QUIT") {
+		return false;
+	} else {
+		reply(conn, "ERROR\n", 0, now);
+	}
+	return true;
+}
+
+void SpeedTestServer::reply(Connection &conn, const std::string &line, long payload, long long now) {
+	Response response;
+	response.due_ns = now + mConfig.latency_us * 1000LL;
+	response.line = line;
+	response.payload = payload;
+	conn.pending.push_back(response);
+}
+
+// It sends every reply that is due, as far as the socket and the rate limit allow
+bool SpeedTestServer::writable(Connection &conn, long long now) {
+	while (!conn.pending.empty() && conn.pending.front().due_ns <= now) {
+		Response &response = conn.pending.front();
+		ssize_t n;
+		if (conn.out_offset < response.line.length()) {
+			n = send(conn.fd, response.line.data() + conn.out_offset, response.line.length() - conn.out_offset, MSG_NOSIGNAL);
+			if (n > 0)
+				conn.out_offset += static_cast<size_t>(n);
+		} else if (response.payload > 0) {
+			long limit = std::min(allowance(conn, now), std::min(response.payload, static_cast<long>(mPayload.size())));
+			if (limit == 0)
+				return true;
+			// The last byte of a DOWNLOAD reply is a newline
+			if (response.payload == 1)
+				n = send(conn.fd, "\n", 1, MSG_NOSIGNAL);
+			else
+				n = send(conn.fd, mPayload.data(), static_cast<size_t>(std::min(limit, response.payload - 1)), MSG_NOSIGNAL);
+			if (n > 0) {
+				consume(conn, n);
+				response.payload -= n;
+			}
+		} else {
+			conn.pending.pop_front();
+			conn.out_offset = 0;
+			continue;
+		}
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		mSent.fetch_add(n, std::memory_order_relaxed);
+	}
+	return true;
+}
+
+// Token bucket in bytes, refilled at --rate and capped at 10 ms worth of traffic (64 KiB minimum)
+long SpeedTestServer::allowance(Connection &conn, long long now) {
+	if (mConfig.rate_mbps <= 0)
+		return LONG_MAX;
+	const double rate = mConfig.rate_mbps * 1024 * 1024 / 8;
+	const double burst = std::max(65536.0, rate / 100);
+	conn.tokens = std::min(burst, conn.tokens + (now - conn.refill_ns) * rate / 1e9);
+	conn.refill_ns = now;
+	conn.throttled = conn.tokens < 1;
+	return conn.throttled ? 0 : static_cast<long>(conn.tokens);
+}
+
+void SpeedTestServer::consume(Connection &conn, long bytes) {
+	if (mConfig.rate_mbps > 0)
+		conn.tokens -= bytes;
+}
+
+// It keeps the epoll interest in line with what the connection is waiting for
+bool SpeedTestServer::update(Connection &conn, int epfd, long long now) {
+	uint32_t events = 0;
+	if (!conn.throttled || conn.upload_missing == 0)
+		events |= EPOLLIN;
+	if (!conn.throttled && !conn.pending.empty() && conn.pending.front().due_ns <= now)
+		events |= EPOLLOUT;
+	if (events == conn.events)
+		return true;
+	struct epoll_event ev{};
+	ev.events = events;
+	ev.data.ptr = &conn;
+	conn.events = events;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev) == 0;
+}
+
+// A reset closes with SO_LINGER 0, so the peer sees a RST instead of a FIN
+void SpeedTestServer::close(Connection &conn, int epfd, bool reset) {
+	if (conn.fd < 0)
+		return;
+	if (reset) {
+		struct linger lg;
+		lg.l_onoff = 1;
+		lg.l_linger = 0;
+		setsockopt(conn.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	if (epfd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conn.fd, nullptr);
+	::close(conn.fd);
+	conn.fd = -1;
+}
+
+// Probes go back to their sender as they are, in batches; anything else is ignored, and
+// --udp-loss drops probes on purpose
+void SpeedTestServer::reflect(int udp_fd) {
+	static thread_local std::vector<char> buffers(UDP_BATCH * UDP_PACKET_SIZE);
+	struct sockaddr_storage peers[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct mmsghdr in[UDP_BATCH];
+	struct mmsghdr out[UDP_BATCH];
+	const uint32_t magic = htonl(UdpProbeEngine::MAGIC);
+	for (int round = 0; round < 16; round++) {
+		for (size_t i = 0; i < UDP_BATCH; i++) {
+			iovs[i].iov_base = buffers.data() + i * UDP_PACKET_SIZE;
+			iovs[i].iov_len = UDP_PACKET_SIZE;
+			memset(&in[i], 0, sizeof(in[i]));
+			in[i].msg_hdr.msg_name = &peers[i];
+			in[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+			in[i].msg_hdr.msg_iov = &iovs[i];
+			in[i].msg_hdr.msg_iovlen = 1;
+		}
+		int n = recvmmsg(udp_fd, in, UDP_BATCH, MSG_DONTWAIT, nullptr);
+		if (n <= 0)
+			return;
+		unsigned count = 0;
+		for (int i = 0; i < n; i++) {
+			if (in[i].msg_len < sizeof(magic) || memcmp(iovs[i].iov_base, &magic, sizeof(magic)) != 0 || fault(mConfig.udp_loss_rate))
+				continue;
+			mReceived.fetch_add(in[i].msg_len, std::memory_order_relaxed);
+			iovs[i].iov_len = in[i].msg_len;
+			out[count] = in[i];
+			count++;
+		}
+		for (unsigned sent = 0; sent < count; ) {
+			int r = sendmmsg(udp_fd, out + sent, count - sent, 0);
+			if (r <= 0)
+				break;
+			for (int i = 0; i < r; i++)
+				mSent.fetch_add(out[sent + i].msg_hdr.msg_iov->iov_len, std::memory_order_relaxed);
+			sent += static_cast<unsigned>(r);
+		}
+		if (static_cast<size_t>(n) < UDP_BATCH)
+			return;
+	}
+}
+
+bool SpeedTestServer::fault(double rate) {
+	if (rate <= 0)
+		return false;
+	static thread_local std::mt19937 rng(static_cast<unsigned int>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+	return std::uniform_real_distribution<double>(0.0, 1.0)(rng) < rate;
+}
+
+long long SpeedTestServer::epochMillis() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,80 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_SPEEDTESTSERVER_H
+#define SPEEDTEST_SPEEDTESTSERVER_H
+#include <atomic>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include "DataTypes.h"
+#include "ProtocolFramer.h"
+
+// Stand-in for a speedtest.net server speaking the raw TCP protocol (HI, PING, DOWNLOAD,
+// UPLOAD, QUIT). Every worker thread owns an SO_REUSEPORT listening socket and an epoll
+// loop, so accepted connections spread across cores without any shared state.
+// Replies can be delayed, connections rate limited, and commands made to fail on purpose.
+// Each worker also reflects UdpProbeEngine probes sent to the same port over UDP.
+class SpeedTestServer {
+public:
+	explicit SpeedTestServer(const ServerConfig &config);
+	~SpeedTestServer();
+	bool start();
+	void stop();
+	void wait();
+	int  port() const;
+	long long bytesSent() const;
+	long long bytesReceived() const;
+private:
+	typedef struct response_t {
+		long long   due_ns;
+		std::string line;
+		long        payload;
+	} Response;
+	typedef struct connection_t {
+		int  fd;
+		ProtocolFramer framer;
+		long upload_size;
+		long upload_missing;
+		bool upload_garbage;
+		bool stalled;
+		bool throttled;
+		size_t out_offset;
+		std::deque<Response> pending;
+		double tokens;
+		long long refill_ns;
+		uint32_t events;
+	} Connection;
+
+	int  listen(int port);
+	int  bindUdp(int port);
+	bool address(int port, struct sockaddr_storage &addr, socklen_t &len);
+	static void dualStack(int fd, const struct sockaddr_storage &addr);
+	void loop(int listen_fd, int udp_fd);
+	void reflect(int udp_fd);
+	void accept(int listen_fd, int epfd, std::vector<Connection *> &connections);
+	bool readable(Connection &conn, long long now);
+	bool writable(Connection &conn, long long now);
+	bool command(Connection &conn, const std::string &line, long long now);
+	void reply(Connection &conn, const std::string &line, long payload, long long now);
+	long allowance(Connection &conn, long long now);
+	void consume(Connection &conn, long bytes);
+	bool update(Connection &conn, int epfd, long long now);
+	void close(Connection &conn, int epfd, bool reset);
+	bool fault(double rate);
+	static long long epochMillis();
+
+	ServerConfig mConfig;
+	int mPort;
+	std::vector<int> mListenFds;
+	std::vector<int> mUdpFds;
+	std::vector<std::thread> mWorkers;
+	std::vector<char> mPayload;
+	std::atomic<bool> mStop;
+	std::atomic<long long> mSent;
+	std::atomic<long long> mReceived;
+};
+#endif // SPEEDTEST_SPEEDTESTSERVER_H
@@ -0,0 +1,116 @@
+//
+// Created on 10/16/26.
+//
+
+#include <csignal>
+#include <cstring>
+#include <getopt.h>
+#include "SpeedTestServer.h"
+
+static SpeedTestServer *server = nullptr;
+
+static void onSignal(int) {
+	if (server)
+		server->stop();
+}
+
+void usage(const char* name) {
+	std::cerr << "Usage: " << name << " ";
+	std::cerr << "  [--port port] [--bind address] [--threads n] [--version-string version]\n"
+	             "       [--latency ms] [--rate Mbit/s] [--reset-rate p] [--stall-rate p]\n"
+	             "       [--garbage-rate p] [--udp-loss p] [--help]\n";
+	std::cerr << "optional arguments:" << std::endl;
+	std::cerr << "  --help                   Show this message and exit\n";
+	std::cerr << "  --port port              TCP port to listen on, 0 picks a free one. Default: 8080\n";
+	std::cerr << "  --bind address           IPv4 or IPv6 address to listen on, :: for both families.\n"
+	             "                           Default: all IPv4 addresses\n";
+	std::cerr << "  --threads n              Number of epoll workers. Default: one per core\n";
+	std::cerr << "  --version-string version Version announced in the HELLO reply\n";
+	std::cerr << "  --latency ms             Delay every reply by ms milliseconds\n";
+	std::cerr << "  --rate Mbit/s            Limit every connection to this rate, in both directions\n";
+	std::cerr << "  --reset-rate p           Probability that a command resets the connection\n";
+	std::cerr << "  --stall-rate p           Probability that a command, and every later one, is never answered\n";
+	std::cerr << "  --garbage-rate p         Probability that a command gets a malformed reply\n";
+	std::cerr << "  --udp-loss p             Probability that a UDP probe is not reflected\n";
+}
+
+static struct option ServerLongOptions[] = {
+	{"help",           no_argument,       0, 'h' },
+	{"port",           required_argument, 0, 'p' },
+	{"bind",           required_argument, 0, 'b' },
+	{"threads",        required_argument, 0, 'n' },
+	{"version-string", required_argument, 0, 'v' },
+	{"latency",        required_argument, 0, 'l' },
+	{"rate",           required_argument, 0, 'r' },
+	{"reset-rate",     required_argument, 0, 'R' },
+	{"stall-rate",     required_argument, 0, 'S' },
+	{"garbage-rate",   required_argument, 0, 'G' },
+	{"udp-loss",       required_argument, 0, 'U' },
+	{0,                0,                 0,  0  }
+};
+
+int main(const int argc, const char **argv) {
+	ServerConfig config = ServerConfig();
+	config.port = 8080;
+	config.threads = 0;
+	config.version = "2.9 (2.9.0) 2026-10-16.0000.0000000";
+
+	int long_index = 0;
+	int opt = 0;
+	while ( (opt = getopt_long(argc, (char **)argv, "hp:b:n:v:l:r:R:S:G:U:", ServerLongOptions, &long_index)) != -1 ) {
+		switch (opt) {
+			case 'h':
+				usage(argv[0]);
+				return EXIT_SUCCESS;
+			case 'p':
+				config.port = std::atoi(optarg);
+				break;
+			case 'b':
+				config.bind_address = optarg;
+				break;
+			case 'n':
+				config.threads = std::atoi(optarg);
+				break;
+			case 'v':
+				config.version = optarg;
+				break;
+			case 'l':
+				config.latency_us = static_cast<long>(std::atof(optarg) * 1000);
+				break;
+			case 'r':
+				config.rate_mbps = std::atof(optarg);
+				break;
+			case 'R':
+				config.reset_rate = std::atof(optarg);
+				break;
+			case 'S':
+				config.stall_rate = std::atof(optarg);
+				break;
+			case 'G':
+				config.garbage_rate = std::atof(optarg);
+				break;
+			case 'U':
+				config.udp_loss_rate = std::atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	SpeedTestServer instance(config);
+	if (!instance.start())
+		return EXIT_FAILURE;
+	server = &instance;
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	std::string address = config.bind_address.empty() ? "0.0.0.0" : config.bind_address;
+	if (address.find(':') != std::string::npos)
+		address = "[" + address + "]";
+	std::cout << "Listening on " << address << ":" << instance.port() << " (TCP and UDP)" << std::endl;
+	instance.wait();
+	server = nullptr;
+	std::cout << "Sent " << instance.bytesSent() << " bytes, received " << instance.bytesReceived() << " bytes" << std::endl;
+	return EXIT_SUCCESS;
+}
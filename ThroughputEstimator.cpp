@@ -0,0 +1,108 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cmath>
+#include "ThroughputEstimator.h"
+
+// A window is part of the slow-start ramp while it is this much faster than the previous one
+static const double SLOW_START_GROWTH = 0.05;
+
+// Two-sided 95% Student's t quantiles for 1..30 degrees of freedom
+static const double T_QUANTILES[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+ThroughputEstimator::ThroughputEstimator(const long window_ms, const int min_windows, const double tolerance):
+	mWindowNs(window_ms * 1000000LL),
+	mMinWindows(min_windows < 2 ? 2 : min_windows),
+	mTolerance(tolerance),
+	mWindowStartNs(-1),
+	mWindowStartBytes(0),
+	mFirstNs(0),
+	mFirstBytes(0),
+	mSteadyStartNs(0),
+	mSteadyStartBytes(0),
+	mLastNs(0),
+	mLastBytes(0),
+	mSteady(false),
+	mPreviousRate(0) {
+}
+
+// It accounts a cumulative byte count taken at now_ns
+void ThroughputEstimator::sample(const long long now_ns, const long long bytes) {
+	if (mWindowStartNs < 0) {
+		mWindowStartNs = mFirstNs = mLastNs = now_ns;
+		mWindowStartBytes = mFirstBytes = mLastBytes = bytes;
+		return;
+	}
+	mLastNs = now_ns;
+	mLastBytes = bytes;
+	if (now_ns - mWindowStartNs < mWindowNs)
+		return;
+
+	double rate = (bytes - mWindowStartBytes) * 8 / (static_cast<double>(now_ns - mWindowStartNs) / 1000000000);
+	if (!mSteady && (mPreviousRate == 0 || rate > mPreviousRate * (1 + SLOW_START_GROWTH))) {
+		mPreviousRate = rate;
+	} else {
+		if (!mSteady) {
+			mSteady = true;
+			mSteadyStartNs = mWindowStartNs;
+			mSteadyStartBytes = mWindowStartBytes;
+		}
+		mRates.push_back(rate);
+	}
+	mWindowStartNs = now_ns;
+	mWindowStartBytes = bytes;
+}
+
+bool ThroughputEstimator::converged() const {
+	if (mTolerance <= 0 || static_cast<int>(mRates.size()) < mMinWindows)
+		return false;
+	auto current = speed();
+	return current > 0 && halfWidth() <= current * mTolerance;
+}
+
+// Aggregate bytes over wall time since the end of slow start, in bit/s, with a 95% confidence
+// interval. Until a steady window is seen the whole run is used and the interval is left open.
+ThroughputResult ThroughputEstimator::result() const {
+	ThroughputResult r = ThroughputResult();
+	r.speed = speed();
+	r.windows = static_cast<int>(mRates.size());
+	r.converged = converged();
+	// The interval needs at least two steady windows, before that lower and upper are unset
+	r.bounded = r.windows >= 2;
+	if (r.bounded) {
+		double h = halfWidth();
+		r.lower = std::max(0.0, r.speed - h);
+		r.upper = r.speed + h;
+	}
+	return r;
+}
+
+double ThroughputEstimator::speed() const {
+	long long start_ns = mSteady ? mSteadyStartNs : mFirstNs;
+	long long start_bytes = mSteady ? mSteadyStartBytes : mFirstBytes;
+	if (mLastNs <= start_ns)
+		return 0;
+	return (mLastBytes - start_bytes) * 8 / (static_cast<double>(mLastNs - start_ns) / 1000000000);
+}
+
+double ThroughputEstimator::halfWidth() const {
+	size_t n = mRates.size();
+	if (n < 2)
+		return 0;
+	double mean = 0;
+	for (auto &r : mRates)
+		mean += r;
+	mean /= n;
+	double var = 0;
+	for (auto &r : mRates)
+		var += (r - mean) * (r - mean);
+	var /= (n - 1);
+	double t = n - 1 <= 30 ? T_QUANTILES[n - 2] : 1.96;
+	return t * std::sqrt(var / n);
+}
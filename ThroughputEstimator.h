@@ -0,0 +1,38 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_THROUGHPUTESTIMATOR_H
+#define SPEEDTEST_THROUGHPUTESTIMATOR_H
+#include <vector>
+#include "DataTypes.h"
+
+// Throughput estimator built on the aggregate byte count of all connections over
+// wall time. Samples are folded into fixed windows; the windows of the TCP slow-start
+// ramp are excluded, and the test is considered converged once the confidence interval
+// of the steady windows is within the requested relative tolerance.
+class ThroughputEstimator {
+public:
+	ThroughputEstimator(const long window_ms, const int min_windows, const double tolerance);
+	void sample(const long long now_ns, const long long bytes);
+	bool converged() const;
+	ThroughputResult result() const;
+private:
+	double speed() const;
+	double halfWidth() const;
+	long long mWindowNs;
+	int    mMinWindows;
+	double mTolerance;
+	long long mWindowStartNs;
+	long long mWindowStartBytes;
+	long long mFirstNs;
+	long long mFirstBytes;
+	long long mSteadyStartNs;
+	long long mSteadyStartBytes;
+	long long mLastNs;
+	long long mLastBytes;
+	bool   mSteady;
+	double mPreviousRate;
+	std::vector<double> mRates;
+};
+#endif // SPEEDTEST_THROUGHPUTESTIMATOR_H
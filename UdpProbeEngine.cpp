@@ -0,0 +1,322 @@
+//
+// Created on 10/16/26.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "UdpProbeEngine.h"
+#include "SpeedTestClient.h"
+#include "MonotonicClock.h"
+#include "SpeedTestConfig.h"
+
+static const uint32_t HELLO_SEQUENCE = 0xFFFFFFFF;
+
+UdpProbeEngine::UdpProbeEngine(const ServerInfo &server, const UdpProbeConfig &config):
+	mServerInfo(server),
+	mConfig(config),
+	mSocketOptions(),
+	mStop(nullptr),
+	mFd(-1),
+	mTotal(0),
+	mSent(0),
+	mSending(false),
+	mHighest(-1),
+	mLastTransit(0),
+	mJitter(0),
+	mRttSum(0) {
+	mResult = UdpProbeResult();
+	mConfig.packet_size = std::max(mConfig.packet_size, static_cast<int>(HEADER_SIZE));
+	mConfig.batch = std::max(mConfig.batch, 1);
+}
+
+UdpProbeEngine::~UdpProbeEngine() {
+	if (mFd >= 0)
+		::close(mFd);
+}
+
+bool UdpProbeEngine::supported() {
+#if defined(__linux__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+void UdpProbeEngine::setSocketOptions(const SocketOptions &options) {
+	mSocketOptions = options;
+}
+
+// The train winds down, and run() returns what it has so far, once *stop is raised
+void UdpProbeEngine::setStop(const std::atomic<bool> *stop) {
+	mStop = stop;
+}
+
+// It returns false when the server does not reflect probes at all; loss is only measured
+// once the reflector answered a hello probe
+bool UdpProbeEngine::run(UdpProbeResult &result, std::function<void(bool)> cb) {
+	result = UdpProbeResult();
+	if (!supported() || !open() || !hello())
+		return false;
+
+	mTotal = std::max(1L, mConfig.rate_pps * mConfig.duration_ms / 1000);
+	mSeen.assign(static_cast<size_t>(mTotal), false);
+	mSending = true;
+	std::thread sender(&UdpProbeEngine::send, this);
+	receive(cb);
+	sender.join();
+
+	mResult.sent = mSent;
+	mResult.lost = std::max(0L, mResult.sent - mResult.received - mResult.client_dropped);
+	mResult.loss = mResult.sent > 0 ? static_cast<double>(mResult.lost) / mResult.sent : 0;
+	mResult.jitter = static_cast<long long>(mJitter);
+	mResult.rtt_avg = mResult.received > 0 ? mRttSum / mResult.received : 0;
+	result = mResult;
+	return mResult.sent > 0;
+}
+
+#if defined(__linux__)
+bool UdpProbeEngine::open() {
+	ResolverCache::Address addr;
+	if (!SpeedTestClient(mServerInfo, mSocketOptions).resolve(addr))
+		return false;
+	mFd = socket(addr.addr.ss_family, SOCK_DGRAM, 0);
+	if (mFd < 0)
+		return false;
+	if (!SpeedTestClient::applySocketOptions(mFd, mSocketOptions))
+		return false;
+
+	// A receive buffer deep enough for a full drain interval keeps the client from dropping
+	// probes itself; SO_RCVBUFFORCE goes past net.core.rmem_max when allowed to
+	int size = SPEED_TEST_UDP_SOCKET_BUFFER;
+	if (setsockopt(mFd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(mFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(mFd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	int on = 1;
+	setsockopt(mFd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	setsockopt(mFd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+
+	if (::connect(mFd, (struct sockaddr *)&addr.addr, addr.len) < 0) {
+		std::cerr << "UdpProbeEngine::open: Unable to reach " << mServerInfo.host << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool UdpProbeEngine::hello() {
+	std::vector<char> packet(static_cast<size_t>(mConfig.packet_size), 0);
+	uint32_t magic = htonl(MAGIC);
+	uint32_t sequence = HELLO_SEQUENCE;
+	memcpy(packet.data(), &magic, sizeof(magic));
+	memcpy(packet.data() + 4, &sequence, sizeof(sequence));
+	for (int attempt = 0; attempt < 3 && !stopped(); attempt++) {
+		if (::send(mFd, packet.data(), packet.size(), 0) < 0 && errno != ECONNREFUSED)
+			return false;
+		struct pollfd pfd = {mFd, POLLIN, 0};
+		const long long deadline = MonotonicClock::now() + 500000000LL;
+		long long now = MonotonicClock::now();
+		while (now < deadline && poll(&pfd, 1, static_cast<int>((deadline - now) / 1000000) + 1) > 0) {
+			char reply[64];
+			ssize_t n = recv(mFd, reply, sizeof(reply), MSG_DONTWAIT | MSG_TRUNC);
+			if (n >= static_cast<ssize_t>(HEADER_SIZE) && memcmp(reply, &magic, sizeof(magic)) == 0 && memcmp(reply + 4, &sequence, sizeof(sequence)) == 0)
+				return true;
+			now = MonotonicClock::now();
+		}
+	}
+	std::cerr << "UdpProbeEngine::hello: No UDP reflector on " << mServerInfo.host << std::endl;
+	return false;
+}
+
+// Probes are due every 1/rate seconds from the start of the train. Whatever is due goes
+// out in one sendmmsg call of up to config.batch probes, so a late wake-up catches up
+// in a burst instead of lowering the rate. Sequence numbers only advance once the kernel
+// took the probe, so the sender never shows up as network loss. A sender that cannot keep
+// up stops at the end of the train anyway, with fewer probes sent.
+void UdpProbeEngine::send() {
+	const size_t batch = static_cast<size_t>(mConfig.batch);
+	const size_t size = static_cast<size_t>(mConfig.packet_size);
+	const long long interval_ns = std::max(1LL, 1000000000LL / std::max(1L, mConfig.rate_pps));
+	std::vector<char> buffers(batch * size, 0);
+	std::vector<struct iovec> iovs(batch);
+	std::vector<struct mmsghdr> msgs(batch);
+	const uint32_t magic = htonl(MAGIC);
+	for (size_t i = 0; i < batch; i++) {
+		iovs[i].iov_base = buffers.data() + i * size;
+		iovs[i].iov_len = size;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		memcpy(buffers.data() + i * size, &magic, sizeof(magic));
+	}
+
+	long sequence = 0;
+	const long long start = MonotonicClock::now();
+	const long long limit = (mConfig.duration_ms + SPEED_TEST_STREAM_SAMPLE_MS) * 1000000LL;
+	while (sequence < mTotal && !stopped()) {
+		const long long elapsed = MonotonicClock::now() - start;
+		if (elapsed > limit)
+			break;
+		const long due = static_cast<long>(std::min(static_cast<long long>(mTotal), elapsed / interval_ns + 1));
+		if (due <= sequence) {
+			std::this_thread::sleep_for(std::chrono::nanoseconds(sequence * interval_ns - elapsed));
+			continue;
+		}
+		const size_t count = std::min(static_cast<size_t>(due - sequence), batch);
+		const long long now = wallNow();
+		for (size_t i = 0; i < count; i++) {
+			uint32_t seq = static_cast<uint32_t>(sequence + static_cast<long>(i));
+			memcpy(buffers.data() + i * size + 4, &seq, sizeof(seq));
+			memcpy(buffers.data() + i * size + 8, &now, sizeof(now));
+		}
+		int sent = sendmmsg(mFd, msgs.data(), static_cast<unsigned>(count), 0);
+		if (sent < 0) {
+			if (errno == ECONNREFUSED) {
+				// The reflector went away, the probes are lost as far as the test goes
+				sequence += static_cast<long>(count);
+			} else if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			} else {
+				break;
+			}
+		} else {
+			sequence += sent;
+		}
+		mSent = sequence;
+	}
+	mSending = false;
+}
+
+// It reads probes back until config.drain_ms after the last one went out, or until every
+// probe sent came back
+void UdpProbeEngine::receive(std::function<void(bool)> cb) {
+	const size_t batch = static_cast<size_t>(mConfig.batch);
+	const size_t size = static_cast<size_t>(mConfig.packet_size);
+	const size_t control = CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t));
+	std::vector<char> buffers(batch * size);
+	std::vector<char> controls(batch * control);
+	std::vector<struct iovec> iovs(batch);
+	std::vector<struct mmsghdr> msgs(batch);
+	const uint32_t magic = htonl(MAGIC);
+
+	long long drain_deadline = 0;
+	long long next_tick = MonotonicClock::now() + SPEED_TEST_STREAM_SAMPLE_MS * 1000000LL;
+	while (!stopped()) {
+		long long now = MonotonicClock::now();
+		if (!mSending) {
+			if (drain_deadline == 0)
+				drain_deadline = now + mConfig.drain_ms * 1000000LL;
+			if (now >= drain_deadline || mResult.received + mResult.client_dropped >= mSent)
+				break;
+		}
+		if (cb && now >= next_tick) {
+			cb(true);
+			next_tick = now + SPEED_TEST_STREAM_SAMPLE_MS * 1000000LL;
+		}
+
+		struct pollfd pfd = {mFd, POLLIN, 0};
+		if (poll(&pfd, 1, 10) <= 0)
+			continue;
+		for (size_t i = 0; i < batch; i++) {
+			iovs[i].iov_base = buffers.data() + i * size;
+			iovs[i].iov_len = size;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = controls.data() + i * control;
+			msgs[i].msg_hdr.msg_controllen = control;
+		}
+		int n = recvmmsg(mFd, msgs.data(), static_cast<unsigned>(batch), MSG_DONTWAIT, nullptr);
+		if (n <= 0)
+			continue;
+		const long long fallback = wallNow();
+		for (int i = 0; i < n; i++) {
+			const char *packet = buffers.data() + static_cast<size_t>(i) * size;
+			if (msgs[i].msg_len < HEADER_SIZE || memcmp(packet, &magic, sizeof(magic)) != 0)
+				continue;
+			long long arrival = fallback;
+			for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+				if (cmsg->cmsg_level != SOL_SOCKET)
+					continue;
+				if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					struct timespec ts;
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					arrival = static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+				} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+					uint32_t dropped;
+					memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+					mResult.client_dropped = std::max(mResult.client_dropped, static_cast<long>(dropped));
+				}
+			}
+			uint32_t sequence;
+			long long sent_ns;
+			memcpy(&sequence, packet + 4, sizeof(sequence));
+			memcpy(&sent_ns, packet + 8, sizeof(sent_ns));
+			account(sequence, sent_ns, arrival);
+		}
+	}
+}
+#else
+bool UdpProbeEngine::open() {
+	return false;
+}
+
+bool UdpProbeEngine::hello() {
+	return false;
+}
+
+void UdpProbeEngine::send() {
+	mSending = false;
+}
+
+void UdpProbeEngine::receive(std::function<void(bool)>) {
+}
+#endif
+
+// Transit time is the round trip as both ends are on the client clock. Jitter is the RFC 3550
+// interarrival jitter over consecutive arrivals: J += (|D(i-1,i)| - J) / 16.
+void UdpProbeEngine::account(uint32_t sequence, long long sent_ns, long long arrival_ns) {
+	if (sequence >= static_cast<uint32_t>(mTotal))
+		return;
+	if (mSeen[sequence]) {
+		mResult.duplicated++;
+		return;
+	}
+	mSeen[sequence] = true;
+	if (static_cast<long>(sequence) < mHighest)
+		mResult.reordered++;
+	else
+		mHighest = sequence;
+
+	const long long transit = arrival_ns - sent_ns;
+	if (mResult.received > 0) {
+		const long long d = transit > mLastTransit ? transit - mLastTransit : mLastTransit - transit;
+		mJitter += (d - mJitter) / 16;
+		mResult.rtt_min = std::min(mResult.rtt_min, transit);
+		mResult.rtt_max = std::max(mResult.rtt_max, transit);
+	} else {
+		mResult.rtt_min = transit;
+		mResult.rtt_max = transit;
+	}
+	mLastTransit = transit;
+	mRttSum += transit;
+	mResult.received++;
+}
+
+bool UdpProbeEngine::stopped() {
+	return mStop != nullptr && mStop->load();
+}
+
+// Kernel receive timestamps are on CLOCK_REALTIME, so send times are too. Only differences
+// between the two are used, over a train of a few seconds.
+long long UdpProbeEngine::wallNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return static_cast<long long>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
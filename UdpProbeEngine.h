@@ -0,0 +1,55 @@
+//
+// Created on 10/16/26.
+//
+
+#ifndef SPEEDTEST_UDPPROBEENGINE_H
+#define SPEEDTEST_UDPPROBEENGINE_H
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "DataTypes.h"
+
+// Packet loss and jitter over UDP. A train of sequence-numbered, timestamped probes is sent
+// at a fixed rate to a reflector listening on the server's UDP port, which echoes them back.
+// Probes go out and come in with sendmmsg/recvmmsg batches, arrival times are kernel receive
+// timestamps, and packets the client socket dropped itself are counted apart from the loss.
+//
+// Probe layout, padded to the configured packet size: magic (network order), sequence
+// number and send time in nanoseconds. Only the magic is read by the reflector.
+class UdpProbeEngine {
+public:
+	static const uint32_t MAGIC = 0x53545550;
+	static const size_t HEADER_SIZE = 16;
+
+	UdpProbeEngine(const ServerInfo &server, const UdpProbeConfig &config);
+	~UdpProbeEngine();
+	static bool supported();
+	void setSocketOptions(const SocketOptions &options);
+	void setStop(const std::atomic<bool> *stop);
+	bool run(UdpProbeResult &result, std::function<void(bool)> cb = nullptr);
+private:
+	bool open();
+	bool hello();
+	void send();
+	void receive(std::function<void(bool)> cb);
+	void account(uint32_t sequence, long long sent_ns, long long arrival_ns);
+	bool stopped();
+	static long long wallNow();
+
+	ServerInfo mServerInfo;
+	UdpProbeConfig mConfig;
+	SocketOptions mSocketOptions;
+	const std::atomic<bool> *mStop;
+	int  mFd;
+	long mTotal;
+	std::atomic<long> mSent;
+	std::atomic<bool> mSending;
+	std::vector<bool> mSeen;
+	long mHighest;
+	long long mLastTransit;
+	double mJitter;
+	long long mRttSum;
+	UdpProbeResult mResult;
+};
+#endif // SPEEDTEST_UDPPROBEENGINE_H
@@ -1,11 +1,20 @@
 #include <iostream>
 #include <map>
 #include <iomanip>
-#include "SpeedTest.h"
+#include <sstream>
+#include "SpeedTestRunner.h"
+#include "SpeedTestDaemon.h"
 #include "TestConfigTemplate.h"
 #include "CmdOptions.h"
+#include "MonotonicClock.h"
 #include <csignal>
 
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+	stopRequested = 1;
+}
+
 void banner() {
 	std::cout << "SpeedTest++ version " << SpeedTest_VERSION_MAJOR << "." << SpeedTest_VERSION_MINOR << std::endl;
 	std::cout << "Speedtest.net command line interface" << std::endl;
@@ -16,16 +25,235 @@ void banner() {
 void usage(const char* name) {
 	std::cerr << "Usage: " << name << " ";
 	std::cerr << "  [--latency] [--download] [--upload] [--share] [--help]\n"
-	             "       [--serverid id] [--test-server host:port] [--output verbose|text]\n";
+	             "       [--serverid id] [--test-server host:port] [--output verbose|text]\n"
+	             "       [--engine threads|epoll|uring] [--mode chunked|streaming] [--preflight]\n"
+	             "       [--tolerance ratio] [--cache-ttl seconds] [--packet-loss] [--udp-rate pps]\n"
+	             "       [--loaded-latency]\n"
+	             "       [--multi-server k] [--source address[,address...]] [--interface name[,name...]]\n"
+	             "       [--mark n] [--pin-cpus] [--daemon] [--interval seconds]\n"
+	             "       [--interval-jitter ratio] [--metrics address:port]\n";
 	std::cerr << "optional arguments:" << std::endl;
 	std::cerr << "  --help                   Show this message and exit\n";
 	std::cerr << "  --latency                Perform latency test only\n";
 	std::cerr << "  --download               Perform download test only. It includes latency test\n";
 	std::cerr << "  --upload                 Perform upload test only. It includes latency test\n";
 	std::cerr << "  --share                  Generate and provide a URL to the speedtest.net share results image\n";
+	std::cerr << "  --packet-loss            Measure packet loss and jitter with UDP probes. It needs\n"
+	             "                           a UDP reflector on the server port\n";
+	std::cerr << "  --udp-rate pps           UDP probes sent per second. Default: " << udpProbeConfig.rate_pps << "\n";
+	std::cerr << "  --loaded-latency         Measure latency during the download and upload tests on a\n"
+	             "                           dedicated connection (bufferbloat)\n";
 	std::cerr << "  --test-server host:port  Run speed test against a specific server\n";
 	std::cerr << "  --serverid id            Run speed test against a specific ServerId\n";
 	std::cerr << "  --output verbose|text    Set output type. Default: verbose\n";
+	std::cerr << "  --engine threads|epoll|uring\n"
+	             "                           Set transfer engine. uring falls back to threads\n"
+	             "                           when io_uring is unavailable. Default: threads\n";
+	std::cerr << "  --mode chunked|streaming Set transfer mode. streaming keeps every connection\n"
+	             "                           busy for the whole test duration, with the threads\n"
+	             "                           engine only. Default: chunked\n";
+	std::cerr << "  --preflight              Select a static test profile from a preflight download\n"
+	             "                           instead of the adaptive concurrency controller\n";
+	std::cerr << "  --tolerance ratio        End a transfer test once its 95% confidence interval is\n"
+	             "                           within ratio of the estimate, 0 disables. Default: " << SPEED_TEST_CONVERGENCE_TOLERANCE << "\n";
+	std::cerr << "  --cache-ttl seconds      Reuse the cached server list for this long, 0 disables\n"
+	             "                           the cache. Default: " << SPEED_TEST_SERVER_CACHE_TTL << "\n";
+	std::cerr << "  --multi-server k         Spread download and upload streams across the k best servers\n"
+	             "                           of the discovery and report the aggregate. Default: 1\n";
+	std::cerr << "  --source address[,address...]\n"
+	             "                           Bind connections to this source address. With several\n"
+	             "                           addresses every uplink is tested at the same time\n";
+	std::cerr << "  --interface name[,name...]\n"
+	             "                           Bind connections to this network interface. With several\n"
+	             "                           interfaces every uplink is tested at the same time\n";
+	std::cerr << "  --mark n                 Set the routing mark of every connection (SO_MARK)\n";
+	std::cerr << "  --pin-cpus               Pin transfer workers to cores, those that service the\n"
+	             "                           network interface IRQs first\n";
+	std::cerr << "  --daemon                 Keep running, repeat the test every interval and export\n"
+	             "                           the results on the metrics endpoint\n";
+	std::cerr << "  --interval seconds       Time between two tests in daemon mode. Default: " << SPEED_TEST_DAEMON_INTERVAL << "\n";
+	std::cerr << "  --interval-jitter ratio  Spread every interval randomly by up to ratio of it. Default: " << SPEED_TEST_DAEMON_INTERVAL_JITTER << "\n";
+	std::cerr << "  --metrics address:port   Prometheus metrics endpoint in daemon mode. Default: 127.0.0.1:" << SPEED_TEST_METRICS_PORT << "\n";
+}
+
+// Progress and results of one runner, printed as they come. Without dots the per-sample
+// progress marks are left out, for runners whose output is buffered.
+static SpeedTestRunner::ProgressCallback reportPrinter(SpeedTestRunner &runner, const RunnerOptions &options, bool verbose, bool dots, std::ostream &out, std::ostream &err) {
+	const bool autoSelect = options.selected_server.empty() && options.selected_serverid == -1;
+	return [&runner, options, verbose, dots, autoSelect, &out, &err](SpeedTestRunner::Phase phase, SpeedTestRunner::Event event, bool success) {
+		if (event == SpeedTestRunner::step) {
+			if (verbose && dots)
+				out << (success ? '.' : '*') << std::flush;
+			return;
+		}
+		const SpeedTestReport report = runner.result();
+		switch (phase) {
+			case SpeedTestRunner::ip_info:
+				if (event != SpeedTestRunner::end)
+					break;
+				if (verbose) {
+					out << "IP: " << report.ip_info.ip_address << " (" << report.ip_info.isp << ") " << "Location: [" << report.ip_info.lat << ", " << report.ip_info.lon << "]" << std::flush;
+				} else {
+					out << report.ip_info.ip_address << ",";
+					out << report.ip_info.lat << ",";
+					out << report.ip_info.lon << ",";
+					out << report.ip_info.isp << ",";
+				}
+				break;
+			case SpeedTestRunner::server_selection:
+				if (event == SpeedTestRunner::begin) {
+					if (verbose && autoSelect) {
+						out << std::endl;
+						out << "Finding fastest server (" << report.server_count << " servers online) " << std::flush;
+					}
+					break;
+				}
+				if (verbose) {
+					out << std::endl;
+					out << "Server: " << report.server.name << " " << report.server.host << " by " << report.server.sponsor << " (" << report.server.distance << " km from you): " << std::fixed << std::setprecision(3) << MonotonicClock::toMillis(report.latency) << " ms" << std::flush;
+					out << std::endl;
+					out << "Ping: " << std::fixed << std::setprecision(3) << MonotonicClock::toMillis(report.latency) << " ms." << std::flush;
+				} else {
+					out << report.server.id << ",";
+					out << report.server.sponsor << ",";
+					out << report.server.distance << ",";
+					out << std::fixed << std::setprecision(3) << MonotonicClock::toMillis(report.latency) << ",";
+				}
+				break;
+			case SpeedTestRunner::jitter:
+				if (event == SpeedTestRunner::begin) {
+					if (verbose) {
+						out << std::endl;
+						out << "Jitter: " << std::flush;
+					}
+				} else if (verbose) {
+					out << MonotonicClock::toMillis(report.jitter) << " ms." << std::flush;
+					const LatencyStats &stats = report.latency_stats;
+					if (stats.count > 0) {
+						out << std::endl << "Latency: " << std::setprecision(3) << MonotonicClock::toMillis(stats.p50) << " ms median, ";
+						out << MonotonicClock::toMillis(stats.p90) << " ms p90, " << MonotonicClock::toMillis(stats.p99) << " ms p99, ";
+						out << MonotonicClock::toMillis(stats.p999) << " ms p99.9, " << MonotonicClock::toMillis(stats.max) << " ms max, ";
+						out << "stddev " << stats.stddev / 1000000 << " ms (" << stats.count << " samples)." << std::flush;
+					}
+				} else {
+					out << MonotonicClock::toMillis(report.jitter) << ",";
+				}
+				break;
+			case SpeedTestRunner::packet_loss: {
+				if (event == SpeedTestRunner::begin) {
+					if (verbose) {
+						out << std::endl;
+						out << "Testing packet loss (" << options.udp_rate << " pps) " << std::flush;
+					}
+					break;
+				}
+				const UdpProbeResult &loss = report.packet_loss;
+				if (verbose) {
+					out << std::endl;
+					if (!success) {
+						out << "Packet loss: unavailable, no UDP reflector on the server" << std::flush;
+						break;
+					}
+					out << "Packet loss: " << std::fixed << std::setprecision(2) << loss.loss * 100 << "% (" << loss.lost << " of " << loss.sent << " lost, ";
+					out << loss.reordered << " reordered, " << loss.duplicated << " duplicated";
+					if (loss.client_dropped > 0)
+						out << ", " << loss.client_dropped << " dropped by this host";
+					out << "), UDP jitter: " << std::setprecision(3) << MonotonicClock::toMillis(loss.jitter) << " ms." << std::flush;
+				} else {
+					out << std::fixed << std::setprecision(4) << loss.loss << ",";
+					out << std::setprecision(3) << MonotonicClock::toMillis(loss.jitter) << ",";
+				}
+				break;
+			}
+			case SpeedTestRunner::preflight:
+				if (!verbose)
+					break;
+				out << std::endl;
+				if (event == SpeedTestRunner::begin)
+					out << "Determine line type (" << preflightConfigDownload.concurrency << ") " << std::flush;
+				else
+					out << report.download_config.label << std::flush;
+				break;
+			case SpeedTestRunner::download:
+			case SpeedTestRunner::upload: {
+				const bool isDownload = phase == SpeedTestRunner::download;
+				const TestConfig &config = isDownload ? report.download_config : report.upload_config;
+				const ThroughputResult &result = isDownload ? report.download : report.upload;
+				const std::vector<ServerThroughput> &servers = isDownload ? report.download_servers : report.upload_servers;
+				if (event == SpeedTestRunner::begin) {
+					if (verbose) {
+						out << std::endl;
+						if (options.preflight)
+							out << "Testing " << (isDownload ? "download" : "upload") << " speed (" << config.concurrency << ") " << std::flush;
+						else
+							out << "Testing " << (isDownload ? "download" : "upload") << " speed (adaptive) " << std::flush;
+					}
+					break;
+				}
+				if (!success)
+					break;
+				if (verbose) {
+					out << std::endl;
+					if (!options.preflight)
+						out << config.label << std::endl;
+					out << (isDownload ? "Download: " : "Upload: ");
+					out << std::fixed;
+					out << std::setprecision(2);
+					out << result.speed << " Mbit/s";
+					if (result.bounded)
+						out << " (95% CI " << result.lower << " - " << result.upper << ")" << std::flush;
+					else
+						out << " (95% CI unavailable)" << std::flush;
+					if (result.cpu_bound)
+						out << std::endl << "  Client CPU saturated (busiest worker " << std::setprecision(0) << result.cpu_peak * 100 << "%, process " << result.cpu_load * 100 << "% of all cores): the link may be faster" << std::setprecision(2) << std::flush;
+					for (auto &server : servers)
+						out << std::endl << "  " << server.server.sponsor << " " << server.server.host << ": " << server.speed << " Mbit/s (" << server.streams << " streams)" << std::flush;
+					if (options.loaded_latency) {
+						const LoadedLatency &loaded = result.loaded;
+						out << std::endl << "  Latency under load: ";
+						if (loaded.samples == 0) {
+							out << "unavailable" << std::flush;
+						} else {
+							out << std::setprecision(3) << MonotonicClock::toMillis(loaded.p50) << " ms median, " << MonotonicClock::toMillis(loaded.p90) << " ms p90, ";
+							out << MonotonicClock::toMillis(loaded.p99) << " ms p99 (+" << MonotonicClock::toMillis(loaded.increase) << " ms over idle, ";
+							out << loaded.samples << " samples";
+							if (loaded.timeouts > 0)
+								out << ", " << loaded.timeouts << " timeouts";
+							out << ")" << std::setprecision(2) << std::flush;
+						}
+					}
+				} else {
+					out << std::fixed;
+					out << std::setprecision(2);
+					out << result.speed << ",";
+					if (options.loaded_latency) {
+						out << std::setprecision(3) << MonotonicClock::toMillis(result.loaded.p50) << ",";
+						out << MonotonicClock::toMillis(result.loaded.p99) << ",";
+					}
+				}
+				break;
+			}
+			case SpeedTestRunner::share:
+				if (event != SpeedTestRunner::end || !success)
+					break;
+				if (verbose) {
+					out << std::endl;
+					out << "Results image: " << report.share_url << std::flush;
+				} else {
+					out << report.share_url << std::flush;
+				}
+				break;
+			case SpeedTestRunner::failed:
+				err << report.error << std::endl;
+				break;
+			case SpeedTestRunner::done:
+				if (event == SpeedTestRunner::end)
+					out << std::endl;
+				break;
+			default:
+				break;
+		}
+	};
 }
 
 int main(const int argc, const char **argv) {
@@ -46,174 +274,93 @@ int main(const int argc, const char **argv) {
 	}
 
 	signal(SIGPIPE, SIG_IGN);
-	auto sp = SpeedTest(SPEED_TEST_MIN_SERVER_VERSION);
-
-	IPInfo info;
-	if (!sp.ipInfo(info)) {
-		std::cerr << "Unable to retrieve your IP info. Try again later" << std::endl;
-		return EXIT_FAILURE;
-	}
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << "IP: " << info.ip_address << " (" << info.isp << ") " << "Location: [" << info.lat << ", " << info.lon << "]" << std::flush;
-	} else {
-		std::cout << info.ip_address << ",";
-		std::cout << info.lat << ",";
-		std::cout << info.lon << ",";
-		std::cout << info.isp << ",";
-	}
-
-	ServerInfo serverInfo;
-	auto serverList = sp.serverList();
-	if (serverList.empty()) {
-		std::cerr << "Unable to download server list. Try again later" << std::endl;
-		return EXIT_FAILURE;
-	}
-	if (programOptions.selected_server.empty() && programOptions.selected_serverid == -1) {
-		if (programOptions.output_type == OutputType::verbose) {
-			std::cout << std::endl;
-			std::cout << "Finding fastest server (" << serverList.size() << " servers online) " << std::flush;
-		}
-		serverInfo = sp.bestServer(10, [&programOptions](bool success) {
-			if (programOptions.output_type == OutputType::verbose)
-				std::cout << (success ? '.' : '*') << std::flush;
-		});
-	} else {
-		serverInfo.host.append(programOptions.selected_server);
-		for (auto &s : serverList) {
-			if ( (programOptions.selected_serverid != -1 && s.id == programOptions.selected_serverid) || s.host == serverInfo.host ) {
-				serverInfo = s;
-				break;
-			}
-		}
-		sp.setServer(serverInfo);
-	}
-	if (serverInfo.host.empty()) {
-		std::cerr << "Host name is empty." << std::endl;
-		return EXIT_FAILURE;
-	}
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << "Server: " << serverInfo.name << " " << serverInfo.host << " by " << serverInfo.sponsor << " (" << serverInfo.distance << " km from you): " << sp.latency() << " ms" << std::flush;
-	} else {
-		std::cout << serverInfo.id << ",";
-		std::cout << serverInfo.sponsor << ",";
-		std::cout << serverInfo.distance << ",";
-	}
+	RunnerOptions options = SpeedTestRunner::defaultOptions();
+	options.latency           = programOptions.latency;
+	options.download          = programOptions.download;
+	options.upload            = programOptions.upload;
+	options.share             = programOptions.share;
+	options.preflight         = programOptions.preflight;
+	options.selected_server   = programOptions.selected_server;
+	options.selected_serverid = programOptions.selected_serverid;
+	options.multi_server      = programOptions.multi_server;
+	options.pin_cpus          = programOptions.pin_cpus;
+	options.packet_loss       = programOptions.packet_loss;
+	options.loaded_latency    = programOptions.loaded_latency;
+	if (programOptions.udp_rate > 0)
+		options.udp_rate      = programOptions.udp_rate;
+	options.engine            = programOptions.engine;
+	options.mode              = programOptions.mode;
+	options.tolerance         = programOptions.tolerance;
+	options.cache_ttl         = programOptions.cache_ttl;
 
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << "Ping: " << sp.latency() << " ms." << std::flush;
-	} else {
-		std::cout << sp.latency() << ",";
-	}
-	long jitter = 0;
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << "Jitter: " << std::flush;
-	}
-	if (sp.jitter(serverInfo, jitter)) {
-		if (programOptions.output_type == OutputType::verbose)
-			std::cout << jitter << " ms." << std::flush;
-		else
-			std::cout << jitter << ",";
-	} else {
-		std::cerr << "Jitter measurement is unavailable at this time." << std::endl;
-		return EXIT_FAILURE;
-	}
-	if (programOptions.latency) {
-		std::cout << std::endl;
-		return EXIT_SUCCESS;
+	// Every source address or device is an uplink; a single value applies to all of them
+	std::vector<SocketOptions> uplinks(std::max(std::max(programOptions.sources.size(), programOptions.devices.size()), static_cast<size_t>(1)));
+	for (size_t i = 0; i < uplinks.size(); i++) {
+		uplinks[i] = SocketOptions();
+		if (!programOptions.sources.empty())
+			uplinks[i].source_address = programOptions.sources[programOptions.sources.size() == 1 ? 0 : i];
+		if (!programOptions.devices.empty())
+			uplinks[i].device = programOptions.devices[programOptions.devices.size() == 1 ? 0 : i];
+		uplinks[i].mark = programOptions.mark;
 	}
 
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << "Determine line type (" << preflightConfigDownload.concurrency << ") " << std::flush;
-	}
-	double preSpeed = 0;
-	if (!sp.downloadSpeed(serverInfo, preflightConfigDownload, preSpeed, [&programOptions](bool success) {
-		if (programOptions.output_type == OutputType::verbose)
-			std::cout << (success ? '.' : '*') << std::flush;
-	})) {
-		std::cerr << "Pre-flight check failed." << std::endl;
-		return EXIT_FAILURE;
-	}
-
-	TestConfig uploadConfig;
-	TestConfig downloadConfig;
-	testConfigSelector(preSpeed, uploadConfig, downloadConfig);
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << downloadConfig.label << std::flush;
-	}
-
-	if (!programOptions.upload) {
-		if (programOptions.output_type == OutputType::verbose) {
-			std::cout << std::endl;
-			std::cout << "Testing download speed (" << downloadConfig.concurrency << ") " << std::flush;
-		}
-		double downloadSpeed = 0;
-		if (sp.downloadSpeed(serverInfo, downloadConfig, downloadSpeed, [&programOptions](bool success) {
-			if (programOptions.output_type == OutputType::verbose)
-				std::cout << (success ? '.' : '*') << std::flush;
-		})) {
-			if (programOptions.output_type == OutputType::verbose) {
-				std::cout << std::endl;
-				std::cout << "Download: ";
-				std::cout << std::fixed;
-				std::cout << std::setprecision(2);
-				std::cout << downloadSpeed << " Mbit/s" << std::flush;
-			} else {
-				std::cout << std::fixed;
-				std::cout << std::setprecision(2);
-				std::cout << downloadSpeed << ",";
-			}
-		} else {
-			std::cerr << "Download test failed." << std::endl;
+	if (programOptions.daemon) {
+		DaemonConfig config;
+		config.runner = options;
+		config.runner.socket = uplinks[0];
+		config.interval_s = programOptions.interval;
+		config.interval_jitter = programOptions.interval_jitter;
+		config.metrics_address = programOptions.metrics_address;
+		config.metrics_port = programOptions.metrics_port;
+		SpeedTestDaemon daemon(config);
+		if (!daemon.start())
 			return EXIT_FAILURE;
-		}
-	}
-	if (programOptions.download) {
-		std::cout << std::endl;
+		if (programOptions.output_type == OutputType::verbose)
+			std::cout << "Metrics: http://" << config.metrics_address << ":" << daemon.metricsPort() << "/metrics" << std::endl;
+		signal(SIGINT, onSignal);
+		signal(SIGTERM, onSignal);
+		while (!stopRequested)
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		daemon.stop();
+		daemon.wait();
 		return EXIT_SUCCESS;
 	}
 
-	if (programOptions.output_type == OutputType::verbose) {
-		std::cout << std::endl;
-		std::cout << "Testing upload speed (" << uploadConfig.concurrency << ") " << std::flush;
-	}
-	double uploadSpeed = 0;
-	if (sp.uploadSpeed(serverInfo, uploadConfig, uploadSpeed, [&programOptions](bool success) {
-		if (programOptions.output_type == OutputType::verbose)
-			std::cout << (success ? '.' : '*') << std::flush;
-	})) {
-		if (programOptions.output_type == OutputType::verbose) {
-			std::cout << std::endl;
-			std::cout << "Upload: ";
-			std::cout << std::fixed;
-			std::cout << std::setprecision(2);
-			std::cout << uploadSpeed << " Mbit/s" << std::flush;
-		} else {
-			std::cout << std::fixed;
-			std::cout << std::setprecision(2);
-			std::cout << uploadSpeed << ",";
+	const bool verbose = programOptions.output_type == OutputType::verbose;
+	if (uplinks.size() > 1) {
+		// One runner, and so one SpeedTest and connection pool, per uplink, all at once
+		std::vector<std::unique_ptr<SpeedTestRunner>> runners;
+		std::vector<std::unique_ptr<std::ostringstream>> outs;
+		std::vector<std::unique_ptr<std::ostringstream>> errs;
+		for (auto &uplink : uplinks) {
+			RunnerOptions uplinkOptions = options;
+			uplinkOptions.socket = uplink;
+			runners.push_back(std::unique_ptr<SpeedTestRunner>(new SpeedTestRunner(uplinkOptions)));
+			outs.push_back(std::unique_ptr<std::ostringstream>(new std::ostringstream()));
+			errs.push_back(std::unique_ptr<std::ostringstream>(new std::ostringstream()));
+			runners.back()->subscribe(reportPrinter(*runners.back(), uplinkOptions, verbose, false, *outs.back(), *errs.back()));
 		}
-	} else {
-		std::cerr << "Upload test failed." << std::endl;
-		return EXIT_FAILURE;
-	}
-
-	if (programOptions.share) {
-		std::string share_it;
-		if (sp.share(serverInfo, share_it)) {
-			if (programOptions.output_type == OutputType::verbose) {
-				std::cout << std::endl;
-				std::cout << "Results image: " << share_it << std::flush;
-			} else {
-				std::cout << share_it << std::flush;
-			}
+		for (auto &runner : runners)
+			runner->start();
+		bool success = true;
+		for (size_t i = 0; i < runners.size(); i++) {
+			runners[i]->wait();
+			const std::string name = uplinks[i].device.empty() ? uplinks[i].source_address : uplinks[i].device;
+			if (verbose)
+				std::cout << "Uplink " << name << std::endl << outs[i]->str() << std::endl;
+			else
+				std::cout << name << "," << outs[i]->str();
+			if (!errs[i]->str().empty())
+				std::cerr << name << ": " << errs[i]->str();
+			success = success && runners[i]->poll() == SpeedTestRunner::done;
 		}
+		return success ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	std::cout << std::endl;
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	options.socket = uplinks[0];
+	SpeedTestRunner runner(options);
+	runner.subscribe(reportPrinter(runner, options, verbose, true, std::cout, std::cerr));
+	runner.start();
+	runner.wait();
+	return runner.poll() == SpeedTestRunner::done ? EXIT_SUCCESS : EXIT_FAILURE;
+}